@@ -0,0 +1,110 @@
+/*
+ * Example reader of the mesh exported by ROAM --export <name>.
+ *
+ * Maps the shared memory and prints a summary of every new frame: triangle
+ * count, height range and surface area in heightmap grid units. The vertices
+ * are read in place, nothing is copied.
+ *
+ *   ./ROAM map.txt --export /roam_mesh &
+ *   ./roam-mesh-consumer /roam_mesh
+ */
+#include "mesh_export.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static void wait_a_moment(void)
+{
+	struct timespec ts = { 0, 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s <name> [frames]\n", name);
+	printf("\n");
+	printf("Reads frames exported by ROAM --export <name> until the writer exits\n");
+	printf("or the given number of frames have been read.\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	unsigned long maxFrames = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+
+	MeshExport *exp = MeshExport_open(argv[1]);
+	if (exp == NULL) {
+		return -1;
+	}
+
+	const MeshExportHeader *header = MeshExport_header(exp);
+	printf("%s: %u x %u heightmap, %u slots of %u triangles\n", argv[1],
+	       header->width, header->height, header->slot_count, header->max_triangles);
+
+	uint64_t lastGeneration = 0;
+	unsigned long frames = 0, skipped = 0, torn = 0;
+
+	while (maxFrames == 0 || frames < maxFrames) {
+		uint64_t generation = MeshExport_generation(exp);
+		if (generation == lastGeneration) {
+			if (MeshExport_closed(exp))
+				break;
+			wait_a_moment();
+			continue;
+		}
+
+		MeshExportFrame frame;
+		if (MeshExport_acquire(exp, &frame) != 0) {
+			continue;
+		}
+
+		float minHeight = INFINITY, maxHeight = -INFINITY;
+		double area = 0;
+
+		size_t i;
+		for (i = 0; i < frame.triangles; ++i) {
+			const float *v = frame.vertices + i*9;
+
+			// patch space to grid units of the frame, area of the triangle
+			// projected to the ground plane.
+			float ax = (v[3] - v[0])*frame.width,  ay = (v[4] - v[1])*frame.height;
+			float bx = (v[6] - v[0])*frame.width,  by = (v[7] - v[1])*frame.height;
+			area += fabsf(ax*by - ay*bx)*0.5f;
+
+			int k;
+			for (k = 0; k < 3; ++k) {
+				float h = v[k*3+2];
+				if (h < minHeight) minHeight = h;
+				if (h > maxHeight) maxHeight = h;
+			}
+		}
+
+		// the writer came around to the slot while it was read, try
+		// again with the next frame.
+		if (!MeshExport_validate(exp, &frame)) {
+			torn++;
+			continue;
+		}
+
+		if (lastGeneration != 0 && frame.generation > lastGeneration + 1) {
+			skipped += frame.generation - lastGeneration - 1;
+		}
+		lastGeneration = frame.generation;
+		frames++;
+
+		printf("frame %llu: %zu triangles, heights %.3f..%.3f, area %.0f, view (%.3f, %.3f, %.3f)\n",
+		       (unsigned long long) frame.frame, frame.triangles, minHeight, maxHeight, area,
+		       frame.view[0], frame.view[1], frame.view[2]);
+	}
+
+	printf("read %lu frames, %lu skipped, %lu torn reads retried\n", frames, skipped, torn);
+
+	MeshExport_delete(exp);
+	return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Example remote viewer of the tessellation streamed by ROAM --stream <path>.
+ *
+ * Connects to the Unix socket, rebuilds the mesh of every frame from the
+ * changes and prints how large the messages are compared to sending the
+ * whole mesh.
+ *
+ *   ./ROAM map.txt --stream /tmp/roam.sock &
+ *   ./roam-stream-client /tmp/roam.sock
+ */
+#include "stream_socket.h"
+#include "tessellation_stream.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static void usage(const char *name)
+{
+	printf("Usage: %s <socket> [frames]\n", name);
+	printf("\n");
+	printf("Receives frames streamed by ROAM --stream <socket> until the stream\n");
+	printf("ends or the given number of frames have been received.\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	unsigned long maxFrames = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+
+	int fd = StreamSocket_connect(argv[1]);
+	if (fd < 0) {
+		return -1;
+	}
+
+	TessellationDecoder decoder;
+
+	unsigned char *buffer = NULL;
+	size_t capacity = 0, size = 0;
+	unsigned long frames = 0;
+	size_t totalBytes = 0, totalRawBytes = 0;
+
+	while (maxFrames == 0 || frames < maxFrames) {
+		if (StreamSocket_receive(fd, &buffer, &capacity, &size) != 0) {
+			break;
+		}
+
+		if (decoder.decode(buffer, size) != 0) {
+			printf("Malformed message of %zu bytes\n", size);
+			break;
+		}
+
+		if (buffer[0] != TESSELLATION_STREAM_FRAME) {
+			printf("%zu x %zu heightmap\n", decoder.getWidth(), decoder.getHeight());
+			continue;
+		}
+
+		// what sending getTessellation() output would take.
+		size_t rawBytes = decoder.getVertices().size()*sizeof(float);
+		totalBytes += size;
+		totalRawBytes += rawBytes;
+		frames++;
+
+		printf("frame %llu: %zu triangles, %zu bytes (%.2f%% of %zu)\n",
+		       (unsigned long long) decoder.getFrame(), decoder.getTriangleCount(),
+		       size, 100.0*size/rawBytes, rawBytes);
+	}
+
+	if (totalRawBytes > 0) {
+		printf("received %lu frames, %zu bytes, %.2f%% of the raw mesh\n",
+		       frames, totalBytes, 100.0*totalBytes/totalRawBytes);
+	}
+
+	free(buffer);
+	StreamSocket_close(fd, NULL);
+
+	return 0;
+}
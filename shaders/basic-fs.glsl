@@ -1,15 +1,19 @@
 #version 330
 
-smooth in vec4 theColor;
+smooth in float theHeight;
 smooth in vec2 theNormalTexel;
 
 out vec4 fragColor;
 
 uniform sampler2D normalMap;
 
+// terrain color by height, see create_color_ramp in opengl_render.cpp
+uniform sampler1D colorRamp;
+
 void main()
 {
 	vec3 normal = texture(normalMap, theNormalTexel).xyz;
 	float diffuse = max(0.0, dot(normal, vec3(0, 0, 1)));
-	fragColor = theColor * vec4(diffuse, diffuse, diffuse, 1.0);
+	vec3 color = texture(colorRamp, theHeight).rgb;
+	fragColor = vec4(color * diffuse, 1.0);
 }
@@ -1,18 +1,85 @@
 #version 330
 
+// vertex formats, see RenderMode in opengl_render.cpp
+#define VERTEX_FORMAT_FLOAT 0
+#define VERTEX_FORMAT_GRID  1
+#define VERTEX_FORMAT_PATH  2
+
+// path code layout, see TerrainPatch::getTessellationCodes
+#define PATH_CODE_PATH_BITS 27u
+#define PATH_CODE_PATH_MASK 0x7ffffffu
+
 layout(location = 0)in vec3 position;
-layout(location = 1)in vec3 color;
 layout(location = 2)in vec2 normalTexel;
+layout(location = 3)in uvec2 gridCoord;
 
 uniform mat4 u_proj_matrix;
 uniform mat4 u_model_matrix;
+uniform int u_vertex_format;
+
+// single channel heightmap, used with VERTEX_FORMAT_GRID and _PATH
+uniform sampler2D heightMap;
 
-smooth out vec4 theColor;
+// one path code per triangle, used with VERTEX_FORMAT_PATH
+uniform usamplerBuffer pathCodes;
+
+smooth out float theHeight;
 smooth out vec2 theNormalTexel;
 
+// reconstruct the grid coordinate of this vertex from the path code of
+// the triangle, following the same splits as TerrainPatch.
+ivec2 pathCodeCorner(ivec2 size)
+{
+	uint code = texelFetch(pathCodes, gl_VertexID / 3).r;
+	int steps = int(code >> PATH_CODE_PATH_BITS);
+	uint path = code & PATH_CODE_PATH_MASK;
+
+	ivec2 l, r, a;
+	if (((path >> uint(steps-1)) & 1u) == 0u) {
+		l = ivec2(0, size.y-1);
+		r = ivec2(size.x-1, 0);
+		a = ivec2(0, 0);
+	} else {
+		l = ivec2(size.x-1, 0);
+		r = ivec2(0, size.y-1);
+		a = ivec2(size.x-1, size.y-1);
+	}
+
+	for (int i = steps-2; i >= 0; --i) {
+		ivec2 c = (l + r) / 2;
+		if (((path >> uint(i)) & 1u) == 0u) {
+			// left child
+			ivec2 apex = a;
+			r = l;
+			l = apex;
+			a = c;
+		} else {
+			// right child
+			l = r;
+			r = a;
+			a = c;
+		}
+	}
+
+	int corner = gl_VertexID % 3;
+	return (corner == 0) ? l : (corner == 1) ? r : a;
+}
+
 void main()
 {
-	gl_Position = u_proj_matrix * u_model_matrix * vec4(position, 1.0);
-	theColor = vec4(color, 1.0);
-	theNormalTexel = normalTexel;
+	vec3 pos = position;
+	vec2 texel = normalTexel;
+
+	if (u_vertex_format != VERTEX_FORMAT_FLOAT) {
+		ivec2 size = textureSize(heightMap, 0);
+		ivec2 grid = (u_vertex_format == VERTEX_FORMAT_PATH) ?
+			pathCodeCorner(size) : ivec2(gridCoord);
+		float height = texelFetch(heightMap, grid, 0).r;
+		pos = vec3(vec2(grid) / vec2(size), height);
+		texel = pos.xy;
+	}
+
+	gl_Position = u_proj_matrix * u_model_matrix * vec4(pos, 1.0);
+	theHeight = pos.z;
+	theNormalTexel = texel;
 }
@@ -0,0 +1,106 @@
+#include "cpu_features.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_FEATURES_X86
+#endif
+
+static const char *levelNames[CPU_LEVEL_COUNT] = {
+	"scalar",
+	"sse4.2",
+	"avx2",
+	"avx512"
+};
+
+// -1 until the first query. Kernels query from several threads, threads
+// racing on the first query store the same level.
+static int detectedLevel = -1;
+static int activeLevel = -1;
+
+CpuLevel CpuFeatures_detect(void)
+{
+	int detected = __atomic_load_n(&detectedLevel, __ATOMIC_ACQUIRE);
+	if (detected >= 0)
+		return (CpuLevel) detected;
+
+	CpuLevel level = CPU_LEVEL_SCALAR;
+
+#ifdef CPU_FEATURES_X86
+	// also checks that the OS saves the wider registers.
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		level = CPU_LEVEL_SSE42;
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+			level = CPU_LEVEL_AVX2;
+			if (__builtin_cpu_supports("avx512f")) {
+				level = CPU_LEVEL_AVX512;
+			}
+		}
+	}
+#endif
+
+	__atomic_store_n(&detectedLevel, (int) level, __ATOMIC_RELEASE);
+	return level;
+}
+
+CpuLevel CpuFeatures_level(void)
+{
+	int active = __atomic_load_n(&activeLevel, __ATOMIC_ACQUIRE);
+	if (active >= 0)
+		return (CpuLevel) active;
+
+	CpuLevel level = CpuFeatures_detect();
+
+	const char *env = getenv("ROAM_CPU_LEVEL");
+	CpuLevel forced;
+	if (env && *env) {
+		if (CpuFeatures_parse(env, &forced) != 0) {
+			printf("Unknown ROAM_CPU_LEVEL %s, using %s\n", env, CpuFeatures_name(level));
+		} else if (forced > level) {
+			printf("ROAM_CPU_LEVEL %s is not supported, using %s\n", env, CpuFeatures_name(level));
+		} else {
+			level = forced;
+		}
+	}
+
+	// a forced level set meanwhile wins.
+	int expected = -1;
+	if (!__atomic_compare_exchange_n(&activeLevel, &expected, (int) level, 0,
+	                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return (CpuLevel) expected;
+
+	return level;
+}
+
+int CpuFeatures_force(CpuLevel level)
+{
+	if (level >= CPU_LEVEL_COUNT || level > CpuFeatures_detect())
+		return -1;
+
+	__atomic_store_n(&activeLevel, (int) level, __ATOMIC_RELEASE);
+	return 0;
+}
+
+const char *CpuFeatures_name(CpuLevel level)
+{
+	if (level >= CPU_LEVEL_COUNT)
+		return "unknown";
+
+	return levelNames[level];
+}
+
+int CpuFeatures_parse(const char *name, CpuLevel *level)
+{
+	int i;
+	for (i = 0; i < CPU_LEVEL_COUNT; ++i) {
+		if (strcmp(name, levelNames[i]) == 0) {
+			*level = (CpuLevel) i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,64 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Instruction set levels vectorized kernels are built for, each level
+ * implies the ones below it.
+ */
+typedef enum
+{
+	CPU_LEVEL_SCALAR = 0,
+	CPU_LEVEL_SSE42,
+	CPU_LEVEL_AVX2,
+	CPU_LEVEL_AVX512,
+
+	CPU_LEVEL_COUNT
+} CpuLevel;
+
+/**
+ * Highest level supported by the CPU and the OS.
+ */
+CpuLevel CpuFeatures_detect(void);
+
+/**
+ * Level kernels should use.
+ *
+ * Same as CpuFeatures_detect() unless lowered with the ROAM_CPU_LEVEL
+ * environment variable (e.g. ROAM_CPU_LEVEL=sse4.2) or CpuFeatures_force().
+ */
+CpuLevel CpuFeatures_level(void);
+
+/**
+ * Force kernels to use the given level, e.g. for benchmarking.
+ *
+ * Must be called before any kernel runs, kernels pick their implementation
+ * on first use.
+ *
+ * @param level
+ * @return 0 on success, -1 if the CPU doesn't support the level.
+ */
+int CpuFeatures_force(CpuLevel level);
+
+/**
+ * @return name of the level, e.g. "avx2".
+ */
+const char *CpuFeatures_name(CpuLevel level);
+
+/**
+ * Parse level name as returned by CpuFeatures_name().
+ *
+ * @param name
+ * @param level on success
+ * @return 0 on success, -1 on unknown name.
+ */
+int CpuFeatures_parse(const char *name, CpuLevel *level);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // CPU_FEATURES_H
@@ -1,4 +1,5 @@
 #include "gfx/camera/camera.hpp"
+#include "terrain_data.hpp"
 
 Vec3f Camera::screenSpacePointTo3DRay(
 const Mat4x4f &proj, const Mat4x4f &modelview, const Vec2i &resolution, const Vec2i &screen_point, float z) const
@@ -44,6 +45,26 @@ const Vec2i &screen_point, Vec3f planeNormal) const
 	return Vec3d(i.x, i.y, i.z);
 }
 
+bool Camera::collisionPointOnTerrain(
+const Mat4x4f &proj, const Mat4x4f &modelview, const Vec2i &resolution,
+const Vec2i &screen_point, const TerrainData *terrain, Vec3f *point) const
+{
+	TerrainRay ray;
+	ray.origin = screenSpacePointTo3DRay(
+		proj, modelview, resolution, screen_point, 0.0);
+	ray.direction = screenSpacePointTo3DRay(
+		proj, modelview, resolution, screen_point, 1.0) - ray.origin;
+	ray.maxT = 1.0f;
+
+	TerrainHit hit;
+	if (!terrain->intersect(ray, &hit)) {
+		return false;
+	}
+
+	*point = hit.position;
+	return true;
+}
+
 Vec3f Camera::rotatePointAroundAxis(
 const Vec3f &point, const Vec3f &axis, float theta)
 {
@@ -5,9 +5,13 @@
 #include "math/vec2.hpp"
 #include "math/vec3.hpp"
 
+class TerrainData;
+
 class Camera
 {
 public:
+	virtual ~Camera() {}
+
 	/**
 	 * On camera motion event.
 	 *
@@ -103,6 +107,25 @@ public:
 		const Mat4x4f &proj, const Mat4x4f &modelview, const Vec2i &resolution, 
 		const Vec2i &screen_point, Vec3f planeNormal) const;
 
+	/**
+	 * Calculates the collision point of screen space ray on terrain.
+	 *
+	 * The modelview matrix must map patch space (x / width, y / height,
+	 * height) into view space, i.e. include the terrain scale.
+	 *
+	 * @param  current projection matrix
+	 * @param  current modelview matrix
+	 * @param  resolution of the screen, e.g. 800 x 600
+	 * @param  point on screen
+	 * @param  terrain to intersect
+	 * @param  point on terrain in patch space, if hit
+	 *
+	 * @return true if the ray hits the terrain before the far plane.
+	 */
+	bool collisionPointOnTerrain(
+		const Mat4x4f &proj, const Mat4x4f &modelview, const Vec2i &resolution,
+		const Vec2i &screen_point, const TerrainData *terrain, Vec3f *point) const;
+
 	/**
 	 * Helper function for camera calcuation.
 	 *
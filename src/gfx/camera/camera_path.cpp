@@ -0,0 +1,61 @@
+#include "gfx/camera/camera_path.hpp"
+#include "gfx/spline.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+int CameraPath::load(const char *filename)
+{
+	FILE *fd = fopen(filename, "r");
+	if (!fd) {
+		printf("Unable to open file %s : %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	m_positions.clear();
+	m_lookats.clear();
+
+	char line[512];
+	int row = 0;
+
+	while (fgets(line, sizeof(line), fd)) {
+		++row;
+
+		Vec3f p, l;
+		int n = sscanf(line, "%f %f %f %f %f %f", &p.x, &p.y, &p.z, &l.x, &l.y, &l.z);
+		if (n <= 0 || line[0] == '#')
+			continue;
+
+		if (n != 6) {
+			printf("%s:%d: expected 6 values, got %d\n", filename, row, n);
+			fclose(fd);
+			return -1;
+		}
+
+		m_positions.push_back(p);
+		m_lookats.push_back(l);
+	}
+
+	fclose(fd);
+
+	if (m_positions.size() < 2) {
+		printf("%s: at least 2 control points are required\n", filename);
+		m_positions.clear();
+		m_lookats.clear();
+		return -1;
+	}
+
+	m_positions.insert(m_positions.begin(), m_positions.front());
+	m_positions.push_back(m_positions.back());
+	m_lookats.insert(m_lookats.begin(), m_lookats.front());
+	m_lookats.push_back(m_lookats.back());
+
+	return 0;
+}
+
+void CameraPath::evaluate(float t, Vec3f *position, Vec3f *lookat) const
+{
+	*position = spline<float>(t, m_positions.size(), &m_positions[0]);
+	*lookat = spline<float>(t, m_lookats.size(), &m_lookats[0]);
+}
@@ -0,0 +1,51 @@
+#ifndef CAMERA_PATH_HPP
+#define CAMERA_PATH_HPP
+
+#include "math/vec3.hpp"
+
+#include <vector>
+
+/**
+ * Camera path for flythroughs, interpolated with Catmull-Rom splines.
+ *
+ * Path file has one control point per row:
+ *
+ *   <position x> <position y> <position z> <lookat x> <lookat y> <lookat z>
+ *
+ * Empty rows and rows starting with # are ignored. The path passes through
+ * every control point, at least two are required.
+ */
+class CameraPath
+{
+private:
+	// control points, first and last are duplicated so that the spline
+	// passes through the end points.
+	std::vector<Vec3f> m_positions;
+	std::vector<Vec3f> m_lookats;
+
+public:
+	/**
+	 * Load the control points from the given file.
+	 *
+	 * @return 0 on success, != 0 on failure.
+	 */
+	int load(const char *filename);
+
+	/**
+	 * Evaluate the path.
+	 *
+	 * @param t between [0, 1], 0 being the first and 1 the last point.
+	 * @param position reference
+	 * @param lookat reference
+	 */
+	void evaluate(float t, Vec3f *position, Vec3f *lookat) const;
+
+	size_t size() const;
+};
+
+inline size_t CameraPath::size() const
+{
+	return m_positions.empty() ? 0 : m_positions.size() - 2;
+}
+
+#endif // CAMERA_PATH_HPP
@@ -19,6 +19,20 @@ FirstPerson::FirstPerson(const Vec3f &position, const Vec3f &lookat)
 	updateModelViewMatrix();
 }
 
+void FirstPerson::setView(const Vec3f &position, const Vec3f &lookat, const Vec3f &up)
+{
+	m_position = position;
+	m_viewDir = lookat - position;
+	m_viewDir.normalize();
+
+	m_viewUp = up - up.dot(m_viewDir) * m_viewDir;
+	m_viewUp.normalize();
+
+	m_viewSide = m_viewDir.cross(m_viewUp);
+
+	updateModelViewMatrix();
+}
+
 void FirstPerson::onCameraMotion(const Vec2f &motion)
 {
 	// horizontal movement.
@@ -69,7 +83,7 @@ void FirstPerson::updateModelViewMatrix()
 	m_modelViewMatrix.m[13] = -res.y;
 	m_modelViewMatrix.m[14] = -res.z;
 
-	m_modelViewMatrixInverse = m_modelViewMatrix.getInverse();
+	m_modelViewMatrixInverse = m_modelViewMatrix.getRigidInverse();
 }
 
 void FirstPerson::setPosition(const Vec2f &position)
@@ -24,6 +24,15 @@ private:
 public:
 	FirstPerson(const Vec3f &position, const Vec3f &lookat);
 
+	/**
+	 * Place the camera at position looking at the given point.
+	 *
+	 * @param position
+	 * @param lookat
+	 * @param up direction of the world
+	 */
+	void setView(const Vec3f &position, const Vec3f &lookat, const Vec3f &up);
+
 	void onCameraMotion(const Vec2f &motion);
 	void onCameraZoom(float factor);
 	void onCameraMovement(const Vec2f &motion);
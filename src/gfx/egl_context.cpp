@@ -0,0 +1,147 @@
+#include "gfx/egl_context.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ROAM_HAVE_EGL
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+EGLContextOffscreen::EGLContextOffscreen()
+	: m_display(EGL_NO_DISPLAY)
+	, m_context(EGL_NO_CONTEXT)
+	, m_surface(EGL_NO_SURFACE)
+{
+}
+
+EGLContextOffscreen::~EGLContextOffscreen()
+{
+	if (m_display == EGL_NO_DISPLAY)
+		return;
+
+	eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (m_surface != EGL_NO_SURFACE)
+		eglDestroySurface(m_display, m_surface);
+	if (m_context != EGL_NO_CONTEXT)
+		eglDestroyContext(m_display, m_context);
+	eglTerminate(m_display);
+}
+
+/**
+ * Get a display that doesn't need a window system. Prefer Mesa's
+ * surfaceless platform, fall back to the default display.
+ */
+static EGLDisplay getDisplay()
+{
+	const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+	if (extensions && strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+			(PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay) {
+			EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+			if (display != EGL_NO_DISPLAY)
+				return display;
+		}
+	}
+
+	return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+int EGLContextOffscreen::init()
+{
+	EGLint major = 0, minor = 0;
+
+	m_display = getDisplay();
+	if (m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, &major, &minor)) {
+		printf("Unable to initialize EGL display: 0x%x\n", eglGetError());
+		m_display = EGL_NO_DISPLAY;
+		return -1;
+	}
+
+	printf("EGL %d.%d, vendor: %s\n", major, minor, eglQueryString(m_display, EGL_VENDOR));
+
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		printf("Unable to bind OpenGL API: 0x%x\n", eglGetError());
+		return -1;
+	}
+
+	const char *extensions = eglQueryString(m_display, EGL_EXTENSIONS);
+	bool surfaceless = extensions && strstr(extensions, "EGL_KHR_surfaceless_context");
+
+	const EGLint configAttribs[] = {
+		EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_DEPTH_SIZE, 24,
+		EGL_NONE
+	};
+
+	EGLConfig config;
+	EGLint numConfigs = 0;
+	if (!eglChooseConfig(m_display, configAttribs, &config, 1, &numConfigs) || numConfigs < 1) {
+		printf("No suitable EGL config: 0x%x\n", eglGetError());
+		return -1;
+	}
+
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+		EGL_NONE
+	};
+
+	m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT, contextAttribs);
+	if (m_context == EGL_NO_CONTEXT) {
+		printf("Unable to create EGL context: 0x%x\n", eglGetError());
+		return -1;
+	}
+
+	// everything is rendered into framebuffer objects, pbuffer is only
+	// needed to make the context current.
+	if (!surfaceless) {
+		const EGLint pbufferAttribs[] = {
+			EGL_WIDTH, 1,
+			EGL_HEIGHT, 1,
+			EGL_NONE
+		};
+		m_surface = eglCreatePbufferSurface(m_display, config, pbufferAttribs);
+		if (m_surface == EGL_NO_SURFACE) {
+			printf("Unable to create EGL pbuffer: 0x%x\n", eglGetError());
+			return -1;
+		}
+	}
+
+	if (!eglMakeCurrent(m_display, m_surface, m_surface, m_context)) {
+		printf("Unable to make EGL context current: 0x%x\n", eglGetError());
+		return -1;
+	}
+
+	printf("EGL context created (%s)\n", surfaceless ? "surfaceless" : "pbuffer");
+
+	return 0;
+}
+
+#else
+
+EGLContextOffscreen::EGLContextOffscreen()
+	: m_display(0)
+	, m_context(0)
+	, m_surface(0)
+{
+}
+
+EGLContextOffscreen::~EGLContextOffscreen()
+{
+}
+
+int EGLContextOffscreen::init()
+{
+	printf("Built without EGL, offscreen rendering is not available\n");
+	return -1;
+}
+
+#endif // ROAM_HAVE_EGL
@@ -0,0 +1,43 @@
+#ifndef EGL_CONTEXT_HPP
+#define EGL_CONTEXT_HPP
+
+/**
+ * Offscreen OpenGL 3.3 context without a window system.
+ *
+ * Uses a surfaceless context when the driver supports
+ * EGL_KHR_surfaceless_context, otherwise a small pbuffer surface. Rendering
+ * is expected to go into a Framebuffer. Only available when built with EGL
+ * (ROAM_HAVE_EGL), otherwise init always fails.
+ */
+class EGLContextOffscreen
+{
+private:
+	// EGLDisplay, EGLContext and EGLSurface, kept opaque so that the EGL
+	// headers are not needed by users.
+	void *m_display;
+	void *m_context;
+	void *m_surface;
+
+public:
+	EGLContextOffscreen();
+	~EGLContextOffscreen();
+
+	/**
+	 * Create the context and make it current on the calling thread.
+	 *
+	 * @return 0 on success, != 0 on failure.
+	 */
+	int init();
+
+	/**
+	 * @return true if init has succeeded.
+	 */
+	bool isValid() const;
+};
+
+inline bool EGLContextOffscreen::isValid() const
+{
+	return m_context != 0;
+}
+
+#endif // EGL_CONTEXT_HPP
@@ -0,0 +1,228 @@
+#include "gfx/frame_profiler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+FrameProfiler::FrameProfiler(size_t window)
+	: m_window(window)
+	, m_cpu(NULL)
+	, m_gpu(NULL)
+	, m_frame(0)
+	, m_initialized(false)
+{
+	m_cpu = new float[m_window*PHASE_COUNT];
+	m_gpu = new float[m_window*PHASE_COUNT];
+
+	std::fill(m_cpu, m_cpu + m_window*PHASE_COUNT, -1.0f);
+	std::fill(m_gpu, m_gpu + m_window*PHASE_COUNT, -1.0f);
+
+	memset(m_start, 0, sizeof(m_start));
+	memset(m_gpuActive, 0, sizeof(m_gpuActive));
+	memset(m_queries, 0, sizeof(m_queries));
+	memset(m_issued, 0, sizeof(m_issued));
+	memset(m_queryFrame, 0, sizeof(m_queryFrame));
+}
+
+FrameProfiler::~FrameProfiler()
+{
+	if (m_initialized) {
+		glDeleteQueries(QUERY_FRAMES*PHASE_COUNT, &m_queries[0][0]);
+	}
+
+	delete [] m_cpu;
+	delete [] m_gpu;
+}
+
+void FrameProfiler::init()
+{
+	if (m_initialized)
+		return;
+
+	glGenQueries(QUERY_FRAMES*PHASE_COUNT, &m_queries[0][0]);
+	m_initialized = true;
+}
+
+double FrameProfiler::now()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(
+		steady_clock::now().time_since_epoch()).count();
+}
+
+void FrameProfiler::beginFrame()
+{
+	size_t row = m_frame % m_window;
+	for (int i = 0; i < PHASE_COUNT; ++i) {
+		m_cpu[row*PHASE_COUNT + i] = -1.0f;
+		m_gpu[row*PHASE_COUNT + i] = -1.0f;
+	}
+
+	// the queries in this slot were issued QUERY_FRAMES ago.
+	if (m_initialized) {
+		size_t slot = m_frame % QUERY_FRAMES;
+		collectQueries(slot);
+		m_queryFrame[slot] = m_frame;
+	}
+
+	begin(PHASE_FRAME);
+}
+
+void FrameProfiler::endFrame()
+{
+	end(PHASE_FRAME);
+	++m_frame;
+}
+
+void FrameProfiler::begin(Phase phase, bool gpu)
+{
+	m_start[phase] = now();
+#ifdef ROAM_TRACING
+	m_traceStart[phase] = Trace::now();
+#endif
+
+	m_gpuActive[phase] = gpu && m_initialized;
+	if (m_gpuActive[phase]) {
+		size_t slot = m_frame % QUERY_FRAMES;
+		glBeginQuery(GL_TIME_ELAPSED, m_queries[slot][phase]);
+		m_issued[slot][phase] = true;
+	}
+}
+
+void FrameProfiler::end(Phase phase)
+{
+	if (m_gpuActive[phase]) {
+		glEndQuery(GL_TIME_ELAPSED);
+		m_gpuActive[phase] = false;
+	}
+
+	size_t row = m_frame % m_window;
+	m_cpu[row*PHASE_COUNT + phase] = now() - m_start[phase];
+
+#ifdef ROAM_TRACING
+	Trace::complete(phaseName(phase), m_traceStart[phase]);
+#endif
+}
+
+void FrameProfiler::collectQueries(size_t slot)
+{
+	size_t frame = m_queryFrame[slot];
+	bool inWindow = frame + m_window > m_frame;
+
+	for (int i = 0; i < PHASE_COUNT; ++i) {
+		if (!m_issued[slot][i])
+			continue;
+
+		m_issued[slot][i] = false;
+
+		// never block, result that is not ready by now is dropped.
+		GLint available = 0;
+		glGetQueryObjectiv(m_queries[slot][i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available || !inWindow)
+			continue;
+
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(m_queries[slot][i], GL_QUERY_RESULT, &elapsed);
+		m_gpu[(frame % m_window)*PHASE_COUNT + i] = elapsed / 1000000.0f;
+	}
+}
+
+float FrameProfiler::percentile(Phase phase, bool gpu, float p) const
+{
+	const float *samples = gpu ? m_gpu : m_cpu;
+	size_t rows = std::min(m_frame, m_window);
+
+	std::vector<float> values;
+	values.reserve(rows);
+
+	for (size_t i = 0; i < rows; ++i) {
+		float value = samples[i*PHASE_COUNT + phase];
+		if (value >= 0.0f)
+			values.push_back(value);
+	}
+
+	if (values.empty())
+		return -1.0f;
+
+	size_t k = (size_t) (p / 100.0f * (values.size() - 1) + 0.5f);
+	k = std::min(k, values.size() - 1);
+	std::nth_element(values.begin(), values.begin() + k, values.end());
+
+	return values[k];
+}
+
+void FrameProfiler::print() const
+{
+	printf("FrameProfiler {\n");
+	printf("  frames: %zu (window %zu)\n", m_frame, m_window);
+	printf("  %-12s %8s %8s %8s | %8s %8s %8s\n",
+	       "phase [ms]", "cpu p50", "p90", "p99", "gpu p50", "p90", "p99");
+
+	for (int i = 0; i < PHASE_COUNT; ++i) {
+		Phase phase = (Phase) i;
+		printf("  %-12s %8.3f %8.3f %8.3f | %8.3f %8.3f %8.3f\n",
+		       phaseName(phase),
+		       percentile(phase, false, 50),
+		       percentile(phase, false, 90),
+		       percentile(phase, false, 99),
+		       percentile(phase, true, 50),
+		       percentile(phase, true, 90),
+		       percentile(phase, true, 99));
+	}
+
+	printf("}\n");
+}
+
+int FrameProfiler::writeCSV(const char *filename) const
+{
+	FILE *fd = fopen(filename, "w");
+	if (!fd) {
+		printf("Unable to open file %s for writing\n", filename);
+		return -1;
+	}
+
+	fprintf(fd, "frame");
+	for (int i = 0; i < PHASE_COUNT; ++i)
+		fprintf(fd, ",cpu_%s_ms", phaseName((Phase) i));
+	for (int i = 0; i < PHASE_COUNT; ++i)
+		fprintf(fd, ",gpu_%s_ms", phaseName((Phase) i));
+	fprintf(fd, "\n");
+
+	// oldest frame first, empty cell when there is no sample.
+	size_t rows = std::min(m_frame, m_window);
+	for (size_t frame = m_frame - rows; frame < m_frame; ++frame) {
+		size_t row = frame % m_window;
+
+		fprintf(fd, "%zu", frame);
+		for (int i = 0; i < PHASE_COUNT; ++i) {
+			float value = m_cpu[row*PHASE_COUNT + i];
+			value >= 0.0f ? fprintf(fd, ",%.4f", value) : fprintf(fd, ",");
+		}
+		for (int i = 0; i < PHASE_COUNT; ++i) {
+			float value = m_gpu[row*PHASE_COUNT + i];
+			value >= 0.0f ? fprintf(fd, ",%.4f", value) : fprintf(fd, ",");
+		}
+		fprintf(fd, "\n");
+	}
+
+	fclose(fd);
+	return 0;
+}
+
+const char *FrameProfiler::phaseName(Phase phase)
+{
+	switch (phase) {
+	case PHASE_EVENTS:     return "events";
+	case PHASE_RESET:      return "reset";
+	case PHASE_TESSELLATE: return "tessellate";
+	case PHASE_EXTRACT:    return "extract";
+	case PHASE_UPLOAD:     return "upload";
+	case PHASE_DRAW:       return "draw";
+	case PHASE_SWAP:       return "swap";
+	case PHASE_READBACK:   return "readback";
+	case PHASE_FRAME:      return "frame";
+	default:               return "unknown";
+	}
+}
@@ -0,0 +1,134 @@
+#ifndef FRAME_PROFILER_HPP
+#define FRAME_PROFILER_HPP
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+
+#include "trace.hpp"
+
+#include <stddef.h>
+
+/**
+ * Per-phase frame timing.
+ *
+ * CPU time of each phase is measured with a high-resolution clock, GPU time
+ * with GL_TIME_ELAPSED queries. Queries are read back a few frames later so
+ * the pipeline is never stalled. Timings of the latest frames are kept in a
+ * rolling window for percentiles and CSV dumps.
+ *
+ * With ROAM_TRACING phases are also recorded as trace events.
+ */
+class FrameProfiler
+{
+public:
+	enum Phase
+	{
+		PHASE_EVENTS = 0,
+		PHASE_RESET,
+		PHASE_TESSELLATE,
+		PHASE_EXTRACT,
+		PHASE_UPLOAD,
+		PHASE_DRAW,
+		PHASE_SWAP,
+
+		// offscreen rendering reads the frame back instead of swapping.
+		PHASE_READBACK,
+
+		// whole frame from beginFrame to endFrame.
+		PHASE_FRAME,
+
+		PHASE_COUNT
+	};
+
+	/**
+	 * Constructor.
+	 *
+	 * @param number of frames kept in the rolling window.
+	 */
+	FrameProfiler(size_t window = 1024);
+	~FrameProfiler();
+
+	/**
+	 * Create the GPU queries, OpenGL context must be current.
+	 */
+	void init();
+
+	void beginFrame();
+	void endFrame();
+
+	/**
+	 * Start timing a phase. Phases must not overlap.
+	 *
+	 * @param phase
+	 * @param also time the phase on GPU
+	 */
+	void begin(Phase phase, bool gpu = false);
+	void end(Phase phase);
+
+	/**
+	 * Percentile of the phase timings in the rolling window.
+	 *
+	 * @param phase
+	 * @param GPU or CPU timings
+	 * @param percentile between [0, 100]
+	 *
+	 * @return milliseconds, negative if there are no samples.
+	 */
+	float percentile(Phase phase, bool gpu, float p) const;
+
+	/**
+	 * Print p50/p90/p99 of every phase.
+	 */
+	void print() const;
+
+	/**
+	 * Write the timings in the rolling window into CSV file, one row per
+	 * frame.
+	 *
+	 * @return 0 on success, != 0 on failure.
+	 */
+	int writeCSV(const char *filename) const;
+
+	/**
+	 * @return number of frames ended so far.
+	 */
+	size_t frame() const;
+
+	static const char *phaseName(Phase phase);
+
+private:
+	// frames in flight before GPU queries are read back.
+	static const size_t QUERY_FRAMES = 4;
+
+	void collectQueries(size_t slot);
+
+	static double now();
+
+	size_t m_window;
+
+	// timings in milliseconds, m_window rows of PHASE_COUNT.
+	// negative value means no sample.
+	float *m_cpu;
+	float *m_gpu;
+
+	// number of the current frame, starts from 0.
+	size_t m_frame;
+
+	double m_start[PHASE_COUNT];
+#ifdef ROAM_TRACING
+	int64_t m_traceStart[PHASE_COUNT];
+#endif
+	bool m_gpuActive[PHASE_COUNT];
+
+	GLuint m_queries[QUERY_FRAMES][PHASE_COUNT];
+	bool m_issued[QUERY_FRAMES][PHASE_COUNT];
+	size_t m_queryFrame[QUERY_FRAMES];
+	bool m_initialized;
+};
+
+inline size_t FrameProfiler::frame() const
+{
+	return m_frame;
+}
+
+#endif // FRAME_PROFILER_HPP
@@ -0,0 +1,127 @@
+#include "gfx/framebuffer.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+Framebuffer::Framebuffer()
+	: m_fbo(0)
+	, m_color(0)
+	, m_depth(0)
+	, m_next(0)
+	, m_count(0)
+	, m_width(0)
+	, m_height(0)
+{
+	m_pbo[0] = m_pbo[1] = 0;
+	m_pending[0] = m_pending[1] = false;
+	m_sequence[0] = m_sequence[1] = -1;
+}
+
+Framebuffer::~Framebuffer()
+{
+	if (m_fbo == 0)
+		return;
+
+	glDeleteBuffers(2, m_pbo);
+	glDeleteRenderbuffers(1, &m_depth);
+	glDeleteRenderbuffers(1, &m_color);
+	glDeleteFramebuffers(1, &m_fbo);
+}
+
+int Framebuffer::init(int width, int height)
+{
+	m_width = width;
+	m_height = height;
+
+	glGenRenderbuffers(1, &m_color);
+	glBindRenderbuffer(GL_RENDERBUFFER, m_color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+	glGenRenderbuffers(1, &m_depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, m_depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &m_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_color);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depth);
+
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		printf("Framebuffer is not complete: 0x%x\n", status);
+		return -1;
+	}
+
+	glGenBuffers(2, m_pbo);
+	for (int i = 0; i < 2; ++i) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbo[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, width*height*4, NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	return 0;
+}
+
+void Framebuffer::beginReadback()
+{
+	int i = m_next;
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbo[i]);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	m_pending[i] = true;
+	m_sequence[i] = m_count++;
+	m_next = 1 - i;
+}
+
+long Framebuffer::finishReadback(unsigned char *pixels, bool last)
+{
+	// m_next is the older one, if it's still queued, the other the latest.
+	int i = m_next;
+	if (!m_pending[i]) {
+		i = 1 - i;
+		if (!last || !m_pending[i])
+			return -1;
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbo[i]);
+	const unsigned char *data = (const unsigned char *) glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+
+	if (data) {
+		// OpenGL has the bottom row first.
+		const size_t stride = m_width*4;
+		for (int y = 0; y < m_height; ++y) {
+			memcpy(pixels + y*stride, data + (m_height - 1 - y)*stride, stride);
+		}
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	m_pending[i] = false;
+
+	return data ? m_sequence[i] : -1;
+}
+
+int Framebuffer::writePPM(const char *filename, const unsigned char *pixels, int width, int height)
+{
+	FILE *fd = fopen(filename, "wb");
+	if (!fd) {
+		printf("Unable to open file %s for writing\n", filename);
+		return -1;
+	}
+
+	fprintf(fd, "P6\n%d %d\n255\n", width, height);
+	for (int i = 0; i < width*height; ++i) {
+		fwrite(pixels + i*4, 1, 3, fd);
+	}
+
+	fclose(fd);
+	return 0;
+}
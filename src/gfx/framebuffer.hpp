@@ -0,0 +1,98 @@
+#ifndef FRAMEBUFFER_HPP
+#define FRAMEBUFFER_HPP
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+
+#include <stddef.h>
+
+/**
+ * Offscreen render target with RGBA8 color and 24-bit depth.
+ *
+ * Pixels are read back asynchronously through two pixel buffer objects:
+ * beginReadback() queues the copy of the current frame and
+ * finishReadback() maps the oldest queued one, usually a frame later, so
+ * the CPU doesn't wait for the GPU.
+ */
+class Framebuffer
+{
+private:
+	GLuint m_fbo;
+	GLuint m_color;
+	GLuint m_depth;
+
+	// ping-pong pixel pack buffers.
+	GLuint m_pbo[2];
+	bool m_pending[2];
+	long m_sequence[2];
+	int m_next;
+	long m_count;
+
+	int m_width, m_height;
+
+public:
+	Framebuffer();
+	~Framebuffer();
+
+	/**
+	 * Create the framebuffer, OpenGL context must be current.
+	 *
+	 * @return 0 on success, != 0 on failure.
+	 */
+	int init(int width, int height);
+
+	void bind() const;
+	static void unbind();
+
+	/**
+	 * Queue the readback of the current contents.
+	 *
+	 * If there's already two readbacks queued, the oldest is dropped.
+	 */
+	void beginReadback();
+
+	/**
+	 * Copy the oldest queued readback into pixels, top row first.
+	 *
+	 * The latest readback is left queued unless last is set, so its copy
+	 * overlaps the next frame instead of stalling on it.
+	 *
+	 * @param pixels with room for width*height*4 bytes
+	 * @param last finish the latest readback too, e.g. after the last frame
+	 *
+	 * @return number of the readback starting from 0, -1 if none finished.
+	 */
+	long finishReadback(unsigned char *pixels, bool last = false);
+
+	int getWidth() const;
+	int getHeight() const;
+
+	/**
+	 * Write RGBA pixels, top row first, into binary PPM file.
+	 *
+	 * @return 0 on success, != 0 on failure.
+	 */
+	static int writePPM(const char *filename, const unsigned char *pixels, int width, int height);
+};
+
+inline void Framebuffer::bind() const
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+}
+
+inline void Framebuffer::unbind()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+inline int Framebuffer::getWidth() const
+{
+	return m_width;
+}
+
+inline int Framebuffer::getHeight() const
+{
+	return m_height;
+}
+
+#endif // FRAMEBUFFER_HPP
@@ -1,11 +1,25 @@
 #include "gfx/opengl_render.hpp"
 
 #include "gfx/camera/camera.hpp"
+#include "gfx/camera/camera_path.hpp"
 #include "gfx/camera/first_person.hpp"
+#include "gfx/egl_context.hpp"
+#include "gfx/framebuffer.hpp"
+#include "gfx/frame_profiler.hpp"
+#include "gfx/render_state.hpp"
 #include "gfx/shader.hpp"
 #include "gfx/shaderpool.hpp"
-
+#include "gfx/spline.hpp"
+#include "mesh_export.h"
+#include "stream_socket.h"
+#include "task_scheduler.hpp"
+#include "tessellation_stream.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
 #include <iostream>
+#include <string.h>
+#include <vector>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
 #include <GL/gl.h>
@@ -52,9 +66,60 @@ Mat4x4f projectionMatrix;
 // shading model
 bool wireframe = false;
 
+// how the tessellation is transferred to the GPU.
+enum RenderMode
+{
+	// float positions and normal texels per vertex.
+	RENDER_VERTICES = 0,
+
+	// 16-bit grid coordinates per vertex, heights fetched from a texture.
+	RENDER_GRID,
+
+	// grid coordinates as generalized triangle strips.
+	RENDER_STRIPS,
+
+	// one path code per triangle, corners reconstructed on the GPU.
+	RENDER_PATH_CODES,
+
+	RENDER_MODE_COUNT
+};
+
+// must match the VERTEX_FORMAT_* defines in basic-vs.glsl
+enum VertexFormat
+{
+	VERTEX_FORMAT_FLOAT = 0,
+	VERTEX_FORMAT_GRID  = 1,
+	VERTEX_FORMAT_PATH  = 2
+};
+
+static const char *renderModeNames[RENDER_MODE_COUNT] = {
+	"vertices",
+	"grid",
+	"strips",
+	"path codes"
+};
+
+static const VertexFormat renderModeFormats[RENDER_MODE_COUNT] = {
+	VERTEX_FORMAT_FLOAT,
+	VERTEX_FORMAT_GRID,
+	VERTEX_FORMAT_GRID,
+	VERTEX_FORMAT_PATH
+};
+
+RenderMode renderMode = RENDER_VERTICES;
+
 Camera *camera;
 bool wasd[4] = { false, false, false, false };
 
+// print statistics after the next tessellation.
+bool printStats = false;
+
+// print the terrain point in the middle of the screen on the next frame.
+bool pickCenter = false;
+
+// skip terrain hidden behind terrain, toggled with o.
+bool occlusionCulling = false;
+
 void setPerspectiveProjection(float fovy, float near, float far)
 {
 	float radians = 0.5 * fovy * DEGREES_2_RADIANS;
@@ -118,6 +183,19 @@ int on_event(SDL_Event *event)
 		case SDLK_s: wasd[2] = false; break;
 		case SDLK_d: wasd[3] = false; break;
 		case SDLK_1: wireframe = !wireframe; break;
+		case SDLK_m:
+			renderMode = (RenderMode) ((renderMode + 1) % RENDER_MODE_COUNT);
+			printf("render mode: %s\n", renderModeNames[renderMode]);
+			break;
+		case SDLK_p: printStats = true; break;
+		case SDLK_g: pickCenter = true; break;
+		case SDLK_o:
+			occlusionCulling = !occlusionCulling;
+			printf("occlusion culling: %s\n", occlusionCulling ? "on" : "off");
+			break;
+		case SDLK_t:
+			TRACE_WRITE("trace.json");
+			break;
 		case SDLK_j:
 			std::cout << camera->getModelViewMatrix() << std::endl;
 			std::cout << "m_pos: " << camera->getPosition() << std::endl;
@@ -161,7 +239,7 @@ int init_OpenGL()
 	return 0;
 }
 
-int init_SDL2(int width, int height)
+int init_SDL2(int width, int height, bool grabInput)
 {
 	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0) {
 		printf("Unable to initialize SDL2: %s\n", SDL_GetError());
@@ -173,12 +251,18 @@ int init_SDL2(int width, int height)
 	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
 	SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
 
-	SDL_SetRelativeMouseMode(SDL_TRUE);
+	if (grabInput) {
+		SDL_SetRelativeMouseMode(SDL_TRUE);
+	}
 
 	screen_width = width;
 	screen_height = height;
 
-	int flags = SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE | SDL_WINDOW_INPUT_GRABBED;
+	int flags = SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
+	if (grabInput) {
+		flags |= SDL_WINDOW_INPUT_GRABBED;
+	}
+
 	window = SDL_CreateWindow("ROAMing",
 	                          SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
 	                          width, height, flags);
@@ -200,13 +284,176 @@ int init_SDL2(int width, int height)
 	return init_OpenGL();
 }
 
-void render(TerrainPatch *patch)
+/**
+ * Write the oldest queued readback of the framebuffer, if output is set,
+ * see Framebuffer::finishReadback().
+ */
+static void write_frame(const RenderOptions &options, Framebuffer &framebuffer, unsigned char *pixels,
+                        bool last = false)
 {
-	if (init_SDL2(1024, 768) != 0) {
+	long frame = framebuffer.finishReadback(pixels, last);
+	if (frame < 0 || !options.output)
 		return;
+
+	char filename[1024];
+	snprintf(filename, sizeof(filename), options.output, (int) frame);
+	Framebuffer::writePPM(filename, pixels, framebuffer.getWidth(), framebuffer.getHeight());
+}
+
+/**
+ * Print and write the flythrough report.
+ *
+ * @return 0 on success, != 0 on failure.
+ */
+static int write_report(const RenderOptions &options, const FrameProfiler &profiler,
+                        const std::vector<size_t> &triangles)
+{
+	size_t minTriangles = triangles.empty() ? 0 : triangles[0];
+	size_t maxTriangles = 0;
+	double sumTriangles = 0;
+
+	for (size_t i = 0; i < triangles.size(); ++i) {
+		minTriangles = std::min(minTriangles, triangles[i]);
+		maxTriangles = std::max(maxTriangles, triangles[i]);
+		sumTriangles += triangles[i];
 	}
 
-	camera = new FirstPerson(Vec3f(0, 1, 0), Vec3f(0, 0, 0));
+	const FrameProfiler::Phase frame = FrameProfiler::PHASE_FRAME;
+	char report[1024];
+	snprintf(report, sizeof(report),
+	         "flythrough: %s\n"
+	         "render_mode: %s\n"
+	         "frames: %zu\n"
+	         "frame_ms_p50: %.3f\n"
+	         "frame_ms_p90: %.3f\n"
+	         "frame_ms_p99: %.3f\n"
+	         "frame_ms_max: %.3f\n"
+	         "triangles_min: %zu\n"
+	         "triangles_mean: %.1f\n"
+	         "triangles_max: %zu\n",
+	         options.flythrough ? options.flythrough : "(static camera)",
+	         renderModeNames[renderMode],
+	         triangles.size(),
+	         profiler.percentile(frame, false, 50),
+	         profiler.percentile(frame, false, 90),
+	         profiler.percentile(frame, false, 99),
+	         profiler.percentile(frame, false, 100),
+	         minTriangles,
+	         triangles.empty() ? 0.0 : sumTriangles / triangles.size(),
+	         maxTriangles);
+
+	printf("%s", report);
+	profiler.print();
+
+	if (options.report) {
+		FILE *fd = fopen(options.report, "w");
+		if (!fd) {
+			printf("Unable to open file %s for writing\n", options.report);
+			return -1;
+		}
+		fputs(report, fd);
+		fclose(fd);
+	}
+
+	return 0;
+}
+
+// texels of the height color ramp.
+#define COLOR_RAMP_SIZE 256
+
+/**
+ * Bake the terrain colors by height into a 1D texture, the fragment shader
+ * looks them up instead of evaluating the spline.
+ */
+static GLuint create_color_ramp()
+{
+	// sand, grass, forest, rock and snow from the lowest height to the
+	// highest, the end knots are repeated for the Catmull-Rom spline.
+	static const Vec3f knots[] = {
+		Vec3f(0.76f, 0.70f, 0.50f),
+		Vec3f(0.76f, 0.70f, 0.50f),
+		Vec3f(0.36f, 0.58f, 0.22f),
+		Vec3f(0.20f, 0.42f, 0.16f),
+		Vec3f(0.48f, 0.43f, 0.38f),
+		Vec3f(0.95f, 0.95f, 0.97f),
+		Vec3f(0.95f, 0.95f, 0.97f),
+	};
+	const size_t count = sizeof(knots) / sizeof(knots[0]);
+
+	float texels[COLOR_RAMP_SIZE*3];
+	for (size_t i = 0; i < COLOR_RAMP_SIZE; ++i) {
+		Vec3f color = spline<float>(i / (COLOR_RAMP_SIZE - 1.0f), count, knots);
+		texels[i*3+0] = clamp<float>(color.x, 0, 1);
+		texels[i*3+1] = clamp<float>(color.y, 0, 1);
+		texels[i*3+2] = clamp<float>(color.z, 0, 1);
+	}
+
+	GLuint texture = 0;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_1D, texture);
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB8, COLOR_RAMP_SIZE, 0, GL_RGB, GL_FLOAT, texels);
+	glBindTexture(GL_TEXTURE_1D, 0);
+
+	return texture;
+}
+
+int render(TerrainPatch *patch, const RenderOptions &options)
+{
+	CameraPath path;
+	const bool flythrough = options.flythrough != NULL;
+
+	if (flythrough && path.load(options.flythrough) != 0) {
+		return -1;
+	}
+
+	if (options.mode) {
+		int mode = 0;
+		while (mode < RENDER_MODE_COUNT && strcmp(renderModeNames[mode], options.mode) != 0)
+			++mode;
+
+		if (mode == RENDER_MODE_COUNT) {
+			printf("Unknown render mode: %s\n", options.mode);
+			return -1;
+		}
+		renderMode = (RenderMode) mode;
+	}
+
+	// fixed number of frames are rendered and reported.
+	const bool timed = flythrough || options.headless;
+
+	EGLContextOffscreen offscreen;
+	Framebuffer framebuffer;
+	unsigned char *pixels = NULL;
+
+	if (options.headless) {
+		if (offscreen.init() != 0 || init_OpenGL() != 0) {
+			return -1;
+		}
+		if (framebuffer.init(options.width, options.height) != 0) {
+			return -1;
+		}
+		framebuffer.bind();
+		on_resize(options.width, options.height);
+		pixels = new unsigned char[options.width*options.height*4];
+	} else {
+		if (init_SDL2(options.width, options.height, !flythrough) != 0) {
+			return -1;
+		}
+
+		// flythrough is timed, so don't wait for vsync.
+		if (flythrough) {
+			SDL_GL_SetSwapInterval(0);
+		}
+	}
+
+	FrameProfiler profiler(timed ? options.frames : 1024);
+	std::vector<size_t> triangles;
+
+	FirstPerson *firstPerson = new FirstPerson(Vec3f(0, 1, 0), Vec3f(0, 0, 0));
+	camera = firstPerson;
 	camera->forceMatrix(Mat4x4f(0.729182, -0.68285, 0.0448257, -1.528,
 	                            0.511006, 0.586905, 0.628025, -23.0045,
 	                            -0.455157, -0.435041, 0.776898, -7.35539,
@@ -216,27 +463,146 @@ void render(TerrainPatch *patch)
 
 	const size_t poolSize = patch->poolSize();
 
-	float *triPool = new float[poolSize*9];
-	float *colorPool = new float[poolSize*9];
-	float *normalTexelPool = new float[poolSize*6];
+	occlusionCulling = options.occlusionCulling;
+
+	MeshExport *meshExport = NULL;
+	uint64_t exportedFrames = 0;
+
+	// one remote viewer at a time, a new one replaces the old.
+	int streamServer = -1;
+	int streamClient = -1;
+	TessellationEncoder *streamEncoder = NULL;
+	std::vector<unsigned char> streamMessage;
+	StreamQueue streamQueue = { NULL, 0, 0 };
+	size_t streamBytes = 0, streamRawBytes = 0, streamDropped = 0;
+
+	float *triPool = NULL;
+	float *normalTexelPool = NULL;
+	unsigned short *gridPool = NULL;
+	unsigned short *stripPool = NULL;
+	unsigned int *pathCodePool = NULL;
+
+	// OpenGL ignores deleting 0.
+	GLuint buffers[5] = { 0 };
+	GLuint arrays[RENDER_MODE_COUNT] = { 0 };
+	GLuint pathCodeTexture = 0;
+	GLuint normalTexture = 0;
+	GLuint heightTexture = 0;
+	GLuint colorRampTexture = 0;
+
+	// the one way out once anything is created, failed or not.
+	auto release = [&]() {
+		glDeleteTextures(1, &colorRampTexture);
+		glDeleteTextures(1, &pathCodeTexture);
+		glDeleteTextures(1, &heightTexture);
+		glDeleteTextures(1, &normalTexture);
+		glDeleteVertexArrays(RENDER_MODE_COUNT, arrays);
+		glDeleteBuffers(5, buffers);
+
+		delete [] pathCodePool;
+		delete [] stripPool;
+		delete [] gridPool;
+		delete [] normalTexelPool;
+		delete [] triPool;
+
+		if (meshExport) {
+			MeshExport_delete(meshExport);
+		}
 
-	GLuint buffers[3];
-	GLuint arrays[3];
-	glGenBuffers(3, buffers);
-	glGenVertexArrays(3, arrays);
+		if (streamServer >= 0) {
+			if (streamClient >= 0) {
+				StreamSocket_close(streamClient, NULL);
+			}
+			StreamSocket_close(streamServer, options.streamSocket);
+		}
+		StreamSocket_clear(&streamQueue);
+		delete streamEncoder;
+
+		delete [] pixels;
+		delete firstPerson;
+		camera = NULL;
+	};
+
+	if (options.exportName) {
+		Heightmap *map = patch->getHeightmap();
+		meshExport = MeshExport_create(options.exportName, poolSize, map->width, map->height);
+		if (meshExport == NULL) {
+			release();
+			return -1;
+		}
+	}
 
+	if (options.streamSocket) {
+		streamServer = StreamSocket_listen(options.streamSocket);
+		if (streamServer < 0) {
+			release();
+			return -1;
+		}
+		streamEncoder = new TessellationEncoder(patch);
+	}
+
+	auto closeStreamClient = [&]() {
+		StreamSocket_close(streamClient, NULL);
+		StreamSocket_clear(&streamQueue);
+		streamClient = -1;
+	};
+
+	// queues streamMessage, drops the viewer when it is gone.
+	auto sendStream = [&]() {
+		if (StreamSocket_send(streamClient, &streamQueue, &streamMessage[0], streamMessage.size()) < 0) {
+			closeStreamClient();
+		}
+	};
+
+	triPool = new float[poolSize*9];
+	normalTexelPool = new float[poolSize*6];
+	gridPool = new unsigned short[poolSize*6];
+	stripPool = new unsigned short[patch->maxStripVertices()*2];
+	pathCodePool = new unsigned int[poolSize];
+
+	glGenBuffers(5, buffers);
+
+	// one vertex array per render mode, attribute layout is set up only
+	// once here.
+	glGenVertexArrays(RENDER_MODE_COUNT, arrays);
+
+	glBindVertexArray(arrays[RENDER_VERTICES]);
 	glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
-	glBindVertexArray(arrays[0]);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(float)*poolSize*9, NULL, GL_STREAM_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
 	glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
-	glBindVertexArray(arrays[1]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float)*poolSize*9, NULL, GL_STREAM_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, buffers[2]);
-	glBindVertexArray(arrays[2]);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(float)*poolSize*6, NULL, GL_STREAM_DRAW);
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+	glBindVertexArray(arrays[RENDER_GRID]);
+	glBindBuffer(GL_ARRAY_BUFFER, buffers[2]);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(unsigned short)*poolSize*6, NULL, GL_STREAM_DRAW);
+	glEnableVertexAttribArray(3);
+	glVertexAttribIPointer(3, 2, GL_UNSIGNED_SHORT, 0, 0);
+
+	glBindVertexArray(arrays[RENDER_STRIPS]);
+	glBindBuffer(GL_ARRAY_BUFFER, buffers[3]);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(unsigned short)*patch->maxStripVertices()*2, NULL, GL_STREAM_DRAW);
+	glEnableVertexAttribArray(3);
+	glVertexAttribIPointer(3, 2, GL_UNSIGNED_SHORT, 0, 0);
+
+	// path codes have no attributes at all, arrays[RENDER_PATH_CODES]
+	// stays empty.
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// path codes are read in the vertex shader through a buffer texture.
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[4]);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(unsigned int)*poolSize, NULL, GL_STREAM_DRAW);
+	glGenTextures(1, &pathCodeTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, pathCodeTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, buffers[4]);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
 
 	// generate normal texture
-	GLuint normalTexture = 0;
 	Heightmap *map = patch->getHeightmap();
 	glGenTextures(1, &normalTexture);
 	glBindTexture(GL_TEXTURE_2D, normalTexture);
@@ -244,45 +610,113 @@ void render(TerrainPatch *patch)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, map->width, map->height, 0, GL_RGB, GL_FLOAT, map->normal_map);
 
+	// generate height texture, read with texelFetch so no filtering.
+	glGenTextures(1, &heightTexture);
+	glBindTexture(GL_TEXTURE_2D, heightTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, map->width, map->height, 0, GL_RED, GL_FLOAT, map->map);
+
+	colorRampTexture = create_color_ramp();
+
+	// compile all shaders up front instead of on the first frame.
+	{
+		TRACE_SCOPE("shaders");
+		std::vector<std::pair<std::string, std::string> > shaders;
+		shaders.push_back(std::make_pair("shaders/basic-vs.glsl", "shaders/basic-fs.glsl"));
+		if (ShaderPool::instance()->preload(shaders) != 0) {
+			release();
+			return -1;
+		}
+	}
+
+	// resolve the program and uniforms once, not every frame.
+	Shader *shader = ShaderPool::instance()->get("shaders/basic-vs.glsl", "shaders/basic-fs.glsl");
+	const GLint projMatrixLocation = shader->getUniformLocation("u_proj_matrix");
+	const GLint modelMatrixLocation = shader->getUniformLocation("u_model_matrix");
+	const GLint vertexFormatLocation = shader->getUniformLocation("u_vertex_format");
+
+	RenderState state;
+	state.useProgram(shader->getHandle());
+	state.uniform1i(shader->getUniformLocation("normalMap"), 0);
+	state.uniform1i(shader->getUniformLocation("heightMap"), 1);
+	state.uniform1i(shader->getUniformLocation("pathCodes"), 2);
+	state.uniform1i(shader->getUniformLocation("colorRamp"), 3);
+
+	profiler.init();
+
 	while (running) {
 		uint32_t current = SDL_GetTicks();
 		float delta = (current - last) / 1000.0f;
 
+		profiler.beginFrame();
+
+		profiler.begin(FrameProfiler::PHASE_EVENTS);
 		SDL_Event event;
-		while (SDL_PollEvent(&event)) {
+		while (!options.headless && SDL_PollEvent(&event)) {
 			running &= on_event(&event);
 		}
 
-		camera->onCameraMovement(generate_movement_vector(delta));
-
+		if (flythrough) {
+			Vec3f position, lookat;
+			path.evaluate(profiler.frame() / (float) std::max<size_t>(options.frames-1, 1),
+			              &position, &lookat);
+			firstPerson->setView(position, lookat, Vec3f(0, 0, 1));
+		} else {
+			camera->onCameraMovement(generate_movement_vector(delta));
+		}
+		profiler.end(FrameProfiler::PHASE_EVENTS);
+
+		profiler.begin(FrameProfiler::PHASE_RESET);
+		// a finer level finished loading, see TerrainLoader.
+		if (patch->swapData()) {
+			TRACE_SCOPE("swap");
+
+			// the textures are already bound, but maybe not on the active unit.
+			Heightmap *map = patch->getHeightmap();
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, normalTexture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, map->width, map->height, 0, GL_RGB, GL_FLOAT, map->normal_map);
+			glBindTexture(GL_TEXTURE_2D, heightTexture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, map->width, map->height, 0, GL_RED, GL_FLOAT, map->map);
+			state.invalidate();
+
+			// the viewer starts over with the new size.
+			if (streamClient >= 0) {
+				streamEncoder->reset();
+				streamEncoder->encodeHeader(streamMessage);
+				sendStream();
+			}
+
+			printf("Frame %zu: switched to %zu x %zu\n", profiler.frame(), map->width, map->height);
+		}
 		patch->reset();
-		patch->tessellate(camera->getPosition()/750);
-		patch->getTessellation(triPool, colorPool, normalTexelPool);
+		profiler.end(FrameProfiler::PHASE_RESET);
+
+		profiler.begin(FrameProfiler::PHASE_TESSELLATE);
+		// patch space, see the modelview scale below.
+		const Vec3f position = camera->getPosition();
+		const Vec3f view(position.x/750, position.y/750, position.z/50);
+		// the export and the stream get the whole patch, hidden terrain
+		// refined as well.
+		patch->setOcclusionCulling(occlusionCulling && !meshExport && streamServer < 0);
+		patch->tessellate(view);
+		profiler.end(FrameProfiler::PHASE_TESSELLATE);
+
+		if (printStats) {
+			patch->print();
+			profiler.print();
+			profiler.writeCSV("frame_times.csv");
+			TaskScheduler::instance()->printStats();
+			TaskScheduler::instance()->resetStats();
+			printStats = false;
+		}
 
 		size_t leaves = patch->amountOfLeaves();
-
-		// update the buffer data
-		glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float)*9*leaves, triPool);
-		glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float)*9*leaves, colorPool);
-		glBindBuffer(GL_ARRAY_BUFFER, buffers[2]);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float)*6*leaves, normalTexelPool);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		if (wireframe) {
-			glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-			glLineWidth(2.0);
-		} else {
-			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		if (timed) {
+			triangles.push_back(leaves);
 		}
 
-		Shader *s = ShaderPool::instance()->get("shaders/basic-vs.glsl", "shaders/basic-fs.glsl");
-		s->enable();
-		glUniformMatrix4fv(s->getUniformLocation("u_proj_matrix"), 1, GL_FALSE, projectionMatrix.m);
-
 		Mat4x4f modelview(camera->getModelViewMatrix());
 		// == glScalef(750, 750, 50);
 		modelview *= Mat4x4f(750, 0,   0,   0,
@@ -290,37 +724,200 @@ void render(TerrainPatch *patch)
 		                     0,   0,   50,  0,
 		                     0,   0,   0,   1);
 
-		glUniformMatrix4fv(s->getUniformLocation("u_model_matrix"), 1, GL_FALSE, modelview.m);
+		// patch space to clip space, leaves outside the frustum are
+		// dropped while extracting.
+		const Mat4x4f clip = projectionMatrix * modelview;
+
+		if (pickCenter) {
+			Vec2i resolution(screen_width, screen_height);
+			Vec3f point;
+			if (camera->collisionPointOnTerrain(projectionMatrix, modelview, resolution,
+			                                    resolution / 2, patch->getData(), &point)) {
+				std::cout << "pick: " << point << std::endl;
+			} else {
+				std::cout << "pick: no terrain" << std::endl;
+			}
+			pickCenter = false;
+		}
 
-		// normal texture
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, normalTexture);
-		glUniform1i(s->getUniformLocation("normalMap"), 0);
+		size_t stripLengths[2] = { 0, 0 };
+		size_t visible = 0;
 
-		glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		glBindBuffer(GL_ARRAY_BUFFER, buffers[2]);
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, 0);
+		profiler.begin(FrameProfiler::PHASE_EXTRACT);
+		if (meshExport) {
+			TRACE_SCOPE("export");
 
-		glDrawArrays(GL_TRIANGLES, 0, leaves*3);
+			// whole patch, written straight into the shared memory.
+			const float position[3] = { view.x, view.y, view.z };
+			Heightmap *map = patch->getHeightmap();
+			size_t count = patch->getTessellation(MeshExport_begin(meshExport), NULL);
+			MeshExport_end(meshExport, exportedFrames++, count, position, map->width, map->height);
+		}
 
-		glDisableVertexAttribArray(0);
-		glDisableVertexAttribArray(1);
-		glDisableVertexAttribArray(2);
+		if (streamServer >= 0) {
+			TRACE_SCOPE("stream");
+
+			int client = StreamSocket_accept(streamServer);
+			if (client >= 0) {
+				if (streamClient >= 0) {
+					closeStreamClient();
+				}
+				streamClient = client;
+				streamEncoder->reset();
+				streamEncoder->encodeHeader(streamMessage);
+				sendStream();
+			}
+
+			// a viewer still reading the previous frame skips this one
+			// instead of stalling rendering. Nothing is encoded for it,
+			// so the next frame carries the changes since the last one
+			// sent and the viewer stays in sync.
+			if (streamClient >= 0) {
+				int queued = StreamSocket_flush(streamClient, &streamQueue);
+				if (queued < 0) {
+					closeStreamClient();
+				} else if (queued > 0) {
+					streamDropped++;
+				} else {
+					streamEncoder->encodeFrame(profiler.frame(), streamMessage);
+					sendStream();
+					streamBytes += streamMessage.size();
+					streamRawBytes += sizeof(float)*9*leaves;
+				}
+			}
+		}
 
-		s->disable();
+		switch (renderMode) {
+		case RENDER_VERTICES:
+			visible = patch->getTessellation(triPool, normalTexelPool, &clip);
+			break;
+		case RENDER_GRID:
+			visible = patch->getTessellationGrid(gridPool, &clip);
+			break;
+		case RENDER_STRIPS:
+			patch->getTessellationStrips(stripPool, stripLengths, &clip);
+			break;
+		case RENDER_PATH_CODES:
+			visible = patch->getTessellationCodes(pathCodePool, &clip);
+			break;
+		default:
+			break;
+		}
+		profiler.end(FrameProfiler::PHASE_EXTRACT);
+
+		// update the buffer data
+		profiler.begin(FrameProfiler::PHASE_UPLOAD, true);
+		switch (renderMode) {
+		case RENDER_VERTICES:
+			state.bindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float)*9*visible, triPool);
+			state.bindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float)*6*visible, normalTexelPool);
+			break;
+		case RENDER_GRID:
+			state.bindBuffer(GL_ARRAY_BUFFER, buffers[2]);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(unsigned short)*6*visible, gridPool);
+			break;
+		case RENDER_STRIPS:
+			state.bindBuffer(GL_ARRAY_BUFFER, buffers[3]);
+			glBufferSubData(GL_ARRAY_BUFFER, 0,
+			                sizeof(unsigned short)*2*(stripLengths[0] + stripLengths[1]), stripPool);
+			break;
+		case RENDER_PATH_CODES:
+			state.bindBuffer(GL_TEXTURE_BUFFER, buffers[4]);
+			glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(unsigned int)*visible, pathCodePool);
+			break;
+		default:
+			break;
+		}
+		profiler.end(FrameProfiler::PHASE_UPLOAD);
+
+		profiler.begin(FrameProfiler::PHASE_DRAW, true);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		state.polygonMode(wireframe ? GL_LINE : GL_FILL);
+		if (wireframe) {
+			state.lineWidth(2.0);
+		}
+
+		state.useProgram(shader->getHandle());
+		glUniformMatrix4fv(projMatrixLocation, 1, GL_FALSE, projectionMatrix.m);
+		glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, modelview.m);
+
+		// normal, height, path code and color ramp textures
+		state.bindTexture(0, GL_TEXTURE_2D, normalTexture);
+		state.bindTexture(1, GL_TEXTURE_2D, heightTexture);
+		state.bindTexture(2, GL_TEXTURE_BUFFER, pathCodeTexture);
+		state.bindTexture(3, GL_TEXTURE_1D, colorRampTexture);
+
+		state.uniform1i(vertexFormatLocation, renderModeFormats[renderMode]);
+		state.bindVertexArray(arrays[renderMode]);
+
+		if (renderMode == RENDER_STRIPS) {
+			// separate strips for left and right trees, a tree can be
+			// culled entirely and some drivers drop the whole draw when a
+			// count is zero.
+			GLint first[2];
+			GLsizei count[2];
+			GLsizei strips = 0;
+			GLint offset = 0;
+			for (int i = 0; i < 2; ++i) {
+				if (stripLengths[i] > 0) {
+					first[strips] = offset;
+					count[strips] = (GLsizei) stripLengths[i];
+					strips++;
+				}
+				offset += stripLengths[i];
+			}
+			glMultiDrawArrays(GL_TRIANGLE_STRIP, first, count, strips);
+		} else {
+			glDrawArrays(GL_TRIANGLES, 0, visible*3);
+		}
+
+		profiler.end(FrameProfiler::PHASE_DRAW);
 
 		GL_PRINT_ERROR;
 		last = current;
-		SDL_GL_SwapWindow(window);
+
+		if (options.headless) {
+			profiler.begin(FrameProfiler::PHASE_READBACK, true);
+			// frame N is queued, frame N-1 has had a frame to transfer.
+			framebuffer.beginReadback();
+			write_frame(options, framebuffer, pixels);
+			profiler.end(FrameProfiler::PHASE_READBACK);
+		} else {
+			profiler.begin(FrameProfiler::PHASE_SWAP);
+			SDL_GL_SwapWindow(window);
+			profiler.end(FrameProfiler::PHASE_SWAP);
+		}
+
+		profiler.endFrame();
+
+		if (timed && profiler.frame() >= options.frames) {
+			running = 0;
+		}
 	}
 
-	glDeleteTextures(1, &normalTexture);
-	glDeleteVertexArrays(3, arrays);
-	glDeleteBuffers(3, buffers);
+	int ret = 0;
+	if (options.headless) {
+		// the last frame is still queued.
+		write_frame(options, framebuffer, pixels, true);
+	}
+	if (timed) {
+		ret = write_report(options, profiler, triangles);
+	}
+	if (options.csv) {
+		profiler.writeCSV(options.csv);
+	}
+
+	TRACE_WRITE("trace.json");
+
+	if (streamRawBytes > 0) {
+		printf("stream: %zu bytes, %.2f%% of the raw mesh, %zu frames skipped\n",
+		       streamBytes, 100.0*streamBytes/streamRawBytes, streamDropped);
+	}
+
+	release();
+
+	return ret;
 }
@@ -3,6 +3,74 @@
 
 #include "terrain_patch.hpp"
 
-void render(TerrainPatch *patch);
+#include <stddef.h>
+
+struct RenderOptions
+{
+	// camera path file, see CameraPath. NULL for interactive mode.
+	const char *flythrough;
+
+	// number of frames rendered in flythrough mode.
+	size_t frames;
+
+	// file to write the flythrough report into, NULL for stdout only.
+	const char *report;
+
+	// file to write the per-frame phase timings into, can be NULL.
+	const char *csv;
+
+	// name of the render mode to start with, NULL for default.
+	const char *mode;
+
+	// render offscreen through EGL instead of a SDL window. Like
+	// flythrough, renders options.frames and writes the report.
+	bool headless;
+
+	// printf pattern of files to write the rendered frames into as PPM,
+	// e.g. "frame_%05d.ppm". Only in headless mode, can be NULL.
+	const char *output;
+
+	int width, height;
+
+	// POSIX shared memory name to export every frame's tessellation into,
+	// e.g. "/roam_mesh", see MeshExport. NULL disables the export.
+	const char *exportName;
+
+	// Unix socket path to stream the tessellation to a remote viewer as
+	// changes between frames, see TessellationEncoder. Can be NULL.
+	const char *streamSocket;
+
+	// skip terrain hidden behind other terrain, see
+	// TerrainPatch::setOcclusionCulling(). Ignored while exporting or
+	// streaming.
+	bool occlusionCulling;
+
+	RenderOptions()
+		: flythrough(NULL)
+		, frames(1000)
+		, report(NULL)
+		, csv(NULL)
+		, mode(NULL)
+		, headless(false)
+		, output(NULL)
+		, width(1024)
+		, height(768)
+		, exportName(NULL)
+		, streamSocket(NULL)
+		, occlusionCulling(false)
+	{
+	}
+};
+
+/**
+ * Open a window and render the given patch until the window is closed, or
+ * in flythrough and headless modes until options.frames are rendered.
+ *
+ * @param patch to render
+ * @param options
+ *
+ * @return 0 on success, != 0 on failure.
+ */
+int render(TerrainPatch *patch, const RenderOptions &options = RenderOptions());
 
 #endif // OPENGL_RENDER_H
@@ -0,0 +1,119 @@
+#include "gfx/render_state.hpp"
+
+#include <stddef.h>
+
+static const GLuint UNKNOWN = ~0u;
+
+RenderState::RenderState()
+{
+	invalidate();
+}
+
+void RenderState::invalidate()
+{
+	m_program = UNKNOWN;
+	m_vertexArray = UNKNOWN;
+	m_arrayBuffer = UNKNOWN;
+	m_textureBuffer = UNKNOWN;
+	m_activeTexture = UNKNOWN;
+
+	for (unsigned int i = 0; i < TEXTURE_UNITS; ++i) {
+		m_textures[i].target = GL_NONE;
+		m_textures[i].texture = UNKNOWN;
+	}
+
+	m_polygonMode = GL_NONE;
+	m_lineWidth = -1.0f;
+	m_intUniforms.clear();
+}
+
+void RenderState::useProgram(GLuint program)
+{
+	if (program != m_program) {
+		glUseProgram(program);
+		m_program = program;
+	}
+}
+
+void RenderState::bindVertexArray(GLuint array)
+{
+	if (array != m_vertexArray) {
+		glBindVertexArray(array);
+		m_vertexArray = array;
+	}
+}
+
+void RenderState::bindBuffer(GLenum target, GLuint buffer)
+{
+	GLuint *current = NULL;
+	switch (target) {
+	case GL_ARRAY_BUFFER:   current = &m_arrayBuffer; break;
+	case GL_TEXTURE_BUFFER: current = &m_textureBuffer; break;
+	default:
+		glBindBuffer(target, buffer);
+		return;
+	}
+
+	if (buffer != *current) {
+		glBindBuffer(target, buffer);
+		*current = buffer;
+	}
+}
+
+void RenderState::bindTexture(unsigned int unit, GLenum target, GLuint texture)
+{
+	if (unit < TEXTURE_UNITS &&
+	    m_textures[unit].target == target && m_textures[unit].texture == texture) {
+		return;
+	}
+
+	if (unit != m_activeTexture) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		m_activeTexture = unit;
+	}
+
+	glBindTexture(target, texture);
+
+	if (unit < TEXTURE_UNITS) {
+		m_textures[unit].target = target;
+		m_textures[unit].texture = texture;
+	}
+}
+
+void RenderState::polygonMode(GLenum mode)
+{
+	if (mode != m_polygonMode) {
+		glPolygonMode(GL_FRONT_AND_BACK, mode);
+		m_polygonMode = mode;
+	}
+}
+
+void RenderState::lineWidth(GLfloat width)
+{
+	if (width != m_lineWidth) {
+		glLineWidth(width);
+		m_lineWidth = width;
+	}
+}
+
+void RenderState::uniform1i(GLint location, GLint value)
+{
+	if (location < 0)
+		return;
+
+	for (size_t i = 0; i < m_intUniforms.size(); ++i) {
+		IntUniform &u = m_intUniforms[i];
+		if (u.program == m_program && u.location == location) {
+			if (u.value != value) {
+				glUniform1i(location, value);
+				u.value = value;
+			}
+			return;
+		}
+	}
+
+	glUniform1i(location, value);
+
+	IntUniform u = { m_program, location, value };
+	m_intUniforms.push_back(u);
+}
@@ -0,0 +1,90 @@
+#ifndef RENDER_STATE_HPP
+#define RENDER_STATE_HPP
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+
+#include <vector>
+
+/**
+ * Shadow copy of the OpenGL state touched by the render loop.
+ *
+ * Each setter compares against the last value it set and calls OpenGL only
+ * when the value changes, so the render loop can state everything it needs
+ * per draw without paying for the redundant calls.
+ *
+ * Only state changed through this class is tracked. After changing the same
+ * state directly, call invalidate() before using the class again.
+ */
+class RenderState
+{
+public:
+	// texture units tracked, more are passed through unfiltered.
+	static const unsigned int TEXTURE_UNITS = 8;
+
+	RenderState();
+
+	/**
+	 * Forget all cached values, the next call of each setter reaches
+	 * OpenGL.
+	 */
+	void invalidate();
+
+	void useProgram(GLuint program);
+	void bindVertexArray(GLuint array);
+
+	/**
+	 * @param GL_ARRAY_BUFFER or GL_TEXTURE_BUFFER, others are not filtered.
+	 * @param buffer
+	 */
+	void bindBuffer(GLenum target, GLuint buffer);
+
+	/**
+	 * Bind texture into a texture unit, switching the active unit only
+	 * when needed.
+	 *
+	 * @param unit starting from 0, not GL_TEXTURE0.
+	 * @param target such as GL_TEXTURE_2D
+	 * @param texture
+	 */
+	void bindTexture(unsigned int unit, GLenum target, GLuint texture);
+
+	void polygonMode(GLenum mode);
+	void lineWidth(GLfloat width);
+
+	/**
+	 * Set integer uniform of the current program.
+	 *
+	 * Values are remembered per program, so switching programs keeps them.
+	 */
+	void uniform1i(GLint location, GLint value);
+
+private:
+	struct TextureBinding
+	{
+		GLenum target;
+		GLuint texture;
+	};
+
+	struct IntUniform
+	{
+		GLuint program;
+		GLint location;
+		GLint value;
+	};
+
+	// ~0 means unknown, the first call always goes through.
+	GLuint m_program;
+	GLuint m_vertexArray;
+	GLuint m_arrayBuffer;
+	GLuint m_textureBuffer;
+	unsigned int m_activeTexture;
+	TextureBinding m_textures[TEXTURE_UNITS];
+	GLenum m_polygonMode;
+	GLfloat m_lineWidth;
+
+	// few uniforms are ever set, linear search is fastest.
+	std::vector<IntUniform> m_intUniforms;
+};
+
+#endif // RENDER_STATE_HPP
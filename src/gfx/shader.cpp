@@ -1,45 +1,182 @@
 #include "gfx/shader.hpp"
 
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <iostream>
 #include <iterator>
 #include <fstream>
+#include <vector>
+
+static const char *defaultCacheDirectory()
+{
+	const char *env = getenv("ROAM_SHADER_CACHE");
+	return env ? env : ".shader_cache";
+}
+
+std::string Shader::s_cacheDirectory = defaultCacheDirectory();
+
+// identifies the cache file format.
+static const char cacheMagic[8] = { 'R', 'O', 'A', 'M', 'S', 'H', 'B', '1' };
+
+/**
+ * 64-bit FNV-1a hash.
+ */
+static uint64_t hash(const std::string &data, uint64_t h = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < data.size(); ++i) {
+		h ^= (unsigned char) data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static bool hasExtension(const char *name)
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+
+	for (GLint i = 0; i < count; ++i) {
+		const char *ext = (const char *) glGetStringi(GL_EXTENSIONS, i);
+		if (ext && strcmp(ext, name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Identifies the driver, binaries are not portable across drivers or even
+ * driver versions.
+ */
+static std::string driverString()
+{
+	const char *vendor = (const char *) glGetString(GL_VENDOR);
+	const char *renderer = (const char *) glGetString(GL_RENDERER);
+	const char *version = (const char *) glGetString(GL_VERSION);
+
+	std::string driver;
+	driver += vendor ? vendor : "";
+	driver += "\n";
+	driver += renderer ? renderer : "";
+	driver += "\n";
+	driver += version ? version : "";
+
+	return driver;
+}
 
 Shader::Shader(const std::string &vertex, const std::string &fragment)
-	: m_vertex(vertex)
+	: m_handle(0)
+	, m_vertexHandle(0)
+	, m_fragmentHandle(0)
+	, m_vertex(vertex)
 	, m_fragment(fragment)
+	, m_cached(false)
+{
+}
+
+void Shader::setCacheDirectory(const std::string &directory)
 {
+	s_cacheDirectory = directory;
 }
 
 int Shader::init()
 {
-	m_handle = glCreateProgram();
-	if ((m_vertexHandle = loadShader(m_vertex, GL_VERTEX_SHADER)) == -1) {
+	if (begin() != 0) {
 		return -1;
 	}
-	if ((m_fragmentHandle = loadShader(m_fragment, GL_FRAGMENT_SHADER)) == -1) {
+
+	return finish();
+}
+
+int Shader::begin()
+{
+	std::string vertexSource, fragmentSource;
+
+	if (readSource(m_vertex, vertexSource) != 0 ||
+	    readSource(m_fragment, fragmentSource) != 0) {
 		return -1;
 	}
 
+	static bool binariesSupported = true;
+	static bool checked = false;
+
+	if (!checked) {
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		binariesSupported = formats > 0;
+
+		// let the driver compile on as many threads as it likes.
+		if (hasExtension("GL_KHR_parallel_shader_compile")) {
+			glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+		}
+		checked = true;
+	}
+
+	m_handle = glCreateProgram();
+	m_cached = false;
+	m_cacheFile.clear();
+
+	if (binariesSupported && !s_cacheDirectory.empty()) {
+		uint64_t key = hash(vertexSource);
+		key = hash(fragmentSource, key);
+		key = hash(driverString(), key);
+
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long) key);
+		m_cacheFile = s_cacheDirectory + name;
+
+		if (loadBinary() == 0) {
+			printf("loaded %s + %s from %s.\n", m_vertex.c_str(), m_fragment.c_str(), m_cacheFile.c_str());
+			m_cached = true;
+			return 0;
+		}
+	}
+
+	m_vertexHandle = compileShader(vertexSource, GL_VERTEX_SHADER);
+	m_fragmentHandle = compileShader(fragmentSource, GL_FRAGMENT_SHADER);
+
 	glAttachShader(m_handle, m_vertexHandle);
 	glAttachShader(m_handle, m_fragmentHandle);
 
 	// force attribute locations
 	// http://stackoverflow.com/questions/4635913/explicit-vs-automatic-attribute-location-binding-for-opengl-shaders/4638906#4638906
 	glBindAttribLocation(m_handle, 0, "position");
-	glBindAttribLocation(m_handle, 1, "color");
 	glBindAttribLocation(m_handle, 2, "normalTexel");
+	glBindAttribLocation(m_handle, 3, "gridCoord");
+
+	if (!m_cacheFile.empty()) {
+		glProgramParameteri(m_handle, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
 
 	glLinkProgram(m_handle);
 
+	return 0;
+}
+
+int Shader::finish()
+{
+	if (m_cached) {
+		return 0;
+	}
+
+	if (checkShader(m_vertexHandle, m_vertex) != 0 ||
+	    checkShader(m_fragmentHandle, m_fragment) != 0) {
+		return -1;
+	}
+
 	// query the link status
 	GLint linked = 0, len = 0, len2 = 0;
 	glGetProgramiv(m_handle, GL_LINK_STATUS, &linked);
 	glGetProgramiv(m_handle, GL_INFO_LOG_LENGTH, &len);
 
-	GLchar *log = new GLchar[len];
-	memset(log, 0, len);
-	glGetProgramInfoLog(m_handle, len, &len, log);
+	GLchar *log = new GLchar[len+1];
+	memset(log, 0, len+1);
+	glGetProgramInfoLog(m_handle, len, &len2, log);
 
 	if (!linked) {
 		printf("linking FAILED.\n");
@@ -47,13 +184,19 @@ int Shader::init()
 		printf("linking SUCCESS.\n");
 	}
 
-	printf("received %d (%d) chars of loginfo:\n\t%s\n", len, len2, log);
+	if (len2 > 0) {
+		printf("received %d (%d) chars of loginfo:\n\t%s\n", len, len2, log);
+	}
 	delete [] log;
 
 	if (!linked) {
 		return -1;
 	}
-	
+
+	if (!m_cacheFile.empty()) {
+		saveBinary();
+	}
+
 	return 0;
 }
 
@@ -62,25 +205,110 @@ Shader::~Shader()
 	disable();
 
 	// detach shaders.
-	glDetachShader(m_handle, m_vertexHandle);
-	glDetachShader(m_handle, m_fragmentHandle);
+	if (m_vertexHandle) {
+		glDetachShader(m_handle, m_vertexHandle);
+		glDeleteShader(m_vertexHandle);
+	}
+	if (m_fragmentHandle) {
+		glDetachShader(m_handle, m_fragmentHandle);
+		glDeleteShader(m_fragmentHandle);
+	}
 
-	// delete shaders and program
-	glDeleteShader(m_vertexHandle);
-	glDeleteShader(m_fragmentHandle);
-	glDeleteShader(m_handle);
+	glDeleteProgram(m_handle);
 }
 
-GLuint Shader::loadShader(const std::string &path, GLenum shaderType)
+int Shader::loadBinary()
 {
-	std::string type;
-	switch (shaderType) {
-	case GL_VERTEX_SHADER: type = "GL_VERTEX_SHADER"; break;
-	case GL_FRAGMENT_SHADER: type = "GL_FRAGMENT_SHADER"; break;
+	FILE *fd = fopen(m_cacheFile.c_str(), "rb");
+	if (!fd) {
+		return -1;
+	}
+
+	char magic[sizeof(cacheMagic)];
+	uint32_t format = 0, length = 0;
+	int ret = -1;
+
+	if (fread(magic, sizeof(magic), 1, fd) == 1 &&
+	    memcmp(magic, cacheMagic, sizeof(magic)) == 0 &&
+	    fread(&format, sizeof(format), 1, fd) == 1 &&
+	    fread(&length, sizeof(length), 1, fd) == 1 &&
+	    length > 0) {
+		std::vector<char> binary(length);
+
+		if (fread(&binary[0], length, 1, fd) == 1) {
+			glProgramBinary(m_handle, format, &binary[0], length);
+
+			// driver rejects binaries it doesn't like, e.g. after update.
+			GLint linked = 0;
+			glGetProgramiv(m_handle, GL_LINK_STATUS, &linked);
+			ret = linked ? 0 : -1;
+		}
+	}
+
+	fclose(fd);
+
+	if (ret != 0) {
+		printf("ignoring stale shader cache %s.\n", m_cacheFile.c_str());
+	}
+
+	return ret;
+}
+
+void Shader::saveBinary() const
+{
+	GLint length = 0;
+	glGetProgramiv(m_handle, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) {
+		return;
+	}
+
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(m_handle, length, &length, &format, &binary[0]);
+
+	if (mkdir(s_cacheDirectory.c_str(), 0755) != 0 && errno != EEXIST) {
+		printf("Unable to create shader cache %s : %s\n", s_cacheDirectory.c_str(), strerror(errno));
+		return;
+	}
+
+	// write into a temporary file first so that readers never see a
+	// partial binary.
+	std::string tmp = m_cacheFile + ".tmp";
+	FILE *fd = fopen(tmp.c_str(), "wb");
+	if (!fd) {
+		printf("Unable to open file %s for writing\n", tmp.c_str());
+		return;
+	}
+
+	uint32_t format32 = format, length32 = length;
+	bool ok = fwrite(cacheMagic, sizeof(cacheMagic), 1, fd) == 1 &&
+	          fwrite(&format32, sizeof(format32), 1, fd) == 1 &&
+	          fwrite(&length32, sizeof(length32), 1, fd) == 1 &&
+	          fwrite(&binary[0], length, 1, fd) == 1;
+
+	if (fclose(fd) != 0 || !ok || rename(tmp.c_str(), m_cacheFile.c_str()) != 0) {
+		printf("Unable to write shader cache %s\n", m_cacheFile.c_str());
+		remove(tmp.c_str());
 	}
+}
 
+GLuint Shader::loadShader(const std::string &path, GLenum shaderType)
+{
 	std::string contents;
+	if (readSource(path, contents) != 0) {
+		return -1;
+	}
+
+	GLuint handle = compileShader(contents, shaderType);
+	if (checkShader(handle, path) != 0) {
+		return -1;
+	}
 
+	return handle;
+}
+
+int Shader::readSource(const std::string &path, std::string &contents) const
+{
 	if (path == "data/shaders/basic-fs.glsl") {
 		contents = "void main()\n{\n\tgl_FragColor = gl_Color;\n}";
 	} else if (path == "data/shaders/basic-vs.glsl") {
@@ -93,8 +321,6 @@ GLuint Shader::loadShader(const std::string &path, GLenum shaderType)
 		           "\tgl_FragColor = gl_Color * texel;\n"
 		           "}\n";
 	} else {
-		printf("attempting to load %s form %s.\n", type.c_str(), path.c_str());
-
 		std::ifstream ifs(path.c_str(), std::ifstream::in);
 		if (ifs.fail()) {
 			printf("Foiled reading file: %s\n", path.c_str());
@@ -106,7 +332,13 @@ GLuint Shader::loadShader(const std::string &path, GLenum shaderType)
 		contents = file_c;
 		ifs.close();
 	}
-	const GLchar* ccontents[1] = { (const GLchar *) contents.c_str() };
+
+	return 0;
+}
+
+GLuint Shader::compileShader(const std::string &source, GLenum shaderType)
+{
+	const GLchar* ccontents[1] = { (const GLchar *) source.c_str() };
 
 	GLuint handle;
 	handle = glCreateShader(shaderType);
@@ -114,12 +346,17 @@ GLuint Shader::loadShader(const std::string &path, GLenum shaderType)
 	glShaderSource(handle, 1, ccontents, NULL);
 	glCompileShader(handle);
 
+	return handle;
+}
+
+int Shader::checkShader(GLuint handle, const std::string &path) const
+{
 	GLint compiled = 0, len = 0, len2 = 0;
 	glGetShaderiv(handle, GL_COMPILE_STATUS, &compiled);
 	glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &len);
 
-	GLchar *log = new GLchar[len];
-	memset(log, 0, len);
+	GLchar *log = new GLchar[len+1];
+	memset(log, 0, len+1);
 	glGetShaderInfoLog(handle, len, &len2, log);
 
 	if (!compiled) {
@@ -128,11 +365,14 @@ GLuint Shader::loadShader(const std::string &path, GLenum shaderType)
 		printf("compilation of %s SUCCESS.\n", path.c_str());
 	}
 
-	printf("received %d (%d) of loginfo:\n\t%s\n", len, len2, log);
+	if (len2 > 0) {
+		printf("received %d (%d) of loginfo:\n\t%s\n", len, len2, log);
+	}
+	delete [] log;
 
 	if (!compiled) {
 		return -1;
 	}
 
-	return handle;
+	return 0;
 }
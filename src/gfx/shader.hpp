@@ -18,6 +18,12 @@ private:
 	// file paths
 	std::string m_vertex, m_fragment;
 
+	// cache file of the linked program, empty if caching is not possible.
+	std::string m_cacheFile;
+
+	// program was loaded from the cache and needs no compiling.
+	bool m_cached;
+
 public:
 	/**
 	 * Consturctor.
@@ -26,17 +32,46 @@ public:
 	 * @param path to the fragment shader 
 	 */
 	Shader(const std::string &vertex, const std::string &fragment);
-	~Shader();
+	virtual ~Shader();
 
 	/**
 	 * Initializexs the shader.
 	 *
 	 * Tries to load the resources and complie them on the GPU.
+	 * Same as begin() followed by finish().
 	 *
 	 * @return on success return 0, on failure != 0
 	 */
 	int init();
 
+	/**
+	 * Start the initialization without waiting for the result.
+	 *
+	 * Loads the program binary from the cache when there's one for the
+	 * same sources and driver, otherwise submits the shaders for
+	 * compiling and linking. Beginning many shaders before finishing any
+	 * lets the driver compile them in parallel.
+	 *
+	 * @return on success return 0, on failure != 0
+	 */
+	int begin();
+
+	/**
+	 * Wait for the compiling and linking to finish, and store the linked
+	 * program into the cache.
+	 *
+	 * @return on success return 0, on failure != 0
+	 */
+	int finish();
+
+	/**
+	 * Set the directory where linked programs are cached.
+	 *
+	 * Default is the value of ROAM_SHADER_CACHE environment variable or
+	 * ".shader_cache". Empty string disables caching.
+	 */
+	static void setCacheDirectory(const std::string &directory);
+
 	virtual void enable() const;
 	static void disable();
 
@@ -69,6 +104,41 @@ protected:
 	 */
 	GLuint loadShader(const std::string &path, GLenum shaderType);
 
+	/**
+	 * Read the source of a shader.
+	 *
+	 * @return 0 on success, != 0 on failure.
+	 */
+	int readSource(const std::string &path, std::string &contents) const;
+
+	/**
+	 * Submit the source for compiling, status is checked in finish().
+	 *
+	 * @return handle to the shader.
+	 */
+	GLuint compileShader(const std::string &source, GLenum shaderType);
+
+	/**
+	 * Check and print the compile status of a shader.
+	 *
+	 * @return 0 on success, != 0 on failure.
+	 */
+	int checkShader(GLuint handle, const std::string &path) const;
+
+	/**
+	 * Try to load the program from m_cacheFile.
+	 *
+	 * @return 0 on success, != 0 on failure.
+	 */
+	int loadBinary();
+
+	/**
+	 * Store the linked program into m_cacheFile.
+	 */
+	void saveBinary() const;
+
+	static std::string s_cacheDirectory;
+
 };
 
 inline void Shader::enable() const
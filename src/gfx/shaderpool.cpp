@@ -28,3 +28,38 @@ Shader *ShaderPool::get(const std::string &vertex, const std::string &fragment)
 
 	return m_shaders[vertex + fragment];
 }
+
+int ShaderPool::preload(const std::vector<std::pair<std::string, std::string> > &shaders)
+{
+	std::vector<Shader *> pending;
+	std::vector<std::string> keys;
+	int ret = 0;
+
+	for (size_t i = 0; i < shaders.size(); ++i) {
+		const std::string &vertex = shaders[i].first;
+		const std::string &fragment = shaders[i].second;
+		if (m_shaders.find(vertex + fragment) != m_shaders.end()) {
+			continue;
+		}
+
+		Shader *tmp = new Shader(vertex, fragment);
+		if (tmp->begin() != 0) {
+			delete tmp;
+			ret = -1;
+			continue;
+		}
+		pending.push_back(tmp);
+		keys.push_back(vertex + fragment);
+	}
+
+	for (size_t i = 0; i < pending.size(); ++i) {
+		if (pending[i]->finish() != 0) {
+			delete pending[i];
+			ret = -1;
+			continue;
+		}
+		m_shaders[keys[i]] = pending[i];
+	}
+
+	return ret;
+}
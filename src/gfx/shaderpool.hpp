@@ -3,6 +3,8 @@
 
 #include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 class Shader;
 
@@ -27,6 +29,18 @@ public:
 	 */
 	Shader *get(const std::string &vertex, const std::string &fragment);
 
+	/**
+	 * Initialize many shaders at once.
+	 *
+	 * All shaders are submitted for compiling before waiting for any of
+	 * them, so the driver may compile them in parallel. Shaders that fail
+	 * are not added to the pool.
+	 *
+	 * @param (vertex, fragment) pairs.
+	 * @return 0 if all shaders were loaded, != 0 otherwise.
+	 */
+	int preload(const std::vector<std::pair<std::string, std::string> > &shaders);
+
 };
 
 #endif // SHADERPOOL_HPP
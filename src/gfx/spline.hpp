@@ -47,8 +47,8 @@ static T spline(T x, size_t nknots, T *knots)
 	x = clamp<T>(x, 0, 1) * nspans;
 	span = (int) x;
 
-	if (span >= nknots - 3) {
-		span = nknots - 3;
+	if (span >= nspans) {
+		span = nspans - 1;
 	}
 
 	x -= span;
@@ -83,24 +83,38 @@ static T spline(T x, size_t nknots, T *knots)
 
 /**
  * Extension to spline function to work with colors.
+ *
+ * Only the four knots of the span are used, so the span is found here
+ * and evaluated per component as a spline of one span.
  */
 template <typename T>
-static Vec3<T> spline(T param, size_t nknots, Vec3<T> *knots)
+static Vec3<T> spline(T param, size_t nknots, const Vec3<T> *knots)
 {
-	T *x = (T*) alloca(nknots * sizeof(T));
-	T *y = (T*) alloca(nknots * sizeof(T));
-	T *z = (T*) alloca(nknots * sizeof(T));
-
-	for (size_t i=0; i<nknots; ++i) {
-		x[i] = knots[i].x;
-		y[i] = knots[i].y;
-		z[i] = knots[i].z;
+	int nspans = nknots - 3;
+
+	assert(nspans >= 1);
+
+	T x = clamp<T>(param, 0, 1) * nspans;
+	int span = (int) x;
+
+	if (span >= nspans) {
+		span = nspans - 1;
+	}
+
+	x -= span;
+	knots += span;
+
+	T cx[4], cy[4], cz[4];
+	for (int i = 0; i < 4; ++i) {
+		cx[i] = knots[i].x;
+		cy[i] = knots[i].y;
+		cz[i] = knots[i].z;
 	}
 
 	return Vec3<T>(
-		spline<T>(param, nknots, x),
-		spline<T>(param, nknots, y),
-		spline<T>(param, nknots, z));
+		spline<T>(x, 4, cx),
+		spline<T>(x, 4, cy),
+		spline<T>(x, 4, cz));
 }
 
 #endif // SPLINE_HPP
@@ -1,14 +1,24 @@
 #include "heightmap.h"
+#include "cpu_features.h"
 #include "util.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
 #include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HEIGHTMAP_X86
+#include <immintrin.h>
+#endif
 
 void Heightmap_print(Heightmap *map)
 {
@@ -20,19 +30,7 @@ void Heightmap_print(Heightmap *map)
 	printf("  min: %f\n", map->minZ);
 	printf("  max: %f\n", map->maxZ);
 
-	size_t histogram[11] = {0};
-	size_t i;
-
-	for (i=0; i<map->width*map->height; ++i) {
-		float val = map->map[i];
-		val *= 10;
-		if (val >10) {
-			printf("WAD: %f\n", map->map[i]);
-			histogram[10]++;
-		} else {
-			histogram[(int)val]++;
-		}
-	}
+	const size_t *histogram = map->histogram;
 
 	printf("  histogram {\n");
 	printf("    0.0 - 0.1 : %lu,\n", histogram[0]);
@@ -53,36 +51,270 @@ void Heightmap_print(Heightmap *map)
 
 Heightmap *Heightmap_read(const char *filename)
 {
+	HeightmapFile file;
+	if (Heightmap_open_file(&file, filename) != 0)
+		return NULL;
+
+	const char *end = file.text + file.size;
+	size_t count = Heightmap_count_values(file.values, end);
 	Heightmap *map = NULL;
-	FILE *fd = fopen(filename, "r");
-	if (!fd) {
-		printf("Unable to open file %s : %s\n", filename, strerror(errno));
-		return map;
+
+	if (count != file.width*file.height) {
+		printf("Heightmap %s has %zu heights instead of %zu x %zu\n",
+		       filename, count, file.width, file.height);
+	} else {
+		map = Heightmap_create(file.width, file.height);
+	}
+
+	if (map && Heightmap_parse_values(file.values, end, map->map, &map->minZ, &map->maxZ) != 0) {
+		Heightmap_delete(map);
+		map = NULL;
+	}
+
+	Heightmap_close_file(&file);
+
+	return map;
+}
+
+Heightmap *Heightmap_create(size_t width, size_t height)
+{
+	Heightmap *map = malloc(sizeof(Heightmap));
+	if (!map) {
+		printf("Unable to allocate %zu x %zu heightmap\n", width, height);
+		return NULL;
+	}
+
+	map->map = malloc(width*height*sizeof(float));
+	if (!map->map) {
+		printf("Unable to allocate %zu x %zu heightmap\n", width, height);
+		free(map);
+		return NULL;
 	}
 
-	map = malloc(sizeof(Heightmap));
 	map->normal_map = NULL;
+	map->width = width;
+	map->height = height;
+	map->minZ = FLT_MAX;
+	map->maxZ = -FLT_MAX;
+	memset(map->histogram, 0, sizeof(map->histogram));
 
-	fscanf(fd, "%lu ", &map->width);
-	fscanf(fd, "%lu", &map->height);
+	return map;
+}
 
-	map->map = malloc(map->width*map->height*sizeof(float));
-	memset(map->map, 0, map->width*map->height*sizeof(float));
+static int is_space(char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
 
-	float *ptr = map->map;
+// longest number parsed, e.g. "-1.23456789e+10" fits easily.
+#define TOKEN_SIZE 64
 
-	size_t i;
+/**
+ * Copy the next whitespace separated token of [p, end) into token, NUL
+ * terminated, as the text of a mapped file isn't.
+ *
+ * @return where the token ends, NULL if there is none or it is too long.
+ */
+static const char *next_token(const char *p, const char *end, char token[TOKEN_SIZE])
+{
+	while (p < end && is_space(*p))
+		++p;
 
-	for (i=0; i<map->height*map->width; ++i) {
-		fscanf(fd, "%f", ptr);
-		map->minZ = MIN(map->minZ, *ptr);
-		map->maxZ = MAX(map->maxZ, *ptr);
-		++ptr;
+	size_t length = 0;
+	while (p < end && !is_space(*p)) {
+		if (length + 1 == TOKEN_SIZE)
+			return NULL;
+		token[length++] = *p++;
 	}
 
-	fclose(fd);
+	token[length] = 0;
+	return length ? p : NULL;
+}
 
-	return map;
+int Heightmap_open_file(HeightmapFile *file, const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Unable to open file %s : %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		printf("Heightmap %s is empty\n", filename);
+		close(fd);
+		return -1;
+	}
+
+	void *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (text == MAP_FAILED) {
+		printf("Unable to map file %s : %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	// read front to back, once.
+	madvise(text, st.st_size, MADV_SEQUENTIAL);
+
+	file->text = (const char *) text;
+	file->size = st.st_size;
+
+	const char *end = file->text + file->size;
+	char token[TOKEN_SIZE];
+	char *rest;
+
+	const char *p = next_token(file->text, end, token);
+	file->width = p ? strtoul(token, &rest, 10) : 0;
+	if (p && *rest == 0) {
+		p = next_token(p, end, token);
+		file->height = p ? strtoul(token, &rest, 10) : 0;
+	}
+
+	if (!p || *rest != 0 || file->width < 2 || file->height < 2) {
+		printf("Heightmap %s has no valid dimensions\n", filename);
+		Heightmap_close_file(file);
+		return -1;
+	}
+
+	file->values = p;
+
+	return 0;
+}
+
+void Heightmap_close_file(HeightmapFile *file)
+{
+	munmap((void *) file->text, file->size);
+	file->text = NULL;
+	file->size = 0;
+}
+
+const char *Heightmap_split_values(const HeightmapFile *file, size_t piece, size_t pieces)
+{
+	const char *end = file->text + file->size;
+
+	if (piece == 0)
+		return file->values;
+	if (piece >= pieces)
+		return end;
+
+	// move to the end of the height cut in half.
+	const char *p = file->values + (end - file->values) / pieces * piece;
+	while (p < end && !is_space(*p))
+		++p;
+
+	return p;
+}
+
+size_t Heightmap_count_values(const char *begin, const char *end)
+{
+	size_t count = 0;
+	int space = 1;
+
+	for (; begin < end; ++begin) {
+		int c = is_space(*begin);
+		count += space & !c;
+		space = c;
+	}
+
+	return count;
+}
+
+/**
+ * Parse the height starting at p.
+ *
+ * @return where the height ends, NULL if it isn't one.
+ */
+static const char *parse_height(const char *p, const char *end, float *value)
+{
+	char token[TOKEN_SIZE];
+	char *rest;
+
+	// there is a token at p, so only a too long one is missing.
+	p = next_token(p, end, token);
+	if (p == NULL) {
+		printf("Invalid height, longer than %d characters\n", TOKEN_SIZE - 1);
+		return NULL;
+	}
+
+	*value = strtof(token, &rest);
+	if (*rest != 0) {
+		printf("Invalid height %s\n", token);
+		return NULL;
+	}
+
+	return p;
+}
+
+int Heightmap_parse_values(const char *begin, const char *end, float *out,
+                           float *minZ, float *maxZ)
+{
+	float lo = *minZ, hi = *maxZ;
+
+	for (;;) {
+		while (begin < end && is_space(*begin))
+			++begin;
+		if (begin == end)
+			break;
+
+		float value;
+		begin = parse_height(begin, end, &value);
+		if (begin == NULL)
+			return -1;
+
+		*out++ = value;
+		lo = MIN(lo, value);
+		hi = MAX(hi, value);
+	}
+
+	*minZ = lo;
+	*maxZ = hi;
+
+	return 0;
+}
+
+int Heightmap_parse_decimated(const HeightmapFile *file, const char *begin, const char *end,
+                              size_t first, size_t step, float *out, size_t *count,
+                              float *minZ, float *maxZ)
+{
+	const size_t width = (file->width - 1) / step + 1;
+	const size_t height = (file->height - 1) / step + 1;
+	size_t x = first % file->width;
+	size_t y = first / file->width;
+	size_t index = first;
+	float lo = *minZ, hi = *maxZ;
+
+	for (;;) {
+		while (begin < end && is_space(*begin))
+			++begin;
+		if (begin == end)
+			break;
+
+		if (x % step == 0 && y % step == 0 && y / step < height) {
+			float value;
+			begin = parse_height(begin, end, &value);
+			if (begin == NULL)
+				return -1;
+
+			out[(y / step)*width + x / step] = value;
+			lo = MIN(lo, value);
+			hi = MAX(hi, value);
+		} else {
+			while (begin < end && !is_space(*begin))
+				++begin;
+		}
+
+		++index;
+		if (++x == file->width) {
+			x = 0;
+			++y;
+		}
+	}
+
+	*count = index - first;
+	*minZ = lo;
+	*maxZ = hi;
+
+	return 0;
 }
 
 void Heightmap_delete(Heightmap *map)
@@ -94,72 +326,546 @@ void Heightmap_delete(Heightmap *map)
 	free(map);
 }
 
+static size_t histogram_bin(float height)
+{
+	float val = height * 10;
+
+	// 1.0 and anything out of range, NaN included, go to the last bin.
+	if (!(val >= 0 && val < HEIGHTMAP_HISTOGRAM_BINS - 1))
+		return HEIGHTMAP_HISTOGRAM_BINS - 1;
+
+	return (size_t) val;
+}
+
+/**
+ * Normalized heights of a row into out, which may be the row itself.
+ */
+static void normalize_row(const float *row, float *out, size_t width, float maxZ, size_t *histogram)
+{
+	size_t x;
+	for (x = 0; x < width; ++x) {
+		out[x] = row[x] / maxZ;
+	}
+
+	if (histogram) {
+		for (x = 0; x < width; ++x) {
+			histogram[histogram_bin(out[x])]++;
+		}
+	}
+}
+
 void Heightmap_normalize(Heightmap *map)
 {
-	int i;
-	for (i=0; i<map->height*map->width; ++i) {
-		map->map[i] /= map->maxZ;
+	memset(map->histogram, 0, sizeof(map->histogram));
+	Heightmap_normalize_rows(map, 0, map->height, map->histogram);
+	Heightmap_set_normalized(map);
+}
+
+void Heightmap_normalize_rows(Heightmap *map, size_t y0, size_t y1, size_t *histogram)
+{
+	size_t y;
+	for (y = y0; y < y1; ++y) {
+		float *row = map->map + map->height*y;
+		normalize_row(row, row, map->width, map->maxZ, histogram);
 	}
-	map->maxZ /= map->maxZ;
+}
+
+void Heightmap_set_normalized(Heightmap *map)
+{
 	map->minZ /= map->maxZ;
+	map->maxZ = 1.0f;
 }
 
-void Heightmap_calculate_normals(Heightmap *map)
+// trial & error value.
+#define NORMAL_STRENGTH 32.0f
+
+/**
+ * Compute normals of the inner texels of a row, the first and the last
+ * texel are left untouched.
+ *
+ * @param above row y-1
+ * @param row   row y
+ * @param below row y+1
+ * @param out   normals of row y, 3 floats per texel
+ * @param width of the rows
+ */
+typedef void (*NormalsRowFunc)(const float *above, const float *row, const float *below,
+                               float *out, size_t width);
+
+static void normals_row_scalar(const float *above, const float *row, const float *below,
+                               float *out, size_t width)
 {
-	int x, y;
+	size_t x;
+	for (x = 1; x + 1 < width; ++x) {
+		// dx: Sobel filter
+		//  -1  0  1
+		//  -2  0  2
+		//  -1  0  1
+		//
+		// dy: Sobel filter
+		//  -1 -2 -1
+		//   0  0  0
+		//   1  2  1
+		float tl = above[x-1];
+		float l  = row[x-1];
+		float bl = below[x-1];
+		float b  = below[x];
+		float br = below[x+1];
+		float r  = row[x+1];
+		float tr = above[x+1];
+		float t  = above[x];
+
+		float dx = tr + 2 * r + br - tl - 2 * l - bl;
+		float dy = bl + 2 * b + br - tl - 2 * t - tr;
+
+		float length = sqrtf(dx*dx + dy*dy + 1.0f/(NORMAL_STRENGTH*NORMAL_STRENGTH));
+
+		out[3*x+0] = dx / length;
+		out[3*x+1] = dy / length;
+		out[3*x+2] = 1.0f / (NORMAL_STRENGTH*length);
+	}
+}
+
+#ifdef HEIGHTMAP_X86
+
+// same as normals_row_scalar, 4 texels at a time.
+__attribute__((target("sse4.2")))
+static void normals_row_sse42(const float *above, const float *row, const float *below,
+                              float *out, size_t width)
+{
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 str = _mm_set1_ps(NORMAL_STRENGTH);
+	const __m128 bias = _mm_set1_ps(1.0f/(NORMAL_STRENGTH*NORMAL_STRENGTH));
+	float nx[4], ny[4], nz[4];
+	size_t x, i;
+
+	for (x = 1; x + 4 < width; x += 4) {
+		__m128 tl = _mm_loadu_ps(above + x - 1);
+		__m128 t  = _mm_loadu_ps(above + x);
+		__m128 tr = _mm_loadu_ps(above + x + 1);
+		__m128 l  = _mm_loadu_ps(row + x - 1);
+		__m128 r  = _mm_loadu_ps(row + x + 1);
+		__m128 bl = _mm_loadu_ps(below + x - 1);
+		__m128 b  = _mm_loadu_ps(below + x);
+		__m128 br = _mm_loadu_ps(below + x + 1);
+
+		// same order of operations as the scalar version.
+		__m128 dx = _mm_add_ps(_mm_add_ps(tr, _mm_mul_ps(two, r)), br);
+		dx = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(dx, tl), _mm_mul_ps(two, l)), bl);
+		__m128 dy = _mm_add_ps(_mm_add_ps(bl, _mm_mul_ps(two, b)), br);
+		dy = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(dy, tl), _mm_mul_ps(two, t)), tr);
+
+		__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), bias));
+
+		_mm_storeu_ps(nx, _mm_div_ps(dx, length));
+		_mm_storeu_ps(ny, _mm_div_ps(dy, length));
+		_mm_storeu_ps(nz, _mm_div_ps(one, _mm_mul_ps(str, length)));
+
+		for (i = 0; i < 4; ++i) {
+			out[3*(x+i)+0] = nx[i];
+			out[3*(x+i)+1] = ny[i];
+			out[3*(x+i)+2] = nz[i];
+		}
+	}
+
+	// tail
+	if (x + 1 < width) {
+		normals_row_scalar(above + x - 1, row + x - 1, below + x - 1, out + 3*(x - 1), width - x + 1);
+	}
+}
+
+// same as normals_row_scalar, 8 texels at a time.
+__attribute__((target("avx2")))
+static void normals_row_avx2(const float *above, const float *row, const float *below,
+                             float *out, size_t width)
+{
+	const __m256 two = _mm256_set1_ps(2.0f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 str = _mm256_set1_ps(NORMAL_STRENGTH);
+	const __m256 bias = _mm256_set1_ps(1.0f/(NORMAL_STRENGTH*NORMAL_STRENGTH));
+	float nx[8], ny[8], nz[8];
+	size_t x, i;
+
+	for (x = 1; x + 8 < width; x += 8) {
+		__m256 tl = _mm256_loadu_ps(above + x - 1);
+		__m256 t  = _mm256_loadu_ps(above + x);
+		__m256 tr = _mm256_loadu_ps(above + x + 1);
+		__m256 l  = _mm256_loadu_ps(row + x - 1);
+		__m256 r  = _mm256_loadu_ps(row + x + 1);
+		__m256 bl = _mm256_loadu_ps(below + x - 1);
+		__m256 b  = _mm256_loadu_ps(below + x);
+		__m256 br = _mm256_loadu_ps(below + x + 1);
+
+		// same order of operations as the scalar version.
+		__m256 dx = _mm256_add_ps(_mm256_add_ps(tr, _mm256_mul_ps(two, r)), br);
+		dx = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(dx, tl), _mm256_mul_ps(two, l)), bl);
+		__m256 dy = _mm256_add_ps(_mm256_add_ps(bl, _mm256_mul_ps(two, b)), br);
+		dy = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(dy, tl), _mm256_mul_ps(two, t)), tr);
+
+		__m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx),
+		                                                           _mm256_mul_ps(dy, dy)), bias));
+
+		_mm256_storeu_ps(nx, _mm256_div_ps(dx, length));
+		_mm256_storeu_ps(ny, _mm256_div_ps(dy, length));
+		_mm256_storeu_ps(nz, _mm256_div_ps(one, _mm256_mul_ps(str, length)));
+
+		for (i = 0; i < 8; ++i) {
+			out[3*(x+i)+0] = nx[i];
+			out[3*(x+i)+1] = ny[i];
+			out[3*(x+i)+2] = nz[i];
+		}
+	}
+
+	if (x + 1 < width) {
+		normals_row_sse42(above + x - 1, row + x - 1, below + x - 1, out + 3*(x - 1), width - x + 1);
+	}
+}
+
+// same as normals_row_scalar, 16 texels at a time. AVX-512 implies FMA,
+// which the compiler would fuse the multiplies and adds into, so results
+// would depend on which texels share a vector.
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void normals_row_avx512(const float *above, const float *row, const float *below,
+                               float *out, size_t width)
+{
+	const __m512 two = _mm512_set1_ps(2.0f);
+	const __m512 one = _mm512_set1_ps(1.0f);
+	const __m512 str = _mm512_set1_ps(NORMAL_STRENGTH);
+	const __m512 bias = _mm512_set1_ps(1.0f/(NORMAL_STRENGTH*NORMAL_STRENGTH));
+	float nx[16], ny[16], nz[16];
+	size_t x, i;
+
+	for (x = 1; x + 16 < width; x += 16) {
+		__m512 tl = _mm512_loadu_ps(above + x - 1);
+		__m512 t  = _mm512_loadu_ps(above + x);
+		__m512 tr = _mm512_loadu_ps(above + x + 1);
+		__m512 l  = _mm512_loadu_ps(row + x - 1);
+		__m512 r  = _mm512_loadu_ps(row + x + 1);
+		__m512 bl = _mm512_loadu_ps(below + x - 1);
+		__m512 b  = _mm512_loadu_ps(below + x);
+		__m512 br = _mm512_loadu_ps(below + x + 1);
+
+		// same order of operations as the scalar version.
+		__m512 dx = _mm512_add_ps(_mm512_add_ps(tr, _mm512_mul_ps(two, r)), br);
+		dx = _mm512_sub_ps(_mm512_sub_ps(_mm512_sub_ps(dx, tl), _mm512_mul_ps(two, l)), bl);
+		__m512 dy = _mm512_add_ps(_mm512_add_ps(bl, _mm512_mul_ps(two, b)), br);
+		dy = _mm512_sub_ps(_mm512_sub_ps(_mm512_sub_ps(dy, tl), _mm512_mul_ps(two, t)), tr);
+
+		__m512 length = _mm512_sqrt_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx),
+		                                                           _mm512_mul_ps(dy, dy)), bias));
+
+		_mm512_storeu_ps(nx, _mm512_div_ps(dx, length));
+		_mm512_storeu_ps(ny, _mm512_div_ps(dy, length));
+		_mm512_storeu_ps(nz, _mm512_div_ps(one, _mm512_mul_ps(str, length)));
+
+		for (i = 0; i < 16; ++i) {
+			out[3*(x+i)+0] = nx[i];
+			out[3*(x+i)+1] = ny[i];
+			out[3*(x+i)+2] = nz[i];
+		}
+	}
+
+	if (x + 1 < width) {
+		normals_row_avx2(above + x - 1, row + x - 1, below + x - 1, out + 3*(x - 1), width - x + 1);
+	}
+}
+
+#endif // HEIGHTMAP_X86
+
+static NormalsRowFunc select_normals_row(void)
+{
+#ifdef HEIGHTMAP_X86
+	switch (CpuFeatures_level()) {
+	case CPU_LEVEL_AVX512: return normals_row_avx512;
+	case CPU_LEVEL_AVX2:   return normals_row_avx2;
+	case CPU_LEVEL_SSE42:  return normals_row_sse42;
+	default:               break;
+	}
+#endif
+	return normals_row_scalar;
+}
+
+int Heightmap_allocate_normals(Heightmap *map)
+{
+	if (map->normal_map)
+		free(map->normal_map);
 
 	map->normal_map = malloc(3*map->width*map->height*sizeof(float));
-	memset(map->normal_map, 0, 3*map->width*map->height*sizeof(float));
+	if (!map->normal_map) {
+		printf("Unable to allocate normals for %zu x %zu heightmap\n", map->width, map->height);
+		return -1;
+	}
+
+	return 0;
+}
 
-	for (y=0; y<map->height; ++y) {
+/**
+ * Calculate the normals of row y from it and its neighbours, which are
+ * NULL outside of the map.
+ */
+static void normals_of_row(Heightmap *map, NormalsRowFunc normals_row, size_t y,
+                           const float *above, const float *row, const float *below)
+{
+	size_t x;
+	float *out = map->normal_map + 3*map->height*y;
+	memset(out, 0, 3*map->width*sizeof(float));
+
+	// corner cases
+	if (y == 0 || y == map->height-1) {
 		for (x=0; x<map->width; ++x) {
-			int k = 3*(map->height*y + x);
-
-			// corner cases
-			if (x == 0 || x == map->width-1 || y == 0 || y == map->height-1) {
-				map->normal_map[k+0] = 0;
-				map->normal_map[k+1] = 0;
-				map->normal_map[k+2] = 1.0;
-				continue;
+			out[3*x+2] = 1.0;
+		}
+		return;
+	}
+	out[2] = 1.0;
+	out[3*(map->width-1)+2] = 1.0;
+
+	normals_row(above, row, below, out, map->width);
+}
+
+void Heightmap_calculate_normal_rows(Heightmap *map, size_t y0, size_t y1)
+{
+	size_t y;
+	NormalsRowFunc normals_row = select_normals_row();
+
+	for (y=y0; y<y1; ++y) {
+		const float *row = map->map + map->height*y;
+		normals_of_row(map, normals_row, y,
+		               y > 0 ? row - map->height : NULL,
+		               row,
+		               y + 1 < map->height ? row + map->height : NULL);
+	}
+}
+
+/**
+ * Normalized row y for Heightmap_preprocess_rows() of [y0, y1). Inner rows
+ * are normalized in place and counted, the others only into scratch.
+ */
+static const float *preprocess_row(Heightmap *map, size_t y, size_t y0, size_t y1,
+                                   float *scratch, size_t *histogram)
+{
+	float *row = map->map + map->height*y;
+
+	if (y > y0 && y + 1 < y1) {
+		normalize_row(row, row, map->width, map->maxZ, histogram);
+		return row;
+	}
+
+	// rows y-1, y and y+1 are in use at the same time.
+	float *copy = scratch + map->width*(y % 3);
+	normalize_row(row, copy, map->width, map->maxZ, NULL);
+	return copy;
+}
+
+int Heightmap_preprocess_rows(Heightmap *map, size_t y0, size_t y1, size_t *histogram)
+{
+	if (y0 >= y1)
+		return 0;
+
+	float *scratch = malloc(3*map->width*sizeof(float));
+	if (!scratch) {
+		printf("Unable to allocate rows for preprocessing the heightmap\n");
+		return -1;
+	}
+
+	NormalsRowFunc normals_row = select_normals_row();
+	size_t y;
+
+	const float *above = y0 > 0 ? preprocess_row(map, y0-1, y0, y1, scratch, histogram) : NULL;
+	const float *row = preprocess_row(map, y0, y0, y1, scratch, histogram);
+
+	for (y=y0; y<y1; ++y) {
+		const float *below = y + 1 < map->height
+			? preprocess_row(map, y+1, y0, y1, scratch, histogram) : NULL;
+
+		normals_of_row(map, normals_row, y, above, row, below);
+
+		above = row;
+		row = below;
+	}
+
+	free(scratch);
+
+	return 0;
+}
+
+void Heightmap_calculate_normals(Heightmap *map)
+{
+	if (Heightmap_allocate_normals(map) != 0)
+		return;
+
+	Heightmap_calculate_normal_rows(map, 0, map->height);
+}
+
+/**
+ * Kernel of Heightmap_sample(), for positions [0, count).
+ */
+typedef void (*SampleFunc)(const Heightmap *map, const float *xs, const float *ys, size_t count,
+                           float *heights, float *normals);
+
+static float bilerp(float h00, float h10, float h01, float h11, float tx, float ty)
+{
+	float top = h00 + (h10 - h00) * tx;
+	float bottom = h01 + (h11 - h01) * tx;
+	return top + (bottom - top) * ty;
+}
+
+static void sample_scalar(const Heightmap *map, const float *xs, const float *ys, size_t count,
+                          float *heights, float *normals)
+{
+	// rows are map->height apart, see Heightmap_get.
+	const size_t stride = map->height;
+	const float maxX = map->width - 1;
+	const float maxY = map->height - 1;
+	size_t i, c;
+
+	for (i = 0; i < count; ++i) {
+		// NaN is clamped to 0, like in the vector kernels.
+		float x = xs[i] >= 0 ? xs[i] : 0;
+		float y = ys[i] >= 0 ? ys[i] : 0;
+		x = MIN(x, maxX);
+		y = MIN(y, maxY);
+
+		// the last row and column interpolate from the one before.
+		int ix = MIN((int) x, (int) map->width - 2);
+		int iy = MIN((int) y, (int) map->height - 2);
+		float tx = x - ix;
+		float ty = y - iy;
+
+		size_t k = iy*stride + ix;
+
+		if (heights) {
+			const float *h = map->map;
+			heights[i] = bilerp(h[k], h[k+1], h[k+stride], h[k+stride+1], tx, ty);
+		}
+
+		if (normals) {
+			const float *n = map->normal_map;
+			float v[3];
+			for (c = 0; c < 3; ++c) {
+				v[c] = bilerp(n[3*k+c], n[3*(k+1)+c], n[3*(k+stride)+c], n[3*(k+stride+1)+c],
+				              tx, ty);
+			}
+
+			float length = sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+			normals[3*i+0] = v[0] / length;
+			normals[3*i+1] = v[1] / length;
+			normals[3*i+2] = v[2] / length;
+		}
+	}
+}
+
+#ifdef HEIGHTMAP_X86
+
+// corners are at k, k + step, k + row and k + row + step.
+__attribute__((target("avx2")))
+static inline __m256 bilerp_avx2(const float *base, __m256i k, int step, int row,
+                                 __m256 tx, __m256 ty)
+{
+	__m256 h00 = _mm256_i32gather_ps(base,              k, 4);
+	__m256 h10 = _mm256_i32gather_ps(base + step,       k, 4);
+	__m256 h01 = _mm256_i32gather_ps(base + row,        k, 4);
+	__m256 h11 = _mm256_i32gather_ps(base + row + step, k, 4);
+
+	// same order of operations as bilerp.
+	__m256 top = _mm256_add_ps(h00, _mm256_mul_ps(_mm256_sub_ps(h10, h00), tx));
+	__m256 bottom = _mm256_add_ps(h01, _mm256_mul_ps(_mm256_sub_ps(h11, h01), tx));
+	return _mm256_add_ps(top, _mm256_mul_ps(_mm256_sub_ps(bottom, top), ty));
+}
+
+// same as sample_scalar, 8 positions at a time.
+__attribute__((target("avx2")))
+static void sample_avx2(const Heightmap *map, const float *xs, const float *ys, size_t count,
+                        float *heights, float *normals)
+{
+	const int stride = map->height;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 maxX = _mm256_set1_ps(map->width - 1);
+	const __m256 maxY = _mm256_set1_ps(map->height - 1);
+	const __m256i lastX = _mm256_set1_epi32(map->width - 2);
+	const __m256i lastY = _mm256_set1_epi32(map->height - 2);
+	const __m256i rows = _mm256_set1_epi32(stride);
+	float nx[8], ny[8], nz[8];
+	size_t i, j;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		// max returns the second operand for NaN.
+		__m256 x = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(xs + i), zero), maxX);
+		__m256 y = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(ys + i), zero), maxY);
+
+		__m256i ix = _mm256_min_epi32(_mm256_cvttps_epi32(x), lastX);
+		__m256i iy = _mm256_min_epi32(_mm256_cvttps_epi32(y), lastY);
+		__m256 tx = _mm256_sub_ps(x, _mm256_cvtepi32_ps(ix));
+		__m256 ty = _mm256_sub_ps(y, _mm256_cvtepi32_ps(iy));
+
+		__m256i k = _mm256_add_epi32(_mm256_mullo_epi32(iy, rows), ix);
+
+		if (heights) {
+			_mm256_storeu_ps(heights + i, bilerp_avx2(map->map, k, 1, stride, tx, ty));
+		}
+
+		if (normals) {
+			__m256i k3 = _mm256_add_epi32(_mm256_add_epi32(k, k), k);
+			__m256 vx = bilerp_avx2(map->normal_map + 0, k3, 3, 3*stride, tx, ty);
+			__m256 vy = bilerp_avx2(map->normal_map + 1, k3, 3, 3*stride, tx, ty);
+			__m256 vz = bilerp_avx2(map->normal_map + 2, k3, 3, 3*stride, tx, ty);
+
+			__m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, vx),
+			                                                           _mm256_mul_ps(vy, vy)),
+			                                             _mm256_mul_ps(vz, vz)));
+
+			_mm256_storeu_ps(nx, _mm256_div_ps(vx, length));
+			_mm256_storeu_ps(ny, _mm256_div_ps(vy, length));
+			_mm256_storeu_ps(nz, _mm256_div_ps(vz, length));
+
+			for (j = 0; j < 8; ++j) {
+				normals[3*(i+j)+0] = nx[j];
+				normals[3*(i+j)+1] = ny[j];
+				normals[3*(i+j)+2] = nz[j];
 			}
+		}
+	}
 
-			// dx: Sobel filter
-			//  -1  0  1
-			//  -2  0  2
-			//  -1  0  1
-			//
-			// dy: Sobel filter
-			//  -1 -2 -1
-			//   0  0  0
-			//   1  2  1
-			float tl = Heightmap_get(map, x-1, y-1);
-			float l  = Heightmap_get(map, x-1, y  );
-			float bl = Heightmap_get(map, x-1, y+1);
-			float b  = Heightmap_get(map, x,   y+1);
-			float br = Heightmap_get(map, x+1, y+1);
-			float r  = Heightmap_get(map, x+1, y  );
-			float tr = Heightmap_get(map, x+1, y-1);
-			float t  = Heightmap_get(map, x,   y-1);
-
-			float dx = tr + 2 * r + br - tl - 2 * l - bl;
-			float dy = bl + 2 * b + br - tl - 2 * t - tr;
-
-			// trial & error value.
-			float str = 32.0;
-
-			float length = sqrtf(dx*dx + dy*dy + 1.0/str*1.0/str);
-
-			map->normal_map[k+0] = dx / length;
-			map->normal_map[k+1] = dy / length;
-			map->normal_map[k+2] = 1.0 / (str*length);
+	if (i < count) {
+		sample_scalar(map, xs + i, ys + i, count - i,
+		              heights ? heights + i : NULL, normals ? normals + 3*i : NULL);
+	}
+}
+
+#endif // HEIGHTMAP_X86
+
+static SampleFunc select_sample(const Heightmap *map)
+{
+#ifdef HEIGHTMAP_X86
+	// gathers take 32-bit indices, normals are the largest array.
+	if (3*map->width*map->height <= INT_MAX) {
+		// 16-wide gathers are no faster than two 8-wide ones, the
+		// kernel is bound by the loads.
+		switch (CpuFeatures_level()) {
+		case CPU_LEVEL_AVX512:
+		case CPU_LEVEL_AVX2:   return sample_avx2;
+		default:               break;
 		}
 	}
+#endif
+	// SSE4.2 has no gathers, scalar loads are as fast.
+	return sample_scalar;
+}
+
+void Heightmap_sample(const Heightmap *map, const float *xs, const float *ys, size_t count,
+                      float *heights, float *normals)
+{
+	assert(map->width >= 2 && map->height >= 2);
+	assert(normals == NULL || map->normal_map != NULL);
+
+	select_sample(map)(map, xs, ys, count, heights, normals);
 }
 
 void Heightmap_get_normal(Heightmap *map, int x, int y, float *nx, float *ny, float *nz)
 {
-	assert(x >= 0 && x < map->width);
-	assert(y >= 0 && x < map->height);
+	assert(x >= 0 && (size_t) x < map->width);
+	assert(y >= 0 && (size_t) y < map->height);
 	int k = 3*(map->height*y + x);
 	*nx = map->normal_map[k+0];
 	*ny = map->normal_map[k+1];
@@ -168,7 +874,7 @@ void Heightmap_get_normal(Heightmap *map, int x, int y, float *nx, float *ny, fl
 
 float Heightmap_get(Heightmap *map, int x, int y)
 {
+	assert(x >= 0 && y >= 0);
 	assert((map->height*y + x) < (map->height*map->width));
-	assert((map->height*y + x) >= 0);
 	return (map->map[map->height*y + x]);
 }
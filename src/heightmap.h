@@ -3,6 +3,9 @@
 
 #include <stddef.h>
 
+// tenths of the height range, plus one for heights outside of it.
+#define HEIGHTMAP_HISTOGRAM_BINS 11
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,8 +21,26 @@ typedef struct
 
 	float minZ, maxZ;
 
+	// heights per bin, counted while normalizing.
+	size_t histogram[HEIGHTMAP_HISTOGRAM_BINS];
+
 } Heightmap;
 
+/**
+ * Heightmap file mapped into memory, so that pieces of it can be parsed in
+ * parallel, see Heightmap_open_file().
+ */
+typedef struct
+{
+	const char *text;
+	size_t size;
+
+	// dimensions and the first height after them.
+	size_t width, height;
+	const char *values;
+
+} HeightmapFile;
+
 /**
  * Debug prints the given heightmap
  */
@@ -39,6 +60,77 @@ void Heightmap_print(Heightmap *map);
  */
 Heightmap *Heightmap_read(const char *filename);
 
+/**
+ * Allocate a heightmap of the given size, the heights are not initialized.
+ *
+ * @param width
+ * @param height
+ * @return heightmap on success, NULL if out of memory.
+ */
+Heightmap *Heightmap_create(size_t width, size_t height);
+
+/**
+ * Map the given heightmap file into memory and parse its dimensions, see
+ * Heightmap_read() for the format.
+ *
+ * @param file
+ * @param filename
+ * @return 0 on success, -1 on failure.
+ */
+int Heightmap_open_file(HeightmapFile *file, const char *filename);
+
+void Heightmap_close_file(HeightmapFile *file);
+
+/**
+ * Start of a piece of the heights of the file when split into the given
+ * number of pieces of about the same size. Pieces end where the next one
+ * starts, the last one at the end of the file, and no height is split.
+ *
+ * @param file
+ * @param piece index, pieces for the end of the file
+ * @param pieces
+ */
+const char *Heightmap_split_values(const HeightmapFile *file, size_t piece, size_t pieces);
+
+/**
+ * Number of heights in [begin, end), without parsing them.
+ */
+size_t Heightmap_count_values(const char *begin, const char *end);
+
+/**
+ * Parse the heights in [begin, end) into out, e.g. a piece given by
+ * Heightmap_split_values(). minZ and maxZ are updated with the heights.
+ *
+ * @param begin
+ * @param end
+ * @param out Heightmap_count_values() floats
+ * @param minZ
+ * @param maxZ
+ * @return 0 on success, -1 if there is something else than a height.
+ */
+int Heightmap_parse_values(const char *begin, const char *end, float *out,
+                           float *minZ, float *maxZ);
+
+/**
+ * Parse only the heights of every step-th row and column in [begin, end)
+ * into a decimated map, skipping the others without parsing them. minZ
+ * and maxZ are updated with the parsed heights.
+ *
+ * @param file the range is in
+ * @param begin
+ * @param end
+ * @param first index of the first height of the range in the whole map
+ * @param step
+ * @param out decimated map, (file->width - 1) / step + 1 heights per row
+ * @param count set to the number of heights in the range
+ * @param minZ
+ * @param maxZ
+ * @return 0 on success, -1 if a parsed one is something else than a height.
+ */
+int Heightmap_parse_decimated(const HeightmapFile *file, const char *begin, const char *end,
+                              size_t first, size_t step, float *out, size_t *count,
+                              float *minZ, float *maxZ);
+
 /**
  * Delete the heightmap from memory.
  *
@@ -55,6 +147,43 @@ void Heightmap_delete(Heightmap *map);
  */
 void Heightmap_normalize(Heightmap *map);
 
+/**
+ * Normalize rows [y0, y1) like Heightmap_normalize(), counting them into
+ * the histogram. Scale minZ and maxZ with Heightmap_set_normalized() once
+ * every row is done.
+ *
+ * @param heightmap
+ * @param y0 first row
+ * @param y1 row after the last one
+ * @param histogram HEIGHTMAP_HISTOGRAM_BINS counts
+ */
+void Heightmap_normalize_rows(Heightmap *map, size_t y0, size_t y1, size_t *histogram);
+
+/**
+ * Set minZ and maxZ to the normalized range.
+ *
+ * @param heightmap
+ */
+void Heightmap_set_normalized(Heightmap *map);
+
+/**
+ * Normalize rows [y0, y1), count them into the histogram and calculate
+ * their normals in one pass, while each row is in cache. Normals must be
+ * allocated with Heightmap_allocate_normals().
+ *
+ * Ranges may be preprocessed in parallel: the first and the last row are
+ * read by the neighbouring ranges, so they are only normalized in a copy.
+ * Normalize them with Heightmap_normalize_rows() once every range is done,
+ * then call Heightmap_set_normalized().
+ *
+ * @param heightmap
+ * @param y0 first row
+ * @param y1 row after the last one
+ * @param histogram HEIGHTMAP_HISTOGRAM_BINS counts
+ * @return 0 on success, -1 if out of memory.
+ */
+int Heightmap_preprocess_rows(Heightmap *map, size_t y0, size_t y1, size_t *histogram);
+
 /**
  * Calculate normalmap from the heightmap
  *
@@ -62,6 +191,25 @@ void Heightmap_normalize(Heightmap *map);
  */
 void Heightmap_calculate_normals(Heightmap *map);
 
+/**
+ * Allocate the normalmap without calculating it, see
+ * Heightmap_calculate_normal_rows().
+ *
+ * @param heightmap
+ * @return 0 on success, -1 if out of memory.
+ */
+int Heightmap_allocate_normals(Heightmap *map);
+
+/**
+ * Calculate normals of rows [y0, y1) into an allocated normalmap. Rows only
+ * read the heightmap, so ranges may be calculated in parallel.
+ *
+ * @param heightmap
+ * @param y0 first row
+ * @param y1 row after the last one
+ */
+void Heightmap_calculate_normal_rows(Heightmap *map, size_t y0, size_t y1);
+
 /**
  * Get the normals
  *
@@ -74,6 +222,24 @@ void Heightmap_calculate_normals(Heightmap *map);
  */
 void Heightmap_get_normal(Heightmap *map, int x, int y, float *nx, float *ny, float *nz);
 
+/**
+ * Bilinearly interpolated heights and normals at a batch of positions.
+ *
+ * Positions are in grid coordinates, e.g. (2.5, 3.0) is halfway between
+ * texels (2, 3) and (3, 3), and are clamped to the map. The kernel is picked
+ * by CpuFeatures_level(), the AVX2 one gathers 8 positions at a time and
+ * gives the same results as the scalar one.
+ *
+ * @param map heightmap with normals calculated
+ * @param xs x coordinates
+ * @param ys y coordinates
+ * @param count number of positions
+ * @param heights count heights, or NULL
+ * @param normals 3 floats per position, normalized, or NULL
+ */
+void Heightmap_sample(const Heightmap *map, const float *xs, const float *ys, size_t count,
+                      float *heights, float *normals);
+
 /**
  * Return the height value at given coordinates.
  *
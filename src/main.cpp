@@ -1,19 +1,151 @@
+#include "cpu_features.h"
+#include "task_scheduler.hpp"
+#include "terrain_loader.hpp"
 #include "terrain_patch.hpp"
 #include "gfx/opengl_render.hpp"
+#include "trace.hpp"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static void usage(const char *name)
+{
+	printf("Usage: %s <terrain_file> [options]\n", name);
+	printf("\n");
+	printf("Options:\n");
+	printf("  --flythrough <file>  fly the camera along the path in file\n");
+	printf("  --frames <n>         number of flythrough frames (default 1000)\n");
+	printf("  --report <file>      write the flythrough report into file\n");
+	printf("  --csv <file>         write per-frame phase timings into file\n");
+	printf("  --mode <name>        initial render mode, e.g. vertices or strips\n");
+	printf("  --headless           render offscreen through EGL, no window\n");
+	printf("  --output <pattern>   write headless frames as PPM, e.g. frame_%%05d.ppm\n");
+	printf("  --size <w>x<h>       size of the window or offscreen frames\n");
+	printf("  --cpu <level>        highest instruction set used by the kernels:\n");
+	printf("                       scalar, sse4.2, avx2 or avx512 (default detected)\n");
+	printf("  --export <name>      write every frame's mesh into shared memory name,\n");
+	printf("                       e.g. /roam_mesh, see examples/mesh_consumer.c\n");
+	printf("  --stream <path>      stream the tessellation to a viewer connecting to\n");
+	printf("                       Unix socket path, see examples/stream_client.cpp\n");
+	printf("  --occlusion <on|off> skip terrain hidden behind terrain (default off),\n");
+	printf("                       not while exporting or streaming\n");
+	printf("  --threads <n>        threads running tasks, including the main thread\n");
+	printf("                       (default one per CPU)\n");
+	printf("  --progressive        start with a coarse level of the terrain, load the\n");
+	printf("                       finer ones while rendering\n");
+}
 
 int main(int argc, char **argv)
 {
 	if (argc < 2) {
-		printf("Usage: %s <terrain_file>\n", argv[0]);
+		usage(argv[0]);
 		return -1;
 	}
 
-	TerrainPatch patch(argv[1]);
-	patch.computeVariance();
-	render(&patch);
+	RenderOptions options;
+	bool progressive = false;
+
+	for (int i = 2; i < argc; ++i) {
+		if (strcmp(argv[i], "--headless") == 0) {
+			options.headless = true;
+			continue;
+		}
+		if (strcmp(argv[i], "--progressive") == 0) {
+			progressive = true;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		if (strcmp(argv[i], "--flythrough") == 0) {
+			options.flythrough = argv[++i];
+		} else if (strcmp(argv[i], "--frames") == 0) {
+			char *end;
+			long frames = strtol(argv[++i], &end, 10);
+			if (*end != 0 || frames <= 0) {
+				usage(argv[0]);
+				return -1;
+			}
+			options.frames = frames;
+		} else if (strcmp(argv[i], "--report") == 0) {
+			options.report = argv[++i];
+		} else if (strcmp(argv[i], "--csv") == 0) {
+			options.csv = argv[++i];
+		} else if (strcmp(argv[i], "--mode") == 0) {
+			options.mode = argv[++i];
+		} else if (strcmp(argv[i], "--output") == 0) {
+			options.output = argv[++i];
+		} else if (strcmp(argv[i], "--size") == 0) {
+			if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 ||
+			    options.width <= 0 || options.height <= 0) {
+				usage(argv[0]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--export") == 0) {
+			options.exportName = argv[++i];
+		} else if (strcmp(argv[i], "--stream") == 0) {
+			options.streamSocket = argv[++i];
+		} else if (strcmp(argv[i], "--occlusion") == 0) {
+			const char *value = argv[++i];
+			if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+				usage(argv[0]);
+				return -1;
+			}
+			options.occlusionCulling = strcmp(value, "on") == 0;
+		} else if (strcmp(argv[i], "--threads") == 0) {
+			long threads = strtol(argv[++i], NULL, 10);
+			if (threads <= 0 || TaskScheduler::init(threads) != 0) {
+				usage(argv[0]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--cpu") == 0) {
+			CpuLevel level;
+			if (CpuFeatures_parse(argv[++i], &level) != 0) {
+				usage(argv[0]);
+				return -1;
+			}
+			if (CpuFeatures_force(level) != 0) {
+				printf("CPU doesn't support %s\n", argv[i]);
+				return -1;
+			}
+		} else {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	printf("cpu: %s (detected %s)\n",
+	       CpuFeatures_name(CpuFeatures_level()),
+	       CpuFeatures_name(CpuFeatures_detect()));
+
+	printf("threads: %zu\n", TaskScheduler::instance()->threadCount());
+
+	TRACE_THREAD_NAME("main");
+
+	TerrainLoader *loader = progressive ? new TerrainLoader(argv[1]) : NULL;
+
+	TerrainData *data = loader ? loader->loadFirst() : TerrainData::load(argv[1]);
+	if (data == NULL) {
+		delete loader;
+		return -1;
+	}
+	data->computeVariance();
+
+	TerrainPatch patch(data);
+	data->release();
+
+	if (loader) {
+		loader->start(&patch);
+	}
+
+	int result = render(&patch, options);
+
+	// before the patch it offers levels to.
+	delete loader;
 
-	return 0;
+	return result;
 }
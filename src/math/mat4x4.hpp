@@ -110,8 +110,9 @@ struct Mat4x4
 
 	// Matrix multiplication.
 	//---------------------------------------------------------------------
-	Mat4x4<T> &operator*=(const Mat4x4<T> &b) {
-		Mat4x4<T> a(*this);
+	Mat4x4<T> &operator*=(const Mat4x4<T> &rhs) {
+		// rhs may be this.
+		Mat4x4<T> a(*this), b(rhs);
 
 		m[ 0] = a.m[ 0]*b.m[ 0] + a.m[ 4]*b.m[1]
 		      + a.m[ 8]*b.m[ 2] + a.m[12]*b.m[3];
@@ -402,6 +403,54 @@ struct Mat4x4
 		return inverse;
 	}
 
+	/**
+	 * Inverse of a rigid transformation, rotation followed by translation.
+	 *
+	 * Much cheaper than getInverse(), but the upper 3x3 must be orthonormal
+	 * and the bottom row (0, 0, 0, 1), otherwise the result is garbage.
+	 *
+	 * @return inverse of the matrix.
+	 */
+	Mat4x4<T> getRigidInverse() const {
+		// transpose the rotation, translation is -R^T * t
+		return Mat4x4<T>(
+			m[ 0], m[ 1], m[ 2], -(m[ 0]*m[12] + m[ 1]*m[13] + m[ 2]*m[14]),
+			m[ 4], m[ 5], m[ 6], -(m[ 4]*m[12] + m[ 5]*m[13] + m[ 6]*m[14]),
+			m[ 8], m[ 9], m[10], -(m[ 8]*m[12] + m[ 9]*m[13] + m[10]*m[14]),
+			0    , 0    , 0    , 1);
+	}
+
+	/**
+	 * Transform a point, w is taken as 1 and the resulting w is dropped.
+	 */
+	Vec3<T> transformPoint(const Vec3<T> &p) const {
+		return Vec3<T>(p.x*m[0] + p.y*m[4] + p.z*m[ 8] + m[12],
+		               p.x*m[1] + p.y*m[5] + p.z*m[ 9] + m[13],
+		               p.x*m[2] + p.y*m[6] + p.z*m[10] + m[14]);
+	}
+
+	// Batched transformations, in and out may be the same array.
+	//---------------------------------------------------------------------
+	void transform(const Vec4<T> *in, Vec4<T> *out, size_t count) const {
+		for (size_t i = 0; i < count; ++i) {
+			out[i] = *this * in[i];
+		}
+	}
+
+	void transformPoints(const Vec3<T> *in, Vec3<T> *out, size_t count) const {
+		for (size_t i = 0; i < count; ++i) {
+			out[i] = transformPoint(in[i]);
+		}
+	}
+
+	// w is taken as 1, e.g. into clip coordinates.
+	void transformPoints(const Vec3<T> *in, Vec4<T> *out, size_t count) const {
+		for (size_t i = 0; i < count; ++i) {
+			out[i] = *this * Vec4<T>(in[i].x, in[i].y, in[i].z, 1);
+		}
+	}
+	//---------------------------------------------------------------------
+
 
 	// Affine transformations
 	//---------------------------------------------------------------------
@@ -549,6 +598,8 @@ inline std::ostream &operator<<(std::ostream &out, const Mat4x4<T> &m)
 	return out;
 }
 
+#include "math/mat4x4_simd.hpp"
+
 typedef Mat4x4<float>  Mat4x4f;
 typedef Mat4x4<double> Mat4x4d;
 
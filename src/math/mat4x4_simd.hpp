@@ -0,0 +1,175 @@
+#ifndef MAT4X4_SIMD_HPP
+#define MAT4X4_SIMD_HPP
+
+/**
+ * SSE specializations of the hot Mat4x4<float> operations, batched
+ * transformations use AVX when compiled with it (e.g. -mavx).
+ *
+ * Included from mat4x4.hpp, don't include directly. Other types and
+ * targets, and builds with ROAM_NO_SIMD, use the scalar templates.
+ */
+
+#if defined(__SSE2__) && !defined(ROAM_NO_SIMD)
+
+#include <emmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+// vector * column-major matrix columns c0..c3.
+static inline __m128 mat4x4_mul_sse(__m128 c0, __m128 c1, __m128 c2, __m128 c3, __m128 v)
+{
+	__m128 r = _mm_mul_ps(c0, _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)));
+	r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))));
+	r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+	r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))));
+	return r;
+}
+
+// x, y, z of the point and 1 as w, c3 is added as is.
+static inline __m128 mat4x4_mul_point_sse(__m128 c0, __m128 c1, __m128 c2, __m128 c3,
+                                          float x, float y, float z)
+{
+	__m128 r = _mm_add_ps(c3, _mm_mul_ps(c0, _mm_set1_ps(x)));
+	r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(y)));
+	r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(z)));
+	return r;
+}
+
+static inline void mat4x4_store_vec3_sse(float *out, __m128 r)
+{
+	_mm_storel_pi((__m64 *) out, r);
+	_mm_store_ss(out + 2, _mm_movehl_ps(r, r));
+}
+
+template <>
+inline Mat4x4<float> &Mat4x4<float>::operator*=(const Mat4x4<float> &b)
+{
+	__m128 c0 = _mm_loadu_ps(m + 0);
+	__m128 c1 = _mm_loadu_ps(m + 4);
+	__m128 c2 = _mm_loadu_ps(m + 8);
+	__m128 c3 = _mm_loadu_ps(m + 12);
+
+	// b may be this, load all of it before storing.
+	__m128 r0 = mat4x4_mul_sse(c0, c1, c2, c3, _mm_loadu_ps(b.m + 0));
+	__m128 r1 = mat4x4_mul_sse(c0, c1, c2, c3, _mm_loadu_ps(b.m + 4));
+	__m128 r2 = mat4x4_mul_sse(c0, c1, c2, c3, _mm_loadu_ps(b.m + 8));
+	__m128 r3 = mat4x4_mul_sse(c0, c1, c2, c3, _mm_loadu_ps(b.m + 12));
+
+	_mm_storeu_ps(m + 0, r0);
+	_mm_storeu_ps(m + 4, r1);
+	_mm_storeu_ps(m + 8, r2);
+	_mm_storeu_ps(m + 12, r3);
+
+	return *this;
+}
+
+template <>
+inline Vec4<float> Mat4x4<float>::operator*(const Vec4<float> &rhs) const
+{
+	Vec4<float> res;
+	_mm_storeu_ps(&res.x, mat4x4_mul_sse(_mm_loadu_ps(m + 0), _mm_loadu_ps(m + 4),
+	                                     _mm_loadu_ps(m + 8), _mm_loadu_ps(m + 12),
+	                                     _mm_loadu_ps(&rhs.x)));
+	return res;
+}
+
+template <>
+inline Mat4x4<float> Mat4x4<float>::getRigidInverse() const
+{
+	// columns of the rotation with w zeroed, transposing them gives the
+	// columns of R^T.
+	const __m128 mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+	__m128 t0 = _mm_and_ps(_mm_loadu_ps(m + 0), mask);
+	__m128 t1 = _mm_and_ps(_mm_loadu_ps(m + 4), mask);
+	__m128 t2 = _mm_and_ps(_mm_loadu_ps(m + 8), mask);
+	__m128 t3 = _mm_setzero_ps();
+	_MM_TRANSPOSE4_PS(t0, t1, t2, t3);
+
+	// -R^T * t, with w = 1
+	__m128 t = _mm_mul_ps(t0, _mm_set1_ps(m[12]));
+	t = _mm_add_ps(t, _mm_mul_ps(t1, _mm_set1_ps(m[13])));
+	t = _mm_add_ps(t, _mm_mul_ps(t2, _mm_set1_ps(m[14])));
+	t = _mm_sub_ps(_mm_set_ps(1, 0, 0, 0), t);
+
+	Mat4x4<float> inverse;
+	_mm_storeu_ps(inverse.m + 0, t0);
+	_mm_storeu_ps(inverse.m + 4, t1);
+	_mm_storeu_ps(inverse.m + 8, t2);
+	_mm_storeu_ps(inverse.m + 12, t);
+	return inverse;
+}
+
+template <>
+inline Vec3<float> Mat4x4<float>::transformPoint(const Vec3<float> &p) const
+{
+	Vec3<float> res;
+	mat4x4_store_vec3_sse(&res.x, mat4x4_mul_point_sse(_mm_loadu_ps(m + 0), _mm_loadu_ps(m + 4),
+	                                                   _mm_loadu_ps(m + 8), _mm_loadu_ps(m + 12),
+	                                                   p.x, p.y, p.z));
+	return res;
+}
+
+template <>
+inline void Mat4x4<float>::transform(const Vec4<float> *in, Vec4<float> *out, size_t count) const
+{
+	const float *src = &in->x;
+	float *dst = &out->x;
+	size_t i = 0;
+
+#ifdef __AVX__
+	// two vectors at a time, both lanes hold the same column.
+	__m256 a0 = _mm256_broadcast_ps((const __m128 *) (m + 0));
+	__m256 a1 = _mm256_broadcast_ps((const __m128 *) (m + 4));
+	__m256 a2 = _mm256_broadcast_ps((const __m128 *) (m + 8));
+	__m256 a3 = _mm256_broadcast_ps((const __m128 *) (m + 12));
+
+	for (; i + 2 <= count; i += 2) {
+		__m256 v = _mm256_loadu_ps(src + i*4);
+		__m256 r = _mm256_mul_ps(a0, _mm256_permute_ps(v, _MM_SHUFFLE(0, 0, 0, 0)));
+		r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_permute_ps(v, _MM_SHUFFLE(1, 1, 1, 1))));
+		r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_permute_ps(v, _MM_SHUFFLE(2, 2, 2, 2))));
+		r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_permute_ps(v, _MM_SHUFFLE(3, 3, 3, 3))));
+		_mm256_storeu_ps(dst + i*4, r);
+	}
+#endif
+
+	__m128 c0 = _mm_loadu_ps(m + 0);
+	__m128 c1 = _mm_loadu_ps(m + 4);
+	__m128 c2 = _mm_loadu_ps(m + 8);
+	__m128 c3 = _mm_loadu_ps(m + 12);
+
+	for (; i < count; ++i) {
+		_mm_storeu_ps(dst + i*4, mat4x4_mul_sse(c0, c1, c2, c3, _mm_loadu_ps(src + i*4)));
+	}
+}
+
+template <>
+inline void Mat4x4<float>::transformPoints(const Vec3<float> *in, Vec3<float> *out, size_t count) const
+{
+	__m128 c0 = _mm_loadu_ps(m + 0);
+	__m128 c1 = _mm_loadu_ps(m + 4);
+	__m128 c2 = _mm_loadu_ps(m + 8);
+	__m128 c3 = _mm_loadu_ps(m + 12);
+
+	for (size_t i = 0; i < count; ++i) {
+		mat4x4_store_vec3_sse(&out[i].x, mat4x4_mul_point_sse(c0, c1, c2, c3, in[i].x, in[i].y, in[i].z));
+	}
+}
+
+template <>
+inline void Mat4x4<float>::transformPoints(const Vec3<float> *in, Vec4<float> *out, size_t count) const
+{
+	__m128 c0 = _mm_loadu_ps(m + 0);
+	__m128 c1 = _mm_loadu_ps(m + 4);
+	__m128 c2 = _mm_loadu_ps(m + 8);
+	__m128 c3 = _mm_loadu_ps(m + 12);
+
+	for (size_t i = 0; i < count; ++i) {
+		_mm_storeu_ps(&out[i].x, mat4x4_mul_point_sse(c0, c1, c2, c3, in[i].x, in[i].y, in[i].z));
+	}
+}
+
+#endif // __SSE2__ && !ROAM_NO_SIMD
+
+#endif // MAT4X4_SIMD_HPP
@@ -0,0 +1,228 @@
+#include "mesh_export.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// slots start on their own cache lines.
+#define MESH_EXPORT_ALIGN 64
+
+struct MeshExport
+{
+	char *name;
+	int writer;
+
+	unsigned char *base;
+	size_t size;
+
+	MeshExportHeader *header;
+};
+
+static size_t align_up(size_t size)
+{
+	return (size + MESH_EXPORT_ALIGN - 1) & ~(size_t) (MESH_EXPORT_ALIGN - 1);
+}
+
+static MeshExportSlot *get_slot(const MeshExport *exp, uint64_t index)
+{
+	const MeshExportHeader *header = exp->header;
+	return (MeshExportSlot *) (exp->base + align_up(sizeof(MeshExportHeader)) +
+	                           (index % header->slot_count)*header->slot_size);
+}
+
+MeshExport *MeshExport_create(const char *name, size_t maxTriangles,
+                              size_t width, size_t height)
+{
+	size_t slotSize = align_up(sizeof(MeshExportSlot) + sizeof(float)*9*maxTriangles);
+	size_t size = align_up(sizeof(MeshExportHeader)) + MESH_EXPORT_SLOTS*slotSize;
+
+	// readers still mapping an old segment keep it, new ones get this.
+	shm_unlink(name);
+
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0) {
+		printf("Unable to create shared memory %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, size) != 0) {
+		printf("Unable to resize shared memory %s: %s\n", name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		printf("Unable to map shared memory %s: %s\n", name, strerror(errno));
+		shm_unlink(name);
+		return NULL;
+	}
+
+	MeshExport *exp = (MeshExport *) malloc(sizeof(MeshExport));
+	exp->name = strdup(name);
+	exp->writer = 1;
+	exp->base = (unsigned char *) base;
+	exp->size = size;
+	exp->header = (MeshExportHeader *) base;
+
+	// ftruncate zeroed the segment, so all sequences and the generation
+	// start at zero. magic is written last, readers check it first.
+	exp->header->version = MESH_EXPORT_VERSION;
+	exp->header->slot_count = MESH_EXPORT_SLOTS;
+	exp->header->max_triangles = maxTriangles;
+	exp->header->slot_size = slotSize;
+	exp->header->width = width;
+	exp->header->height = height;
+	__atomic_store_n(&exp->header->magic, MESH_EXPORT_MAGIC, __ATOMIC_RELEASE);
+
+	return exp;
+}
+
+MeshExport *MeshExport_open(const char *name)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		printf("Unable to open shared memory %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < align_up(sizeof(MeshExportHeader))) {
+		printf("Shared memory %s is too small\n", name);
+		close(fd);
+		return NULL;
+	}
+
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		printf("Unable to map shared memory %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	const MeshExportHeader *header = (const MeshExportHeader *) base;
+	if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != MESH_EXPORT_MAGIC ||
+	    header->version != MESH_EXPORT_VERSION ||
+	    header->slot_count == 0 ||
+	    header->slot_size < sizeof(MeshExportSlot) + sizeof(float)*9*header->max_triangles ||
+	    align_up(sizeof(MeshExportHeader)) + header->slot_count*header->slot_size > (size_t) st.st_size) {
+		printf("Shared memory %s is not a mesh export\n", name);
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	MeshExport *exp = (MeshExport *) malloc(sizeof(MeshExport));
+	exp->name = strdup(name);
+	exp->writer = 0;
+	exp->base = (unsigned char *) base;
+	exp->size = st.st_size;
+	exp->header = (MeshExportHeader *) base;
+
+	return exp;
+}
+
+void MeshExport_delete(MeshExport *exp)
+{
+	if (exp->writer) {
+		__atomic_store_n(&exp->header->closed, 1, __ATOMIC_RELEASE);
+		shm_unlink(exp->name);
+	}
+
+	munmap(exp->base, exp->size);
+	free(exp->name);
+	free(exp);
+}
+
+float *MeshExport_begin(MeshExport *exp)
+{
+	MeshExportSlot *slot = get_slot(exp, exp->header->generation);
+
+	// odd sequence marks the slot being written, the fence keeps the
+	// vertex writes after it.
+	uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return (float *) (slot + 1);
+}
+
+void MeshExport_end(MeshExport *exp, uint64_t frame, size_t triangles, const float view[3],
+                    size_t width, size_t height)
+{
+	uint64_t generation = exp->header->generation;
+	MeshExportSlot *slot = get_slot(exp, generation);
+
+	slot->frame = frame;
+	slot->triangles = triangles;
+	slot->view[0] = view[0];
+	slot->view[1] = view[1];
+	slot->view[2] = view[2];
+	slot->width = width;
+	slot->height = height;
+
+	uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&exp->header->generation, generation + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t MeshExport_generation(const MeshExport *exp)
+{
+	return __atomic_load_n(&exp->header->generation, __ATOMIC_ACQUIRE);
+}
+
+int MeshExport_closed(const MeshExport *exp)
+{
+	return __atomic_load_n(&exp->header->closed, __ATOMIC_ACQUIRE) != 0;
+}
+
+const MeshExportHeader *MeshExport_header(const MeshExport *exp)
+{
+	return exp->header;
+}
+
+int MeshExport_acquire(const MeshExport *exp, MeshExportFrame *frame)
+{
+	uint64_t generation = MeshExport_generation(exp);
+	if (generation == 0)
+		return -1;
+
+	const MeshExportSlot *slot = get_slot(exp, generation - 1);
+
+	uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+	if (sequence & 1)
+		return -1;
+
+	frame->generation = generation;
+	frame->frame = slot->frame;
+	frame->triangles = slot->triangles;
+	frame->view[0] = slot->view[0];
+	frame->view[1] = slot->view[1];
+	frame->view[2] = slot->view[2];
+	frame->width = slot->width;
+	frame->height = slot->height;
+	frame->vertices = (const float *) (slot + 1);
+	frame->slot = slot;
+	frame->sequence = sequence;
+
+	// a torn count must not make the reader run off the slot.
+	if (frame->triangles > exp->header->max_triangles)
+		frame->triangles = exp->header->max_triangles;
+
+	return 0;
+}
+
+int MeshExport_validate(const MeshExport *exp, const MeshExportFrame *frame)
+{
+	(void) exp;
+
+	// keeps the reads of the frame before the second sequence load.
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&frame->slot->sequence, __ATOMIC_RELAXED) == frame->sequence;
+}
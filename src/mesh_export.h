@@ -0,0 +1,163 @@
+#ifndef MESH_EXPORT_H
+#define MESH_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MESH_EXPORT_MAGIC   0x48534d52 // "RMSH"
+#define MESH_EXPORT_VERSION 2
+
+// frames in the ring, a reader has two frames time to read a frame before
+// the writer comes back to its slot.
+#define MESH_EXPORT_SLOTS 3
+
+/**
+ * Shared memory layout, see MeshExport_create().
+ *
+ * The segment starts with the header, followed by MESH_EXPORT_SLOTS slots of
+ * slot_size bytes. Each slot starts with a MeshExportSlot and the triangle
+ * vertices follow it, 9 floats per triangle in patch space:
+ * (x/width, y/height, height), width and height being those of the slot.
+ *
+ * Every slot is guarded by a seqlock: the writer makes sequence odd, writes
+ * the frame and makes it even again. A reader that sees the same even
+ * sequence before and after reading has read a complete frame.
+ */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t max_triangles;
+	uint64_t slot_size;
+
+	// heightmap size of the first frame. Later frames may have another,
+	// e.g. with --progressive, see MeshExportSlot.
+	uint32_t width, height;
+
+	// number of frames published, the latest is in slot
+	// (generation - 1) % slot_count. Written with release semantics.
+	uint64_t generation;
+
+	// non-zero once the writer has exited.
+	uint32_t closed;
+	uint32_t padding;
+} MeshExportHeader;
+
+typedef struct
+{
+	uint64_t sequence;
+	uint64_t frame;
+	uint32_t triangles;
+	float view[3];
+
+	// heightmap size the patch space coordinates are relative to.
+	uint32_t width, height;
+} MeshExportSlot;
+
+typedef struct MeshExport MeshExport;
+
+/**
+ * A frame mapped straight from the shared memory, see MeshExport_acquire().
+ */
+typedef struct
+{
+	uint64_t generation;
+	uint64_t frame;
+	size_t triangles;
+	float view[3];
+	size_t width, height;
+	const float *vertices;
+
+	// private
+	const MeshExportSlot *slot;
+	uint64_t sequence;
+} MeshExportFrame;
+
+/**
+ * Create the shared memory segment for writing, e.g. "/roam_mesh".
+ *
+ * An existing segment with the same name is replaced.
+ *
+ * @param name POSIX shared memory object name
+ * @param maxTriangles largest frame that will be written
+ * @param width of the heightmap of the first frame
+ * @param height of the heightmap of the first frame
+ * @return export, NULL on failure.
+ */
+MeshExport *MeshExport_create(const char *name, size_t maxTriangles,
+                              size_t width, size_t height);
+
+/**
+ * Map an existing segment for reading.
+ *
+ * @param name as given to MeshExport_create()
+ * @return export, NULL on failure.
+ */
+MeshExport *MeshExport_open(const char *name);
+
+/**
+ * Unmap the segment. The writer also removes the name and marks the
+ * segment closed, readers that have it mapped keep it alive.
+ */
+void MeshExport_delete(MeshExport *exp);
+
+/**
+ * Start writing the next frame.
+ *
+ * @return vertex array of the next slot, holds max triangles.
+ */
+float *MeshExport_begin(MeshExport *exp);
+
+/**
+ * Publish the frame written after MeshExport_begin().
+ *
+ * @param exp
+ * @param frame number
+ * @param triangles written
+ * @param view position in patch space
+ * @param width of the heightmap tessellated
+ * @param height of the heightmap tessellated
+ */
+void MeshExport_end(MeshExport *exp, uint64_t frame, size_t triangles, const float view[3],
+                    size_t width, size_t height);
+
+/**
+ * @return number of frames published so far.
+ */
+uint64_t MeshExport_generation(const MeshExport *exp);
+
+/**
+ * @return non-zero if the writer has exited.
+ */
+int MeshExport_closed(const MeshExport *exp);
+
+const MeshExportHeader *MeshExport_header(const MeshExport *exp);
+
+/**
+ * Point frame at the latest published frame, nothing is copied.
+ *
+ * The data may be overwritten at any time, so the frame must be checked with
+ * MeshExport_validate() after it has been read.
+ *
+ * @param exp
+ * @param frame
+ * @return 0 on success, -1 if nothing is published yet or the writer is
+ *         writing the slot right now.
+ */
+int MeshExport_acquire(const MeshExport *exp, MeshExportFrame *frame);
+
+/**
+ * @return non-zero if frame was not overwritten while it was read.
+ */
+int MeshExport_validate(const MeshExport *exp, const MeshExportFrame *frame);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // MESH_EXPORT_H
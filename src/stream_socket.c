@@ -0,0 +1,185 @@
+#define _GNU_SOURCE // accept4
+
+#include "stream_socket.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// larger messages are treated as a broken stream.
+#define STREAM_SOCKET_MAX_MESSAGE (256u << 20)
+
+static int make_address(const char *path, struct sockaddr_un *address)
+{
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		printf("Socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(address->sun_path, path);
+
+	return 0;
+}
+
+static int read_all(int fd, unsigned char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t got = recv(fd, data, size, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return -1;
+
+		data += got;
+		size -= got;
+	}
+
+	return 0;
+}
+
+int StreamSocket_listen(const char *path)
+{
+	struct sockaddr_un address;
+	if (make_address(path, &address) != 0)
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		printf("Unable to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+	    listen(fd, 1) != 0) {
+		printf("Unable to listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int StreamSocket_accept(int server)
+{
+	return accept4(server, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+int StreamSocket_connect(const char *path)
+{
+	struct sockaddr_un address;
+	if (make_address(path, &address) != 0)
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		printf("Unable to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+		printf("Unable to connect to %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int StreamSocket_send(int fd, StreamQueue *queue, const void *data, size_t size)
+{
+	if (size > STREAM_SOCKET_MAX_MESSAGE)
+		return -1;
+
+	if (queue->size + 4 + size > queue->capacity) {
+		size_t capacity = queue->size + 4 + size;
+		unsigned char *grown = (unsigned char *) realloc(queue->data, capacity);
+		if (grown == NULL)
+			return -1;
+
+		queue->data = grown;
+		queue->capacity = capacity;
+	}
+
+	unsigned char *message = queue->data + queue->size;
+	message[0] = (unsigned char) size;
+	message[1] = (unsigned char) (size >> 8);
+	message[2] = (unsigned char) (size >> 16);
+	message[3] = (unsigned char) (size >> 24);
+	memcpy(message + 4, data, size);
+	queue->size += 4 + size;
+
+	return StreamSocket_flush(fd, queue);
+}
+
+int StreamSocket_flush(int fd, StreamQueue *queue)
+{
+	size_t written = 0;
+	while (written < queue->size) {
+		ssize_t count = send(fd, queue->data + written, queue->size - written, MSG_NOSIGNAL);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+
+		written += count;
+	}
+
+	// the rest moves to the front, there is at most a frame or two.
+	if (written > 0) {
+		memmove(queue->data, queue->data + written, queue->size - written);
+		queue->size -= written;
+	}
+
+	return queue->size > 0 ? 1 : 0;
+}
+
+void StreamSocket_clear(StreamQueue *queue)
+{
+	free(queue->data);
+	queue->data = NULL;
+	queue->size = 0;
+	queue->capacity = 0;
+}
+
+int StreamSocket_receive(int fd, unsigned char **buffer, size_t *capacity, size_t *size)
+{
+	unsigned char length[4];
+	if (read_all(fd, length, sizeof(length)) != 0)
+		return -1;
+
+	*size = (size_t) length[0] | (size_t) length[1] << 8 |
+	        (size_t) length[2] << 16 | (size_t) length[3] << 24;
+	if (*size > STREAM_SOCKET_MAX_MESSAGE)
+		return -1;
+
+	if (*size > *capacity || *buffer == NULL) {
+		unsigned char *grown = (unsigned char *) realloc(*buffer, *size ? *size : 1);
+		if (grown == NULL)
+			return -1;
+
+		*buffer = grown;
+		*capacity = *size;
+	}
+
+	return read_all(fd, *buffer, *size);
+}
+
+void StreamSocket_close(int fd, const char *path)
+{
+	close(fd);
+	if (path) {
+		unlink(path);
+	}
+}
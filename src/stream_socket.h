@@ -0,0 +1,90 @@
+#ifndef STREAM_SOCKET_H
+#define STREAM_SOCKET_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Length-prefixed messages over a local (AF_UNIX) stream socket. Each message
+ * is sent as a 32-bit little-endian length followed by the data.
+ */
+
+/**
+ * Messages waiting to be written to a non-blocking socket, see
+ * StreamSocket_send(). Zero initialized when empty.
+ */
+typedef struct StreamQueue {
+	unsigned char *data;
+	size_t size;
+	size_t capacity;
+} StreamQueue;
+
+/**
+ * Create a listening socket at path, replacing a stale socket file.
+ *
+ * The socket is non-blocking, see StreamSocket_accept().
+ *
+ * @return socket, -1 on failure.
+ */
+int StreamSocket_listen(const char *path);
+
+/**
+ * Accept a pending connection without blocking. The connection doesn't
+ * block either, send to it through a StreamQueue.
+ *
+ * @return connected socket, -1 if there is none.
+ */
+int StreamSocket_accept(int server);
+
+/**
+ * Connect to the socket at path.
+ *
+ * @return connected socket, -1 on failure.
+ */
+int StreamSocket_connect(const char *path);
+
+/**
+ * Queue a message and write as much of the queue as the socket takes
+ * without blocking.
+ *
+ * @return 0 if all is written, 1 if some is left in the queue, -1 if the
+ *         other end is gone.
+ */
+int StreamSocket_send(int fd, StreamQueue *queue, const void *data, size_t size);
+
+/**
+ * Write as much of the queue as the socket takes without blocking.
+ *
+ * @return as StreamSocket_send()
+ */
+int StreamSocket_flush(int fd, StreamQueue *queue);
+
+/**
+ * Drop the queued messages and free the queue.
+ */
+void StreamSocket_clear(StreamQueue *queue);
+
+/**
+ * Receive a message into buffer, growing it when needed.
+ *
+ * @param fd
+ * @param buffer malloc'd or NULL, may be reallocated
+ * @param capacity of buffer
+ * @param size of the received message
+ * @return 0 on success, -1 on failure or when the other end closed.
+ */
+int StreamSocket_receive(int fd, unsigned char **buffer, size_t *capacity, size_t *size);
+
+/**
+ * Close a socket, and remove the socket file when path is given.
+ */
+void StreamSocket_close(int fd, const char *path);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // STREAM_SOCKET_H
@@ -0,0 +1,306 @@
+#include "task_scheduler.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+std::atomic<TaskScheduler *> TaskScheduler::m_instance(NULL);
+std::mutex TaskScheduler::m_instanceMutex;
+
+// index in m_workers of the calling thread, see currentWorker().
+static thread_local size_t t_worker = (size_t) -1;
+
+// caller of the task a worker is running, -1 while idle.
+static thread_local size_t t_owner = (size_t) -1;
+
+// tasks run inside each other while waiting, only the outermost one
+// counts as busy time.
+static thread_local int t_depth = 0;
+
+static uint64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * One thread per CPU unless ROAM_THREADS says otherwise.
+ */
+static size_t default_threads()
+{
+	const char *env = getenv("ROAM_THREADS");
+	if (env) {
+		long threads = strtol(env, NULL, 10);
+		if (threads > 0) {
+			return threads;
+		}
+		printf("Invalid ROAM_THREADS %s, using one thread per CPU\n", env);
+	}
+
+	return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+TaskScheduler::TaskScheduler(size_t threads)
+	: m_workerCount(threads - 1)
+	, m_callers(0)
+	, m_queued(0)
+	, m_sleeping(0)
+	, m_statsStart(now_ns())
+{
+	for (size_t i = 0; i < m_workerCount + TASK_SCHEDULER_CALLERS; ++i) {
+		m_workers.push_back(new Worker);
+	}
+
+	for (size_t i = 0; i < m_workerCount; ++i) {
+		m_threads.push_back(std::thread(&TaskScheduler::workerMain, this, i));
+	}
+}
+
+int TaskScheduler::init(size_t threads)
+{
+	std::lock_guard<std::mutex> lock(m_instanceMutex);
+
+	if (m_instance.load()) {
+		printf("Task scheduler is already running with %zu threads\n",
+		       m_instance.load()->threadCount());
+		return -1;
+	}
+
+	m_instance.store(new TaskScheduler(threads ? threads : default_threads()));
+	return 0;
+}
+
+TaskScheduler *TaskScheduler::instance()
+{
+	TaskScheduler *scheduler = m_instance.load(std::memory_order_acquire);
+
+	if (scheduler == NULL) {
+		std::lock_guard<std::mutex> lock(m_instanceMutex);
+		scheduler = m_instance.load();
+		if (scheduler == NULL) {
+			scheduler = new TaskScheduler(default_threads());
+			m_instance.store(scheduler, std::memory_order_release);
+		}
+	}
+
+	return scheduler;
+}
+
+size_t TaskScheduler::currentWorker()
+{
+	if (t_worker == (size_t) -1) {
+		t_worker = m_workerCount + std::min<size_t>(m_callers.fetch_add(1),
+		                                            TASK_SCHEDULER_CALLERS - 1);
+	}
+
+	return t_worker;
+}
+
+size_t TaskScheduler::currentOwner()
+{
+	const size_t self = currentWorker();
+	return self < m_workerCount ? t_owner : self;
+}
+
+void TaskScheduler::run(TaskGroup &group, const std::function<void()> &function)
+{
+	Task *task = new Task;
+	task->function = function;
+	task->group = &group;
+	task->owner = currentOwner();
+
+	const size_t self = currentWorker();
+	group.m_pending.fetch_add(1);
+
+	if (m_workerCount == 0) {
+		execute(task, self);
+		return;
+	}
+
+	Worker *worker = m_workers[self];
+	{
+		std::lock_guard<std::mutex> lock(worker->mutex);
+		worker->tasks.push_back(task);
+	}
+
+	// pairs with the check in workerMain(): either the worker sees the
+	// task or this sees the worker sleeping.
+	m_queued.fetch_add(1);
+	if (m_sleeping.load() > 0) {
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+		m_wake.notify_one();
+	}
+}
+
+void TaskScheduler::wait(TaskGroup &group)
+{
+	const size_t self = currentWorker();
+	const size_t owner = currentOwner();
+
+	while (group.m_pending.load(std::memory_order_acquire) > 0) {
+		Task *task = findTask(self, owner);
+		if (task) {
+			execute(task, self);
+		} else {
+			// the rest of the group is running on other threads.
+			std::this_thread::yield();
+		}
+	}
+}
+
+void TaskScheduler::parallelFor(size_t begin, size_t end, size_t grain,
+                                const std::function<void(size_t, size_t)> &function)
+{
+	if (begin >= end) {
+		return;
+	}
+
+	if (grain == 0) {
+		grain = 1;
+	}
+
+	if (m_workerCount == 0 || end - begin <= grain) {
+		function(begin, end);
+		return;
+	}
+
+	TaskGroup group;
+	while (end - begin > grain) {
+		const size_t middle = begin + (end - begin) / 2;
+		run(group, [this, middle, end, grain, &function]() {
+			parallelFor(middle, end, grain, function);
+		});
+		end = middle;
+	}
+
+	function(begin, end);
+	wait(group);
+}
+
+TaskScheduler::Task *TaskScheduler::findTask(size_t self, size_t owner)
+{
+	Worker *own = m_workers[self];
+	{
+		std::lock_guard<std::mutex> lock(own->mutex);
+		for (size_t i = own->tasks.size(); i-- > 0; ) {
+			Task *task = own->tasks[i];
+			if (owner == (size_t) -1 || task->owner == owner) {
+				own->tasks.erase(own->tasks.begin() + i);
+				m_queued.fetch_sub(1);
+				return task;
+			}
+		}
+	}
+
+	if (m_queued.load() == 0) {
+		return NULL;
+	}
+
+	for (size_t i = 1; i < m_workers.size(); ++i) {
+		Worker *victim = m_workers[(self + i) % m_workers.size()];
+		std::lock_guard<std::mutex> lock(victim->mutex);
+		for (size_t j = 0; j < victim->tasks.size(); ++j) {
+			Task *task = victim->tasks[j];
+			if (owner == (size_t) -1 || task->owner == owner) {
+				victim->tasks.erase(victim->tasks.begin() + j);
+				m_queued.fetch_sub(1);
+				own->steals.fetch_add(1, std::memory_order_relaxed);
+				return task;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+void TaskScheduler::execute(Task *task, size_t self)
+{
+	Worker *worker = m_workers[self];
+	const bool outermost = t_depth++ == 0;
+	const uint64_t start = outermost ? now_ns() : 0;
+
+	// tasks it starts belong to the same caller.
+	const size_t owner = t_owner;
+	t_owner = task->owner;
+	task->function();
+	t_owner = owner;
+
+	if (outermost) {
+		worker->busyNs.fetch_add(now_ns() - start, std::memory_order_relaxed);
+	}
+	t_depth--;
+	worker->executed.fetch_add(1, std::memory_order_relaxed);
+
+	// the group may be gone as soon as it is done.
+	TaskGroup *group = task->group;
+	delete task;
+	group->m_pending.fetch_sub(1, std::memory_order_release);
+}
+
+void TaskScheduler::workerMain(size_t index)
+{
+	TRACE_THREAD_NAME("worker");
+	t_worker = index;
+
+	for (;;) {
+		Task *task = findTask(index, (size_t) -1);
+		if (task) {
+			execute(task, index);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_sleepMutex);
+		m_sleeping.fetch_add(1);
+		m_wake.wait(lock, [this]() { return m_queued.load() > 0; });
+		m_sleeping.fetch_sub(1);
+	}
+}
+
+void TaskScheduler::getStats(std::vector<WorkerStats> &stats) const
+{
+	stats.assign(m_workerCount + 1, WorkerStats());
+
+	// callers add up into the last entry.
+	for (size_t i = 0; i < m_workers.size(); ++i) {
+		WorkerStats &entry = stats[std::min(i, m_workerCount)];
+		entry.tasks += m_workers[i]->executed.load(std::memory_order_relaxed);
+		entry.steals += m_workers[i]->steals.load(std::memory_order_relaxed);
+		entry.busyNs += m_workers[i]->busyNs.load(std::memory_order_relaxed);
+	}
+}
+
+void TaskScheduler::resetStats()
+{
+	for (size_t i = 0; i < m_workers.size(); ++i) {
+		m_workers[i]->executed.store(0, std::memory_order_relaxed);
+		m_workers[i]->steals.store(0, std::memory_order_relaxed);
+		m_workers[i]->busyNs.store(0, std::memory_order_relaxed);
+	}
+
+	m_statsStart = now_ns();
+}
+
+void TaskScheduler::printStats() const
+{
+	std::vector<WorkerStats> stats;
+	getStats(stats);
+
+	const double elapsed = (double) std::max<uint64_t>(now_ns() - m_statsStart, 1);
+
+	printf("TaskScheduler {\n");
+	printf("  threads: %zu\n", threadCount());
+	for (size_t i = 0; i < stats.size(); ++i) {
+		if (i < m_workerCount) {
+			printf("  worker %zu: ", i);
+		} else {
+			printf("  callers: ");
+		}
+		printf("%.1f%% busy, %llu tasks, %llu stolen\n",
+		       100.0*stats[i].busyNs/elapsed,
+		       (unsigned long long) stats[i].tasks,
+		       (unsigned long long) stats[i].steals);
+	}
+	printf("}\n");
+}
@@ -0,0 +1,203 @@
+#ifndef TASK_SCHEDULER_HPP
+#define TASK_SCHEDULER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// threads that are not workers with a deque of their own, later ones share
+// the last deque.
+#define TASK_SCHEDULER_CALLERS 8
+
+/**
+ * Tasks started together, waited for with TaskScheduler::wait().
+ */
+class TaskGroup
+{
+private:
+	friend class TaskScheduler;
+
+	std::atomic<size_t> m_pending;
+
+	TaskGroup(const TaskGroup &);
+	TaskGroup &operator=(const TaskGroup &);
+
+public:
+	TaskGroup() : m_pending(0) {}
+};
+
+/**
+ * Work-stealing scheduler shared by every parallel stage, e.g. loading,
+ * variance, extraction and ray queries.
+ *
+ * Every worker has its own deque: tasks it starts are pushed and popped at
+ * the back, idle workers steal from the front of the others, which takes
+ * the oldest and so usually the largest pieces of work. Threads that are
+ * not workers, callers, get deques of their own too.
+ *
+ * A thread waiting for a group runs queued tasks until the group is done
+ * instead of blocking, so stages can nest and run concurrently on the one
+ * set of workers without oversubscribing the CPU: there is one worker less
+ * than hardware threads, the caller being the last one. Every task belongs
+ * to the caller that started it or its parent task, and a waiting thread
+ * only runs tasks of the caller it is waiting for, e.g. a frame waiting for
+ * its extraction never picks up a piece of a level loading in the
+ * background. Idle workers run any task.
+ */
+class TaskScheduler
+{
+public:
+	struct WorkerStats
+	{
+		// tasks run and how many of them were stolen from other deques.
+		uint64_t tasks;
+		uint64_t steals;
+
+		// time spent running tasks.
+		uint64_t busyNs;
+	};
+
+private:
+	struct Task
+	{
+		std::function<void()> function;
+		TaskGroup *group;
+
+		// index of the caller deque of the thread that started it all.
+		size_t owner;
+	};
+
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<Task *> tasks;
+
+		std::atomic<uint64_t> executed;
+		std::atomic<uint64_t> steals;
+		std::atomic<uint64_t> busyNs;
+
+		Worker() : executed(0), steals(0), busyNs(0) {}
+	};
+
+	// m_workerCount worker threads, plus the deques and stats of
+	// TASK_SCHEDULER_CALLERS callers at the end.
+	size_t m_workerCount;
+	std::vector<Worker *> m_workers;
+	std::vector<std::thread> m_threads;
+
+	// callers that have a deque so far.
+	std::atomic<size_t> m_callers;
+
+	// tasks queued in any deque, workers sleep while there are none.
+	std::atomic<size_t> m_queued;
+	std::atomic<size_t> m_sleeping;
+	std::mutex m_sleepMutex;
+	std::condition_variable m_wake;
+
+	uint64_t m_statsStart;
+
+	static std::atomic<TaskScheduler *> m_instance;
+	static std::mutex m_instanceMutex;
+
+	TaskScheduler(size_t threads);
+
+	TaskScheduler(const TaskScheduler &);
+	TaskScheduler &operator=(const TaskScheduler &);
+
+public:
+	/**
+	 * Create the scheduler with the given number of threads, including
+	 * the calling one. Otherwise it is created on first use with one
+	 * thread per CPU, or as many as the ROAM_THREADS environment variable
+	 * says.
+	 *
+	 * @param threads 0 for one per CPU
+	 * @return 0 on success, -1 if the scheduler already exists.
+	 */
+	static int init(size_t threads);
+
+	static TaskScheduler *instance();
+
+	/**
+	 * Threads running tasks, the workers and the caller.
+	 */
+	size_t threadCount() const;
+
+	/**
+	 * Start the function as a task of the group. With no workers it is
+	 * run right away.
+	 */
+	void run(TaskGroup &group, const std::function<void()> &function);
+
+	/**
+	 * Run tasks until every task of the group has finished, only ones of
+	 * the same caller.
+	 */
+	void wait(TaskGroup &group);
+
+	/**
+	 * Call function(begin, end) for pieces of [begin, end) in parallel,
+	 * returns once all are done. Pieces are split down to grain elements,
+	 * without workers the whole range is one piece.
+	 *
+	 * The range is split in halves, the upper halves becoming tasks, so
+	 * idle threads steal big pieces first.
+	 *
+	 * @param begin
+	 * @param end
+	 * @param grain smallest piece worth a task
+	 * @param function
+	 */
+	void parallelFor(size_t begin, size_t end, size_t grain,
+	                 const std::function<void(size_t, size_t)> &function);
+
+	/**
+	 * Stats of every worker since the last resetStats(), and of the other
+	 * threads combined as the last entry.
+	 */
+	void getStats(std::vector<WorkerStats> &stats) const;
+
+	void resetStats();
+
+	/**
+	 * Print the utilization of every worker since the last resetStats().
+	 */
+	void printStats() const;
+
+private:
+	void workerMain(size_t index);
+
+	/**
+	 * Pop from the deque of the calling thread or steal from the others.
+	 *
+	 * @param self index of the calling thread in m_workers
+	 * @param owner caller the task must belong to, or (size_t) -1 for any
+	 */
+	Task *findTask(size_t self, size_t owner);
+
+	void execute(Task *task, size_t self);
+
+	/**
+	 * Index of the calling thread in m_workers, callers get theirs on
+	 * first use.
+	 */
+	size_t currentWorker();
+
+	/**
+	 * Caller the tasks started by the calling thread belong to.
+	 */
+	size_t currentOwner();
+};
+
+inline size_t TaskScheduler::threadCount() const
+{
+	return m_workerCount + 1;
+}
+
+#endif // TASK_SCHEDULER_HPP
@@ -0,0 +1,858 @@
+#include "terrain_data.hpp"
+#include "task_scheduler.hpp"
+#include "terrain_patch.hpp"
+#include "terrain_tile.h"
+#include "trace.hpp"
+#include "util.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// smallest batch of rays worth its own task.
+#define INTERSECT_GRAIN 256
+
+// smallest batch of samples worth its own task, and the number of
+// positions converted to grid coordinates at a time.
+#define SAMPLE_GRAIN 16384
+#define SAMPLE_CHUNK 1024
+
+// rows of heightmap preprocessing and height bounds per task.
+#define ROWS_GRAIN 64
+
+// bytes of heightmap text parsed per task.
+#define PARSE_GRAIN (1 << 20)
+
+// variance tree levels split into tasks, 2^levels per tree.
+#define VARIANCE_TASK_LEVELS 5
+
+/**
+ * Slab test of a ray against an axis aligned box.
+ *
+ * @param tEnter parameter where the ray enters the box, clamped to tMin.
+ * @return true if the ray hits the box within [tMin, tMax].
+ */
+static bool intersect_box(const float origin[3], const float direction[3],
+                          const float lo[3], const float hi[3],
+                          float tMin, float tMax, float *tEnter)
+{
+	for (int i = 0; i < 3; ++i) {
+		if (direction[i] == 0) {
+			// parallel to the slab, inside or never.
+			if (origin[i] < lo[i] || origin[i] > hi[i])
+				return false;
+			continue;
+		}
+
+		float inverse = 1.0f / direction[i];
+		float t0 = (lo[i] - origin[i]) * inverse;
+		float t1 = (hi[i] - origin[i]) * inverse;
+		if (t0 > t1)
+			std::swap(t0, t1);
+
+		tMin = std::max(tMin, t0);
+		tMax = std::min(tMax, t1);
+		if (tMin > tMax)
+			return false;
+	}
+
+	*tEnter = tMin;
+	return true;
+}
+
+/**
+ * Möller-Trumbore ray-triangle test.
+ *
+ * @return true and t if the ray hits the triangle within [0, tMax].
+ */
+static bool intersect_triangle(const float origin[3], const float direction[3],
+                               const float a[3], const float b[3], const float c[3],
+                               float tMax, float *t)
+{
+	const float e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+	const float e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+
+	const float p[3] = {
+		direction[1]*e2[2] - direction[2]*e2[1],
+		direction[2]*e2[0] - direction[0]*e2[2],
+		direction[0]*e2[1] - direction[1]*e2[0]
+	};
+
+	float det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+	if (fabsf(det) < 1e-12f)
+		return false;
+
+	float inverse = 1.0f / det;
+	const float s[3] = { origin[0] - a[0], origin[1] - a[1], origin[2] - a[2] };
+
+	float u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) * inverse;
+	if (u < 0 || u > 1)
+		return false;
+
+	const float q[3] = {
+		s[1]*e1[2] - s[2]*e1[1],
+		s[2]*e1[0] - s[0]*e1[2],
+		s[0]*e1[1] - s[1]*e1[0]
+	};
+
+	float v = (direction[0]*q[0] + direction[1]*q[1] + direction[2]*q[2]) * inverse;
+	if (v < 0 || u + v > 1)
+		return false;
+
+	float hit = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) * inverse;
+	if (hit < 0 || hit > tMax)
+		return false;
+
+	*t = hit;
+	return true;
+}
+
+TerrainData::TerrainData()
+	: m_map(NULL)
+	, m_leftVariance(NULL)
+	, m_rightVariance(NULL)
+	, m_varianceSize(0)
+	, m_heightBounds(NULL)
+	, m_boundsLevels(0)
+	, m_references(1)
+{
+}
+
+TerrainData::~TerrainData()
+{
+	delete [] m_leftVariance;
+	delete [] m_rightVariance;
+	delete [] m_heightBounds;
+	if (m_map)
+		Heightmap_delete(m_map);
+}
+
+/**
+ * Like Heightmap_read(), parsing pieces of the file in parallel: first the
+ * heights of every piece are counted to know where they go in the map,
+ * then parsed.
+ *
+ * With a step above 1 only every step-th row and column is parsed, see
+ * Heightmap_parse_decimated().
+ */
+static Heightmap *read_heightmap(const char *filename, size_t step)
+{
+	HeightmapFile file;
+	if (Heightmap_open_file(&file, filename) != 0) {
+		return NULL;
+	}
+
+	if ((file.width - 1) % step != 0 || (file.height - 1) % step != 0) {
+		printf("Heightmap %s of %zu x %zu can't be decimated by %zu\n",
+		       filename, file.width, file.height, step);
+		Heightmap_close_file(&file);
+		return NULL;
+	}
+
+	TaskScheduler *scheduler = TaskScheduler::instance();
+	const size_t total = file.width*file.height;
+
+	// skimming is cheap enough that counting first would double it on a
+	// single thread.
+	size_t pieces = std::max<size_t>((file.text + file.size - file.values) / PARSE_GRAIN, 1);
+	if (step > 1 && scheduler->threadCount() == 1) {
+		pieces = 1;
+	}
+
+	std::vector<const char *> starts(pieces + 1);
+	for (size_t i = 0; i <= pieces; ++i) {
+		starts[i] = Heightmap_split_values(&file, i, pieces);
+	}
+
+	// offsets[i] is the first height of piece i.
+	std::vector<size_t> offsets(pieces + 1, 0);
+	if (step == 1 || pieces > 1) {
+		scheduler->parallelFor(0, pieces, 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				offsets[i + 1] = Heightmap_count_values(starts[i], starts[i + 1]);
+			}
+		});
+		for (size_t i = 0; i < pieces; ++i) {
+			offsets[i + 1] += offsets[i];
+		}
+	}
+
+	Heightmap *map = NULL;
+	if (step == 1 && offsets[pieces] != total) {
+		printf("Heightmap %s has %zu heights instead of %zu x %zu\n",
+		       filename, offsets[pieces], file.width, file.height);
+	} else {
+		map = Heightmap_create((file.width - 1) / step + 1, (file.height - 1) / step + 1);
+	}
+
+	if (map) {
+		std::vector<float> minZ(pieces, FLT_MAX);
+		std::vector<float> maxZ(pieces, -FLT_MAX);
+		std::vector<size_t> counts(pieces, 0);
+		std::atomic<bool> failed(false);
+
+		scheduler->parallelFor(0, pieces, 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				int result = step == 1
+					? Heightmap_parse_values(starts[i], starts[i + 1], map->map + offsets[i],
+					                         &minZ[i], &maxZ[i])
+					: Heightmap_parse_decimated(&file, starts[i], starts[i + 1], offsets[i],
+					                            step, map->map, &counts[i],
+					                            &minZ[i], &maxZ[i]);
+				if (result != 0) {
+					failed = true;
+				}
+			}
+		});
+
+		// decimated pieces are only counted while skimming.
+		size_t parsed = step == 1 ? total : 0;
+		for (size_t i = 0; step > 1 && i < pieces; ++i) {
+			parsed += counts[i];
+		}
+		if (!failed && parsed != total) {
+			printf("Heightmap %s has %zu heights instead of %zu x %zu\n",
+			       filename, parsed, file.width, file.height);
+			failed = true;
+		}
+
+		if (failed) {
+			Heightmap_delete(map);
+			map = NULL;
+		} else {
+			map->minZ = *std::min_element(minZ.begin(), minZ.end());
+			map->maxZ = *std::max_element(maxZ.begin(), maxZ.end());
+		}
+	}
+
+	Heightmap_close_file(&file);
+
+	return map;
+}
+
+/**
+ * Normalize the heights, count the histogram and calculate normals in one
+ * pass over bands of rows, see Heightmap_preprocess_rows().
+ */
+static int preprocess_heightmap(Heightmap *map)
+{
+	if (Heightmap_allocate_normals(map) != 0) {
+		return -1;
+	}
+
+	TaskScheduler *scheduler = TaskScheduler::instance();
+	const size_t bands = (map->height + ROWS_GRAIN - 1) / ROWS_GRAIN;
+
+	std::vector<size_t> histograms(bands*HEIGHTMAP_HISTOGRAM_BINS, 0);
+	std::atomic<bool> failed(false);
+
+	scheduler->parallelFor(0, bands, 1, [&](size_t begin, size_t end) {
+		for (size_t band = begin; band < end; ++band) {
+			const size_t y0 = band*ROWS_GRAIN;
+			const size_t y1 = std::min(y0 + ROWS_GRAIN, map->height);
+			if (Heightmap_preprocess_rows(map, y0, y1,
+			                              &histograms[band*HEIGHTMAP_HISTOGRAM_BINS]) != 0) {
+				failed = true;
+			}
+		}
+	});
+
+	if (failed) {
+		return -1;
+	}
+
+	// the first and the last row of each band, no longer read by others.
+	// Two rows per band, so as many rows per task as above.
+	scheduler->parallelFor(0, bands, ROWS_GRAIN / 2, [&](size_t begin, size_t end) {
+		for (size_t band = begin; band < end; ++band) {
+			const size_t y0 = band*ROWS_GRAIN;
+			const size_t y1 = std::min(y0 + ROWS_GRAIN, map->height);
+			size_t *histogram = &histograms[band*HEIGHTMAP_HISTOGRAM_BINS];
+
+			Heightmap_normalize_rows(map, y0, y0 + 1, histogram);
+			if (y1 - 1 > y0) {
+				Heightmap_normalize_rows(map, y1 - 1, y1, histogram);
+			}
+		}
+	});
+
+	for (size_t i = 0; i < histograms.size(); ++i) {
+		map->histogram[i % HEIGHTMAP_HISTOGRAM_BINS] += histograms[i];
+	}
+
+	Heightmap_set_normalized(map);
+
+	return 0;
+}
+
+TerrainData *TerrainData::load(const char *filename)
+{
+	if (TerrainTile_is_tile(filename)) {
+		return loadTile(filename);
+	}
+
+	return loadText(filename, 1);
+}
+
+TerrainData *TerrainData::loadLevel(const char *filename, size_t step)
+{
+	if (step == 1) {
+		return load(filename);
+	}
+
+	if (TerrainTile_is_tile(filename)) {
+		return loadTileLevel(filename, step);
+	}
+
+	return loadText(filename, step);
+}
+
+int TerrainData::readSize(const char *filename, size_t *width, size_t *height, size_t *maxStep)
+{
+	if (TerrainTile_is_tile(filename)) {
+		TerrainTile *tile = TerrainTile_open(filename);
+		if (tile == NULL) {
+			return -1;
+		}
+
+		const TerrainTileHeader *header = TerrainTile_header(tile);
+		*width = *height = header->size;
+		*maxStep = (size_t) 1 << (header->pyramid_levels - 1);
+
+		TerrainTile_close(tile);
+		return 0;
+	}
+
+	HeightmapFile file;
+	if (Heightmap_open_file(&file, filename) != 0) {
+		return -1;
+	}
+
+	*width = file.width;
+	*height = file.height;
+
+	// down to 3 x 3, the smallest map with a center.
+	*maxStep = 1;
+	while ((file.width - 1) % (*maxStep*2) == 0 && (file.height - 1) % (*maxStep*2) == 0 &&
+	       (file.width - 1) / (*maxStep*2) >= 2 && (file.height - 1) / (*maxStep*2) >= 2) {
+		*maxStep *= 2;
+	}
+
+	Heightmap_close_file(&file);
+	return 0;
+}
+
+TerrainData *TerrainData::loadText(const char *filename, size_t step)
+{
+	TerrainData *data = new TerrainData;
+
+	{
+		TRACE_SCOPE("Heightmap_read");
+		data->m_map = read_heightmap(filename, step);
+		if (data->m_map == NULL) {
+			delete data;
+			return NULL;
+		}
+	}
+
+	{
+		TRACE_SCOPE("Heightmap_preprocess");
+		if (preprocess_heightmap(data->m_map) != 0) {
+			delete data;
+			return NULL;
+		}
+	}
+
+	Heightmap_print(data->m_map);
+
+	return data;
+}
+
+TerrainData *TerrainData::create(Heightmap *map)
+{
+	TerrainData *data = new TerrainData;
+	data->m_map = map;
+	return data;
+}
+
+TerrainData *TerrainData::loadTile(const char *filename)
+{
+	TRACE_SCOPE("TerrainData::loadTile");
+
+	TerrainTile *tile = TerrainTile_open(filename);
+	if (tile == NULL) {
+		return NULL;
+	}
+
+	const TerrainTileHeader *header = TerrainTile_header(tile);
+	const size_t points = (size_t) header->size*header->size;
+
+	Heightmap *map = Heightmap_create(header->size, header->size);
+	if (map == NULL || Heightmap_allocate_normals(map) != 0) {
+		if (map) {
+			Heightmap_delete(map);
+		}
+		TerrainTile_close(tile);
+		return NULL;
+	}
+
+	memcpy(map->map, TerrainTile_section(tile, header->heights), sizeof(float)*points);
+	memcpy(map->normal_map, TerrainTile_section(tile, header->normals), sizeof(float)*3*points);
+	map->minZ = header->min_z;
+	map->maxZ = header->max_z;
+	for (size_t i = 0; i < HEIGHTMAP_HISTOGRAM_BINS; ++i) {
+		map->histogram[i] = header->histogram[i];
+	}
+
+	TerrainData *data = create(map);
+
+	// baked with other levels, computeVariance() will do them.
+	if (header->variance_size == (size_t) 2<<header->variance_levels) {
+		data->m_varianceSize = header->variance_size;
+		data->m_leftVariance = new float[data->m_varianceSize];
+		data->m_rightVariance = new float[data->m_varianceSize];
+		memcpy(data->m_leftVariance, TerrainTile_section(tile, header->left_variance),
+		       sizeof(float)*data->m_varianceSize);
+		memcpy(data->m_rightVariance, TerrainTile_section(tile, header->right_variance),
+		       sizeof(float)*data->m_varianceSize);
+	}
+
+	data->layoutHeightBounds();
+	if (header->bounds_size == data->getHeightBoundsSize()) {
+		data->m_heightBounds = new float[header->bounds_size];
+		memcpy(data->m_heightBounds, TerrainTile_section(tile, header->bounds),
+		       sizeof(float)*header->bounds_size);
+	} else {
+		data->computeHeightBounds();
+	}
+
+	printf("Tile %u, %u of %u x %u\n", header->tile_x, header->tile_y,
+	       header->tiles_x, header->tiles_y);
+	Heightmap_print(map);
+
+	TerrainTile_close(tile);
+
+	return data;
+}
+
+TerrainData *TerrainData::loadTileLevel(const char *filename, size_t step)
+{
+	TRACE_SCOPE("TerrainData::loadTileLevel");
+
+	TerrainTile *tile = TerrainTile_open(filename);
+	if (tile == NULL) {
+		return NULL;
+	}
+
+	const TerrainTileHeader *header = TerrainTile_header(tile);
+	const size_t level = __builtin_ctzl(step);
+	if ((step & (step - 1)) != 0 || level >= header->pyramid_levels) {
+		printf("Tile %s has no level decimated by %zu\n", filename, step);
+		TerrainTile_close(tile);
+		return NULL;
+	}
+
+	const size_t size = TerrainTile_level_size(header, level);
+	const size_t points = size*size;
+
+	Heightmap *map = Heightmap_create(size, size);
+	if (map == NULL) {
+		TerrainTile_close(tile);
+		return NULL;
+	}
+
+	// already normalized by the raster, normalizing again keeps them.
+	memcpy(map->map, TerrainTile_level(tile, level), sizeof(float)*points);
+	map->minZ = *std::min_element(map->map, map->map + points);
+	map->maxZ = 1;
+
+	TerrainTile_close(tile);
+
+	if (preprocess_heightmap(map) != 0) {
+		Heightmap_delete(map);
+		return NULL;
+	}
+
+	Heightmap_print(map);
+
+	return create(map);
+}
+
+void TerrainData::retain()
+{
+	m_references.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TerrainData::release()
+{
+	if (m_references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		delete this;
+	}
+}
+
+void TerrainData::print() const
+{
+	printf("TerrainData {\n");
+	printf("  size: %zu x %zu\n", m_map->width, m_map->height);
+	printf("  variance_size: %zu\n", m_varianceSize);
+	printf("  references: %d\n", m_references.load());
+	printf("}\n");
+}
+
+void TerrainData::computeVariance(int maxTessellationLevels)
+{
+	TRACE_SCOPE("TerrainData::computeVariance");
+
+	// leaves are at most one level deeper than the variance tree, plus
+	// one step to select the tree. This must fit into the path codes.
+	assert(maxTessellationLevels + 2 <= PATH_CODE_PATH_BITS);
+
+	// the heights never change, neither would the trees.
+	if (m_leftVariance && m_varianceSize == (size_t) 2<<maxTessellationLevels && m_heightBounds) {
+		return;
+	}
+
+	delete [] m_leftVariance;
+	delete [] m_rightVariance;
+
+	m_varianceSize = 2<<maxTessellationLevels;
+
+	m_leftVariance  = new float[m_varianceSize];
+	m_rightVariance = new float[m_varianceSize];
+	memset(m_leftVariance,  0, sizeof(float)*m_varianceSize);
+	memset(m_rightVariance, 0, sizeof(float)*m_varianceSize);
+
+	TaskScheduler *scheduler = TaskScheduler::instance();
+	TaskGroup group;
+
+	scheduler->run(group, [this, maxTessellationLevels]() {
+		computeVarianceRecursive(
+			maxTessellationLevels, 0, m_leftVariance, 1,
+			0,              m_map->height-1, Heightmap_get(m_map, 0, m_map->height-1),
+			m_map->width-1, 0,               Heightmap_get(m_map, m_map->width-1, 0),
+			0,              0,               Heightmap_get(m_map, 0, 0));
+	});
+	computeVarianceRecursive(
+		maxTessellationLevels, 0, m_rightVariance, 1,
+		m_map->width-1, 0,               Heightmap_get(m_map, m_map->width-1, 0),
+		0,              m_map->height-1, Heightmap_get(m_map, 0, m_map->height-1),
+		m_map->width-1, m_map->height-1, Heightmap_get(m_map, m_map->width-1, m_map->height-1));
+
+	scheduler->wait(group);
+
+	computeHeightBounds();
+}
+
+size_t TerrainData::layoutHeightBounds()
+{
+	// level 0 has a node per grid cell, every level above halves it until
+	// a single node covers the whole map.
+	size_t width = m_map->width - 1;
+	size_t height = m_map->height - 1;
+	size_t total = 0;
+
+	m_boundsLevels = 0;
+	for (;;) {
+		assert(m_boundsLevels < HEIGHT_BOUNDS_MAX_LEVELS);
+
+		m_boundsOffset[m_boundsLevels] = total;
+		m_boundsWidth[m_boundsLevels] = width;
+		m_boundsHeight[m_boundsLevels] = height;
+		m_boundsLevels++;
+		total += width*height;
+
+		if (width == 1 && height == 1)
+			break;
+
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+
+	return total;
+}
+
+void TerrainData::computeHeightBounds()
+{
+	TRACE_SCOPE("TerrainData::computeHeightBounds");
+
+	delete [] m_heightBounds;
+	m_heightBounds = new float[layoutHeightBounds()*2];
+
+	TaskScheduler *scheduler = TaskScheduler::instance();
+
+	scheduler->parallelFor(0, m_boundsHeight[0], ROWS_GRAIN, [this](size_t y0, size_t y1) {
+		for (size_t y = y0; y < y1; ++y) {
+			for (size_t x = 0; x < m_boundsWidth[0]; ++x) {
+				float h00 = Heightmap_get(m_map, x,   y);
+				float h10 = Heightmap_get(m_map, x+1, y);
+				float h01 = Heightmap_get(m_map, x,   y+1);
+				float h11 = Heightmap_get(m_map, x+1, y+1);
+
+				float *bounds = &m_heightBounds[(y*m_boundsWidth[0] + x)*2];
+				bounds[0] = MIN(MIN(h00, h10), MIN(h01, h11));
+				bounds[1] = MAX(MAX(h00, h10), MAX(h01, h11));
+			}
+		}
+	});
+
+	for (size_t level = 1; level < m_boundsLevels; ++level) {
+		scheduler->parallelFor(0, m_boundsHeight[level], ROWS_GRAIN, [this, level](size_t y0, size_t y1) {
+			for (size_t y = y0; y < y1; ++y) {
+				for (size_t x = 0; x < m_boundsWidth[level]; ++x) {
+					float lo = INFINITY, hi = -INFINITY;
+
+					for (size_t cy = y*2; cy < MIN(y*2+2, m_boundsHeight[level-1]); ++cy) {
+						for (size_t cx = x*2; cx < MIN(x*2+2, m_boundsWidth[level-1]); ++cx) {
+							const float *child = getHeightBounds(level-1, cx, cy);
+							lo = MIN(lo, child[0]);
+							hi = MAX(hi, child[1]);
+						}
+					}
+
+					float *bounds = &m_heightBounds[(m_boundsOffset[level] + y*m_boundsWidth[level] + x)*2];
+					bounds[0] = lo;
+					bounds[1] = hi;
+				}
+			}
+		});
+	}
+}
+
+void TerrainData::getNodeBox(size_t level, size_t x, size_t y, float lo[3], float hi[3]) const
+{
+	const float *bounds = getHeightBounds(level, x, y);
+
+	lo[0] = x << level;
+	lo[1] = y << level;
+	lo[2] = bounds[0];
+	hi[0] = MIN((x+1) << level, m_map->width - 1);
+	hi[1] = MIN((y+1) << level, m_map->height - 1);
+	hi[2] = bounds[1];
+}
+
+void TerrainData::getHeightRange(int x0, int y0, int x1, int y1, float *lo, float *hi) const
+{
+	// cells covering the points, the last row and column of points belong
+	// to the cells before them.
+	const size_t cx0 = MIN((size_t) x0, m_boundsWidth[0] - 1);
+	const size_t cy0 = MIN((size_t) y0, m_boundsHeight[0] - 1);
+	const size_t cx1 = MAX(MIN((size_t) MAX(x1 - 1, 0), m_boundsWidth[0] - 1), cx0);
+	const size_t cy1 = MAX(MIN((size_t) MAX(y1 - 1, 0), m_boundsHeight[0] - 1), cy0);
+
+	// within 2x2 nodes once the level is past the highest differing bit.
+	const size_t spread = MAX(cx1 - cx0, cy1 - cy0);
+	const size_t level = MIN(spread ? (size_t) (32 - __builtin_clz((unsigned int) spread)) : 0,
+	                         m_boundsLevels - 1);
+
+	*lo = FLT_MAX;
+	*hi = -FLT_MAX;
+
+	for (size_t y = cy0 >> level; y <= (cy1 >> level); ++y) {
+		for (size_t x = cx0 >> level; x <= (cx1 >> level); ++x) {
+			const float *bounds = getHeightBounds(level, x, y);
+			*lo = MIN(*lo, bounds[0]);
+			*hi = MAX(*hi, bounds[1]);
+		}
+	}
+}
+
+bool TerrainData::intersect(const TerrainRay &ray, TerrainHit *hit) const
+{
+	hit->hit = false;
+	if (m_heightBounds == NULL)
+		return false;
+
+	// grid space, t is the same as in patch space.
+	const float origin[3] = {
+		ray.origin.x * m_map->width, ray.origin.y * m_map->height, ray.origin.z
+	};
+	const float direction[3] = {
+		ray.direction.x * m_map->width, ray.direction.y * m_map->height, ray.direction.z
+	};
+
+	struct Node
+	{
+		size_t level, x, y;
+		float t;
+	};
+
+	// a node pushes at most 4 children, 3 of them stay per level.
+	Node stack[HEIGHT_BOUNDS_MAX_LEVELS*3 + 1];
+	size_t top = 0;
+
+	float best = ray.maxT;
+
+	{
+		size_t level = m_boundsLevels-1;
+		float lo[3], hi[3];
+		getNodeBox(level, 0, 0, lo, hi);
+
+		float t;
+		if (!intersect_box(origin, direction, lo, hi, 0, best, &t))
+			return false;
+
+		Node root = { level, 0, 0, t };
+		stack[top++] = root;
+	}
+
+	while (top > 0) {
+		Node node = stack[--top];
+
+		// a closer hit was found after this was pushed.
+		if (node.t > best)
+			continue;
+
+		if (node.level == 0) {
+			const float h00 = Heightmap_get(m_map, node.x,   node.y);
+			const float h10 = Heightmap_get(m_map, node.x+1, node.y);
+			const float h01 = Heightmap_get(m_map, node.x,   node.y+1);
+			const float h11 = Heightmap_get(m_map, node.x+1, node.y+1);
+
+			const float x0 = node.x, x1 = node.x+1;
+			const float y0 = node.y, y1 = node.y+1;
+			const float a[3] = { x0, y0, h00 };
+			const float b[3] = { x1, y0, h10 };
+			const float c[3] = { x1, y1, h11 };
+			const float d[3] = { x0, y1, h01 };
+
+			float t;
+			if (intersect_triangle(origin, direction, a, b, c, best, &t)) {
+				best = t;
+				hit->hit = true;
+			}
+			if (intersect_triangle(origin, direction, a, c, d, best, &t)) {
+				best = t;
+				hit->hit = true;
+			}
+			continue;
+		}
+
+		// children hit by the ray, pushed farthest first.
+		Node children[4];
+		size_t count = 0;
+		size_t level = node.level-1;
+
+		for (size_t y = node.y*2; y < MIN(node.y*2+2, m_boundsHeight[level]); ++y) {
+			for (size_t x = node.x*2; x < MIN(node.x*2+2, m_boundsWidth[level]); ++x) {
+				float lo[3], hi[3];
+				getNodeBox(level, x, y, lo, hi);
+
+				float t;
+				if (intersect_box(origin, direction, lo, hi, 0, best, &t)) {
+					Node child = { level, x, y, t };
+
+					size_t i = count++;
+					for (; i > 0 && children[i-1].t < t; --i) {
+						children[i] = children[i-1];
+					}
+					children[i] = child;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < count; ++i) {
+			stack[top++] = children[i];
+		}
+	}
+
+	if (hit->hit) {
+		hit->t = best;
+		hit->position = ray.origin + ray.direction*best;
+	}
+
+	return hit->hit;
+}
+
+void TerrainData::intersect(const TerrainRay *rays, TerrainHit *hits, size_t count) const
+{
+	TRACE_SCOPE("TerrainData::intersect");
+
+	TaskScheduler::instance()->parallelFor(0, count, INTERSECT_GRAIN,
+		[this, rays, hits](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				intersect(rays[i], &hits[i]);
+			}
+		});
+}
+
+void TerrainData::computeVarianceRecursive(
+	int maxTessellationLevels, int level, float *varianceTree, int idx,
+	int left_x,  int left_y,  float left_z,
+	int right_x, int right_y, float right_z,
+	int apex_x,  int apex_y,  float apex_z)
+{
+	int center_x = (left_x + right_x) / 2;
+	int center_y = (left_y + right_y) / 2;
+	float center_z = Heightmap_get(m_map, center_x, center_y);
+
+	if (level < maxTessellationLevels) {
+		auto left = [=]() {
+			computeVarianceRecursive(
+				maxTessellationLevels, level+1, varianceTree, (idx<<1),
+				apex_x, apex_y, apex_z,
+				left_x, left_y, left_z,
+				center_x, center_y, center_z);
+		};
+		auto right = [=]() {
+			computeVarianceRecursive(
+				maxTessellationLevels, level+1, varianceTree, (idx<<1)+1,
+				right_x, right_y, right_z,
+				apex_x, apex_y, apex_z,
+				center_x, center_y, center_z);
+		};
+
+		// subtrees write disjoint nodes, the top ones are split into tasks.
+		if (level < VARIANCE_TASK_LEVELS) {
+			TaskScheduler *scheduler = TaskScheduler::instance();
+			TaskGroup group;
+			scheduler->run(group, left);
+			right();
+			scheduler->wait(group);
+		} else {
+			left();
+			right();
+		}
+
+		varianceTree[idx] = MAX(varianceTree[(idx<<1)],
+		                        varianceTree[(idx<<1)+1]);
+	} else {
+		varianceTree[idx] = fabs(center_z - ((left_z + right_z)*0.5));
+	}
+}
+
+void TerrainData::sample(const float *xs, const float *ys, size_t count,
+                         float *heights, float *normals) const
+{
+	TRACE_SCOPE("TerrainData::sample");
+
+	TaskScheduler::instance()->parallelFor(0, count, SAMPLE_GRAIN,
+		[=](size_t begin, size_t end) {
+			sampleRange(xs + begin, ys + begin, end - begin,
+			            heights ? heights + begin : NULL,
+			            normals ? normals + 3*begin : NULL);
+		});
+}
+
+void TerrainData::sampleRange(const float *xs, const float *ys, size_t count,
+                              float *heights, float *normals) const
+{
+	float gridX[SAMPLE_CHUNK], gridY[SAMPLE_CHUNK];
+	const float scaleX = m_map->width, scaleY = m_map->height;
+
+	for (size_t begin = 0; begin < count; begin += SAMPLE_CHUNK) {
+		size_t n = std::min<size_t>(SAMPLE_CHUNK, count - begin);
+
+		for (size_t i = 0; i < n; ++i) {
+			gridX[i] = xs[begin + i] * scaleX;
+			gridY[i] = ys[begin + i] * scaleY;
+		}
+
+		Heightmap_sample(m_map, gridX, gridY, n,
+		                 heights ? heights + begin : NULL,
+		                 normals ? normals + 3*begin : NULL);
+	}
+}
@@ -0,0 +1,289 @@
+#ifndef TERRAIN_DATA_HPP
+#define TERRAIN_DATA_HPP
+
+#include "heightmap.h"
+
+#include "math/vec3.hpp"
+
+#include <atomic>
+#include <stddef.h>
+
+// levels of the height bounds pyramid, enough for 2^31 wide maps.
+#define HEIGHT_BOUNDS_MAX_LEVELS 32
+
+/**
+ * Ray for TerrainData::intersect, in patch space: (x / width, y / height,
+ * height), like the tessellation.
+ */
+struct TerrainRay
+{
+	Vec3f origin;
+	Vec3f direction;
+
+	// hits are searched at origin + direction*t, 0 <= t <= maxT.
+	float maxT;
+};
+
+struct TerrainHit
+{
+	bool hit;
+
+	// ray parameter and patch space position of the hit.
+	float t;
+	Vec3f position;
+};
+
+/**
+ * Read-only terrain shared by any number of TerrainPatch views.
+ *
+ * Holds the heightmap, its normal map and the variance trees. Once
+ * computeVariance() has been called the data is never modified, so patches
+ * on different threads may tessellate against it concurrently.
+ *
+ * Lifetime is reference counted: load() returns the data with one
+ * reference, every patch retains its own and the last release() deletes it.
+ */
+class TerrainData
+{
+private:
+	Heightmap *m_map;
+
+	// left and right 'variance' trees
+	float *m_leftVariance;
+	float *m_rightVariance;
+	size_t m_varianceSize;
+
+	// min/max height of every cell at level 0, of 2x2 nodes of the level
+	// below at the others. Pairs of floats, see getHeightBounds().
+	float *m_heightBounds;
+	size_t m_boundsLevels;
+	size_t m_boundsOffset[HEIGHT_BOUNDS_MAX_LEVELS];
+	size_t m_boundsWidth[HEIGHT_BOUNDS_MAX_LEVELS];
+	size_t m_boundsHeight[HEIGHT_BOUNDS_MAX_LEVELS];
+
+	std::atomic<int> m_references;
+
+	TerrainData();
+	~TerrainData();
+
+	// not copyable, share the pointer instead.
+	TerrainData(const TerrainData &);
+	TerrainData &operator=(const TerrainData &);
+
+public:
+	/**
+	 * Read, normalize and calculate normals for the heightmap in file.
+	 *
+	 * Tiles baked by roam-bake are loaded as they are, variance trees and
+	 * height bounds included, see terrain_tile.h.
+	 *
+	 * @param filename
+	 * @return data with one reference, NULL on failure.
+	 */
+	static TerrainData *load(const char *filename);
+
+	/**
+	 * Like load(), keeping only every step-th row and column of the
+	 * heightmap, for a first look at a large terrain. The other heights of
+	 * a text heightmap are skipped without being parsed, tiles have these
+	 * levels baked in.
+	 *
+	 * A text level is normalized by its own highest height, which may be
+	 * below that of the whole map, so heights can shift slightly from one
+	 * level to the next. Tile levels are exact.
+	 *
+	 * @param filename
+	 * @param step power of two up to the maxStep of readSize(), 1 for load()
+	 * @return data with one reference, NULL on failure.
+	 */
+	static TerrainData *loadLevel(const char *filename, size_t step);
+
+	/**
+	 * Size of the heightmap in file, without loading it.
+	 *
+	 * @param filename
+	 * @param width
+	 * @param height
+	 * @param maxStep largest step loadLevel() can do
+	 * @return 0 on success, -1 on failure.
+	 */
+	static int readSize(const char *filename, size_t *width, size_t *height, size_t *maxStep);
+
+	/**
+	 * Terrain of a heightmap that is normalized and has normals.
+	 *
+	 * @param map deleted with the data
+	 * @return data with one reference.
+	 */
+	static TerrainData *create(Heightmap *map);
+
+	void retain();
+
+	/**
+	 * Drop a reference, deletes the data when it was the last one.
+	 */
+	void release();
+
+	/**
+	 * Compute variance trees, and the height bounds used by intersect().
+	 *
+	 * Must be called before the data is shared with other threads, and
+	 * again only while no patch is tessellating. Does nothing if the trees
+	 * already have the given levels, e.g. for baked tiles.
+	 *
+	 * @param tessellation max levels
+	 */
+	void computeVariance(int maxTessellationLevels = 14);
+
+	/**
+	 * Find the first hit of the ray with the terrain.
+	 *
+	 * The surface is the full resolution heightmap, each grid cell split
+	 * into two triangles along the diagonal from (x, y) to (x+1, y+1).
+	 * Empty space is skipped with a min/max height pyramid, so a query
+	 * tests only a few cells along the ray. Thread-safe.
+	 *
+	 * @param ray
+	 * @param hit result
+	 * @return true if the terrain was hit
+	 */
+	bool intersect(const TerrainRay &ray, TerrainHit *hit) const;
+
+	/**
+	 * Intersect a batch of rays, split into TaskScheduler tasks when it is
+	 * large.
+	 *
+	 * @param rays
+	 * @param hits results, one per ray
+	 * @param count number of rays
+	 */
+	void intersect(const TerrainRay *rays, TerrainHit *hits, size_t count) const;
+
+	/**
+	 * Bilinearly interpolated heights and normals at a batch of patch space
+	 * positions, see Heightmap_sample(). Large batches are split into
+	 * TaskScheduler tasks. Thread-safe.
+	 *
+	 * @param xs x / width of the positions
+	 * @param ys y / height of the positions
+	 * @param count number of positions
+	 * @param heights count heights, or NULL
+	 * @param normals 3 floats per position, or NULL
+	 */
+	void sample(const float *xs, const float *ys, size_t count,
+	            float *heights, float *normals) const;
+
+	/**
+	 * Bounds of the heights in a rectangle of grid points, from the height
+	 * bounds pyramid. Conservative: the range may cover up to twice the
+	 * rectangle on each axis.
+	 *
+	 * @param x0, y0 first corner
+	 * @param x1, y1 last corner, inclusive
+	 * @param lo minimum height
+	 * @param hi maximum height
+	 */
+	void getHeightRange(int x0, int y0, int x1, int y1, float *lo, float *hi) const;
+
+	void print() const;
+
+	/**
+	 * The heightmap, must not be modified while shared.
+	 */
+	Heightmap *getHeightmap() const;
+
+	const float *getLeftVariance() const;
+	const float *getRightVariance() const;
+	size_t getVarianceSize() const;
+
+	/**
+	 * The whole height bounds pyramid, min/max pairs of every level from
+	 * the grid cells up, as stored in baked tiles.
+	 */
+	const float *getHeightBounds() const;
+	size_t getHeightBoundsSize() const;
+
+private:
+	/**
+	 * Read a tile baked by roam-bake.
+	 */
+	static TerrainData *loadTile(const char *filename);
+
+	/**
+	 * A pyramid level of a tile, see loadLevel().
+	 */
+	static TerrainData *loadTileLevel(const char *filename, size_t step);
+
+	/**
+	 * Read a text heightmap, decimated by step.
+	 */
+	static TerrainData *loadText(const char *filename, size_t step);
+
+	/**
+	 * Set the size of every level of the height bounds pyramid.
+	 *
+	 * @return number of nodes in all levels.
+	 */
+	size_t layoutHeightBounds();
+
+	void computeHeightBounds();
+
+	/**
+	 * sample() on the calling thread.
+	 */
+	void sampleRange(const float *xs, const float *ys, size_t count,
+	                 float *heights, float *normals) const;
+
+	/**
+	 * Min and max height of a node of the height bounds pyramid.
+	 */
+	const float *getHeightBounds(size_t level, size_t x, size_t y) const;
+
+	/**
+	 * Box in grid space covered by a node of the height bounds pyramid.
+	 */
+	void getNodeBox(size_t level, size_t x, size_t y, float lo[3], float hi[3]) const;
+
+	void computeVarianceRecursive(
+		int maxTessellationLevels, int level, float *varianceTree, int idx,
+		int left_x,  int left_y,  float left_z,
+		int right_x, int right_y, float right_z,
+		int apex_x,  int apex_y,  float apex_z);
+};
+
+inline Heightmap *TerrainData::getHeightmap() const
+{
+	return m_map;
+}
+
+inline const float *TerrainData::getLeftVariance() const
+{
+	return m_leftVariance;
+}
+
+inline const float *TerrainData::getRightVariance() const
+{
+	return m_rightVariance;
+}
+
+inline size_t TerrainData::getVarianceSize() const
+{
+	return m_varianceSize;
+}
+
+inline const float *TerrainData::getHeightBounds() const
+{
+	return m_heightBounds;
+}
+
+inline size_t TerrainData::getHeightBoundsSize() const
+{
+	return m_boundsLevels ? 2*(m_boundsOffset[m_boundsLevels-1] + 1) : 0;
+}
+
+inline const float *TerrainData::getHeightBounds(size_t level, size_t x, size_t y) const
+{
+	return &m_heightBounds[(m_boundsOffset[level] + y*m_boundsWidth[level] + x)*2];
+}
+
+#endif // TERRAIN_DATA_HPP
@@ -0,0 +1,91 @@
+#include "terrain_loader.hpp"
+#include "terrain_patch.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <stdio.h>
+
+TerrainLoader::TerrainLoader(const char *filename, int maxTessellationLevels)
+	: m_filename(filename)
+	, m_maxTessellationLevels(maxTessellationLevels)
+	, m_stopped(false)
+	, m_start(std::chrono::steady_clock::now())
+{
+}
+
+TerrainLoader::~TerrainLoader()
+{
+	m_stopped = true;
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+double TerrainLoader::elapsedMs() const
+{
+	return std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - m_start).count();
+}
+
+TerrainData *TerrainLoader::loadFirst()
+{
+	size_t width, height, maxStep;
+	if (TerrainData::readSize(m_filename.c_str(), &width, &height, &maxStep) != 0) {
+		return NULL;
+	}
+
+	// the coarsest level that fits, the steps divide the size.
+	const size_t size = std::max(width, height);
+	size_t step = 1;
+	while (step < maxStep && size - 1 > (PROGRESSIVE_FIRST_SIZE - 1)*step) {
+		step *= 2;
+	}
+
+	m_steps.clear();
+	for (size_t finer = step / PROGRESSIVE_LEVEL_FACTOR; finer > 1; finer /= PROGRESSIVE_LEVEL_FACTOR) {
+		m_steps.push_back(finer);
+	}
+	if (step > 1) {
+		m_steps.push_back(1);
+	}
+
+	TerrainData *data = TerrainData::loadLevel(m_filename.c_str(), step);
+	if (data) {
+		Heightmap *map = data->getHeightmap();
+		printf("Level %zu x %zu of %zu x %zu ready after %.1f ms\n",
+		       map->width, map->height, width, height, elapsedMs());
+	}
+
+	return data;
+}
+
+void TerrainLoader::start(TerrainPatch *patch)
+{
+	if (m_steps.empty() || m_thread.joinable()) {
+		return;
+	}
+
+	m_thread = std::thread(&TerrainLoader::run, this, patch);
+}
+
+void TerrainLoader::run(TerrainPatch *patch)
+{
+	TRACE_THREAD_NAME("loader");
+
+	for (size_t i = 0; i < m_steps.size() && !m_stopped; ++i) {
+		TerrainData *data = TerrainData::loadLevel(m_filename.c_str(), m_steps[i]);
+		if (data == NULL) {
+			printf("Unable to load level %zu of %s, keeping the coarser one\n",
+			       i + 1, m_filename.c_str());
+			return;
+		}
+
+		data->computeVariance(m_maxTessellationLevels);
+
+		Heightmap *map = data->getHeightmap();
+		printf("Level %zu x %zu ready after %.1f ms\n", map->width, map->height, elapsedMs());
+
+		patch->offerData(data);
+		data->release();
+	}
+}
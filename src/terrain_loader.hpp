@@ -0,0 +1,80 @@
+#ifndef TERRAIN_LOADER_HPP
+#define TERRAIN_LOADER_HPP
+
+#include "terrain_data.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TerrainPatch;
+
+// grid points per side of the first level at most, small enough to load
+// and compute variance for in a fraction of a second.
+#define PROGRESSIVE_FIRST_SIZE 257
+
+// grid points per side of a level compared to the one before.
+#define PROGRESSIVE_LEVEL_FACTOR 8
+
+/**
+ * Progressive startup: a coarse level of the terrain is loaded first so
+ * rendering can start right away, the finer levels are loaded on a thread
+ * of their own and offered to the patch as each finishes, see
+ * TerrainPatch::offerData(). The last level is the whole heightmap, as
+ * TerrainData::load() reads it.
+ *
+ * Levels keep every step-th row and column, see TerrainData::loadLevel().
+ * A heightmap that can't be decimated is loaded whole by loadFirst().
+ */
+class TerrainLoader
+{
+private:
+	std::string m_filename;
+	int m_maxTessellationLevels;
+
+	// steps of the levels left after the first, coarsest first.
+	std::vector<size_t> m_steps;
+
+	std::thread m_thread;
+	std::atomic<bool> m_stopped;
+
+	std::chrono::steady_clock::time_point m_start;
+
+	TerrainLoader(const TerrainLoader &);
+	TerrainLoader &operator=(const TerrainLoader &);
+
+public:
+	/**
+	 * @param filename heightmap or tile, see TerrainData::load()
+	 * @param tessellation max levels of the variance of the later levels
+	 */
+	TerrainLoader(const char *filename, int maxTessellationLevels = 14);
+
+	/**
+	 * Stops once the level being loaded is done.
+	 */
+	~TerrainLoader();
+
+	/**
+	 * Load the coarsest level, without variance.
+	 *
+	 * @return data with one reference, NULL on failure.
+	 */
+	TerrainData *loadFirst();
+
+	/**
+	 * Load the rest of the levels in the background, offering each to the
+	 * patch. The patch must outlive the loader.
+	 */
+	void start(TerrainPatch *patch);
+
+private:
+	void run(TerrainPatch *patch);
+
+	double elapsedMs() const;
+};
+
+#endif // TERRAIN_LOADER_HPP
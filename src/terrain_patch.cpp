@@ -1,81 +1,288 @@
 #include "terrain_patch.hpp"
+#include "task_scheduler.hpp"
+#include "trace.hpp"
 #include "util.h"
 
-#include "gfx/spline.hpp"
-
+#include <algorithm>
+#include <assert.h>
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef ROAM_TESSELLATION_STATS
+#define TESSELLATION_STAT(x) do { x; } while (0)
+#else
+#define TESSELLATION_STAT(x) do {} while (0)
+#endif
+
+// azimuth bins of the occlusion horizon, and the most occlusion blocks
+// along each axis of the heightmap.
+#define HORIZON_BINS 1024 // power of two
+#define OCCLUSION_BLOCKS 64
+
+// blocks closer to the view are not used as occluders, the error of the
+// tessellation there is large compared to the distance.
+#define OCCLUDER_MIN_BLOCKS 2
+
+/**
+ * Monotonic substitute for the angle of (dx, dy), in [0, 4).
+ */
+static inline float pseudo_angle(float dx, float dy)
+{
+	if (dy >= 0)
+		return (dx >= 0) ? dy/(dx + dy) : 1 - dx/(-dx + dy);
+	else
+		return (dx < 0) ? 2 - dy/(-dx - dy) : 3 + dx/(dx - dy);
+}
+
+/**
+ * Append a vertex into triangle strip of grid coordinates.
+ */
+static inline void stripEmit(unsigned short *strip, size_t *length, int x, int y)
+{
+	strip[(*length)*2+0] = x;
+	strip[(*length)*2+1] = y;
+	++(*length);
+}
+
+static inline bool stripVertexIs(const unsigned short *strip, size_t i, int x, int y)
+{
+	return strip[i*2+0] == x && strip[i*2+1] == y;
+}
+
+/**
+ * Test if the triangle contains the strip edge (i, j).
+ *
+ * @return index of the triangle vertex not on the edge, -1 if not shared.
+ */
+static int stripSharedEdge(const unsigned short *strip, size_t i, size_t j, const int tri[6])
+{
+	int shared = 0, other = -1;
+
+	for (int v = 0; v < 3; ++v) {
+		if (stripVertexIs(strip, i, tri[v*2], tri[v*2+1]) ||
+		    stripVertexIs(strip, j, tri[v*2], tri[v*2+1]))
+			++shared;
+		else
+			other = v;
+	}
+
+	return (shared == 2) ? other : -1;
+}
+
+/**
+ * Append a triangle into generalized triangle strip.
+ *
+ * If the triangle shares the last edge of the strip, only the opposite
+ * vertex is added. If it shares the edge before that, the strip is swapped
+ * by repeating a vertex. Otherwise the strip is restarted with degenerate
+ * triangles.
+ */
+static void stripAppendTriangle(unsigned short *strip, size_t *length, const int tri[6])
+{
+	size_t n = *length;
+	int other;
+
+	if (n >= 2 && (other = stripSharedEdge(strip, n-2, n-1, tri)) >= 0) {
+		stripEmit(strip, length, tri[other*2], tri[other*2+1]);
+		return;
+	}
+
+	if (n >= 3 && (other = stripSharedEdge(strip, n-3, n-1, tri)) >= 0) {
+		// swap: repeating n-3 makes (n-1, n-3) the last edge. It redraws
+		// the previous triangle, which is harmless without blending.
+		stripEmit(strip, length, strip[(n-3)*2], strip[(n-3)*2+1]);
+		stripEmit(strip, length, tri[other*2], tri[other*2+1]);
+		return;
+	}
+
+	if (n > 0) {
+		// no shared edge, bridge with degenerate triangles.
+		stripEmit(strip, length, strip[(n-1)*2], strip[(n-1)*2+1]);
+		stripEmit(strip, length, tri[0], tri[1]);
+	}
+
+	stripEmit(strip, length, tri[0], tri[1]);
+	stripEmit(strip, length, tri[2], tri[3]);
+	stripEmit(strip, length, tri[4], tri[5]);
+}
+
 TerrainPatch::TerrainPatch(const char *fn, int offset_x, int offset_y)
-	: m_map(NULL)
+	: m_data(NULL)
+	, m_map(NULL)
+	, m_pendingData(NULL)
 	, m_worldX(offset_x)
 	, m_worldY(offset_y)
-	, m_leftVariance(NULL)
-	, m_rightVariance(NULL)
-	, m_varianceSize(0)
 	, m_leftRoot(NULL)
 	, m_rightRoot(NULL)
-	, m_leftLeaves(0)
-	, m_rightLeaves(0)
+	, m_leftLeaves(1)
+	, m_rightLeaves(1)
 	, m_triPool(0)
 	, m_poolSize(100000)
 	, m_poolNext(0)
+	, m_occlusionCulling(false)
+	, m_occlusionValid(false)
+	, m_occlusionLevel(0)
+	, m_occlusion(NULL)
+	, m_occlusionLevels(0)
+	, m_horizon(NULL)
 {
-	m_map = Heightmap_read(fn);
-	if (m_map == NULL) {
+	m_data = TerrainData::load(fn);
+	if (m_data == NULL) {
 		return;
 	}
 
-	Heightmap_normalize(m_map);
-	Heightmap_calculate_normals(m_map);
-	Heightmap_print(m_map);
+	init();
+}
+
+TerrainPatch::TerrainPatch(TerrainData *data, size_t poolSize)
+	: m_data(data)
+	, m_map(NULL)
+	, m_pendingData(NULL)
+	, m_worldX(0)
+	, m_worldY(0)
+	, m_leftRoot(NULL)
+	, m_rightRoot(NULL)
+	, m_leftLeaves(1)
+	, m_rightLeaves(1)
+	, m_triPool(0)
+	, m_poolSize(poolSize)
+	, m_poolNext(0)
+	, m_occlusionCulling(false)
+	, m_occlusionValid(false)
+	, m_occlusionLevel(0)
+	, m_occlusion(NULL)
+	, m_occlusionLevels(0)
+	, m_horizon(NULL)
+{
+	m_data->retain();
+
+	init();
+}
+
+void TerrainPatch::init()
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+
+	m_map = m_data->getHeightmap();
 
 	m_triPool = new BTTNode[m_poolSize];
 	memset(m_triPool, 0, sizeof(BTTNode)*m_poolSize);
 
 	m_leftRoot = allocateNode();
 	m_rightRoot = allocateNode();
+
+	layoutOcclusion();
+	m_horizon = new float[HORIZON_BINS];
+}
+
+void TerrainPatch::layoutOcclusion()
+{
+	m_occlusionValid = false;
+	m_occlusionLevel = 0;
+	m_occlusionLevels = 0;
+
+	// blocks are nodes of the height bounds pyramid, so their height range
+	// is a single lookup. Levels above hold the minimum of 2x2 blocks.
+	size_t width = m_map->width - 1;
+	size_t height = m_map->height - 1;
+	while (width > OCCLUSION_BLOCKS || height > OCCLUSION_BLOCKS) {
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+		m_occlusionLevel++;
+	}
+
+	size_t total = 0;
+	for (;;) {
+		assert(m_occlusionLevels < HEIGHT_BOUNDS_MAX_LEVELS);
+
+		m_occlusionOffset[m_occlusionLevels] = total;
+		m_occlusionWidth[m_occlusionLevels] = width;
+		m_occlusionHeight[m_occlusionLevels] = height;
+		m_occlusionLevels++;
+		total += width*height;
+
+		if (width == 1 && height == 1)
+			break;
+
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+
+	delete [] m_occlusion;
+	m_occlusion = new float[total];
 }
 
 TerrainPatch::~TerrainPatch()
 {
 	delete [] m_triPool;
-	delete [] m_leftVariance;
-	delete [] m_rightVariance;
-	Heightmap_delete(m_map);
+	delete [] m_occlusion;
+	delete [] m_horizon;
+	if (m_data)
+		m_data->release();
+
+	TerrainData *pending = m_pendingData.exchange(NULL);
+	if (pending)
+		pending->release();
+}
+
+void TerrainPatch::offerData(TerrainData *data)
+{
+	data->retain();
+
+	TerrainData *dropped = m_pendingData.exchange(data, std::memory_order_acq_rel);
+	if (dropped)
+		dropped->release();
+}
+
+bool TerrainPatch::swapData()
+{
+	TerrainData *data = m_pendingData.exchange(NULL, std::memory_order_acq_rel);
+	if (data == NULL)
+		return false;
+
+	m_data->release();
+	m_data = data;
+	m_map = m_data->getHeightmap();
+
+	layoutOcclusion();
+	reset();
+
+	return true;
 }
 
 void TerrainPatch::print() const
 {
 	printf("TerrainPatch {\n");
-	printf("  variance_size: %zu\n", this->m_varianceSize);
+	printf("  variance_size: %zu\n", m_data->getVarianceSize());
 	printf("  variance_limit: %f\n", this->m_varianceLimit);
 	printf("  left_num_leaves: %zu\n", this->m_leftLeaves);
 	printf("  right_num_leaves: %zu\n", this->m_rightLeaves);
+#ifdef ROAM_TESSELLATION_STATS
+	printf("  stats {\n");
+	printf("    splits: %zu\n", m_stats.splits);
+	printf("    forced_splits: %zu\n", m_stats.forcedSplits);
+	printf("    max_forced_split_depth: %zu\n", m_stats.maxForcedSplitDepth);
+	printf("    pool_used: %zu / %zu\n", m_stats.poolUsed, m_poolSize);
+	printf("    pool_exhausted: %zu\n", m_stats.poolExhausted);
+	printf("    variance_cutoffs: %zu\n", m_stats.varianceCutoffs);
+	printf("    occluded_nodes: %zu\n", m_stats.occludedNodes);
+	printf("    leaf_depths {\n");
+	for (size_t i = 0; i < TESSELLATION_STATS_MAX_DEPTH; ++i) {
+		if (m_stats.leafDepths[i])
+			printf("      %2zu : %zu,\n", i, m_stats.leafDepths[i]);
+	}
+	printf("    }\n");
+	printf("  }\n");
+#endif
 	printf("}\n");
 }
 
 void TerrainPatch::computeVariance(int maxTessellationLevels)
 {
-	m_varianceSize = 2<<maxTessellationLevels;
-
-	m_leftVariance  = new float[m_varianceSize];
-	m_rightVariance = new float[m_varianceSize];
-	memset(m_leftVariance,  0, sizeof(float)*m_varianceSize);
-	memset(m_rightVariance, 0, sizeof(float)*m_varianceSize);
-
-	computeVarianceRecursive(
-		maxTessellationLevels, 0, m_leftVariance, 1, m_map,
-		0,              m_map->height-1, Heightmap_get(m_map, 0, m_map->height-1),
-		m_map->width-1, 0,               Heightmap_get(m_map, m_map->width-1, 0),
-		0,              0,               Heightmap_get(m_map, 0, 0));
-	computeVarianceRecursive(
-		maxTessellationLevels, 0, m_rightVariance, 1, m_map,
-		m_map->width-1, 0,               Heightmap_get(m_map, m_map->width-1, 0),
-		0,              m_map->height-1, Heightmap_get(m_map, 0, m_map->height-1),
-		m_map->width-1, m_map->height-1, Heightmap_get(m_map, m_map->width-1, m_map->height-1));
+	m_data->computeVariance(maxTessellationLevels);
 }
 
 void TerrainPatch::reset()
@@ -90,48 +297,451 @@ void TerrainPatch::reset()
 	m_rightRoot->base_neighbor = m_leftRoot;
 
 	m_poolNext = 2;
+	m_leftLeaves = m_rightLeaves = 1;
+
+	memset(&m_stats, 0, sizeof(m_stats));
 }
 
 void TerrainPatch::tessellate(const Vec3f &view, float errorMargin)
 {
+	tessellate(&view, 1, errorMargin);
+}
+
+void TerrainPatch::tessellate(const Vec3f *views, size_t viewCount, float errorMargin)
+{
+	TRACE_SCOPE("TerrainPatch::tessellate");
+
+	m_occlusionValid = false;
+	if (m_occlusionCulling) {
+		computeOcclusion(views, viewCount, errorMargin);
+	}
+
 	tessellateRecursive(
-		m_leftRoot, view, errorMargin,
+		m_leftRoot, views, viewCount, errorMargin,
 		0,              m_map->height-1,
 		m_map->width-1, 0,
 		0,              0,
-		m_leftVariance, 1);
+		m_data->getLeftVariance(), 1);
 	tessellateRecursive(
-		m_rightRoot, view, errorMargin,
+		m_rightRoot, views, viewCount, errorMargin,
 		m_map->width-1, 0,
 		0,              m_map->height-1,
 		m_map->width-1, m_map->height-1,
-		m_rightVariance, 1);
+		m_data->getRightVariance(), 1);
 
+#ifdef ROAM_TESSELLATION_STATS
+	m_leftLeaves = countLeafDepths(m_leftRoot, 0);
+	m_rightLeaves = countLeafDepths(m_rightRoot, 0);
+	m_stats.poolUsed = m_poolNext;
+#else
 	m_leftLeaves = BTTNode_number_of_leaves(m_leftRoot);
 	m_rightLeaves = BTTNode_number_of_leaves(m_rightRoot);
+#endif
 }
 
-void TerrainPatch::getTessellation(float *vertices, float *colors, float *normalTexels)
+void TerrainPatch::setOcclusionCulling(bool enabled)
 {
-	int idx = 0;
+	m_occlusionCulling = enabled;
+	m_occlusionValid = false;
+}
+
+size_t TerrainPatch::getTessellation(float *vertices, float *normalTexels, const Mat4x4f *clip)
+{
+	TRACE_SCOPE("TerrainPatch::getTessellation");
+
+	// the trees are extracted at once, the right one after room for every
+	// leaf of the left one, and packed once both are done.
+	const size_t rightFirst = m_leftLeaves;
+	int left = 0, right = 0;
+
+	TaskScheduler *scheduler = TaskScheduler::instance();
+	TaskGroup group;
+
+	scheduler->run(group, [&]() {
+		getTessellationRecursive(
+			m_leftRoot, m_map, vertices, normalTexels, &left, clip,
+			0,                 m_map->height-1,
+			m_map->width-1, 0,
+			0,                 0);
+	});
 	getTessellationRecursive(
-		m_leftRoot, m_map, vertices, colors, normalTexels, &idx,
-		0,                 m_map->height-1,
+		m_rightRoot, m_map, vertices + rightFirst*9,
+		normalTexels ? normalTexels + rightFirst*6 : NULL, &right, clip,
 		m_map->width-1, 0,
-		0,                 0);
-	getTessellationRecursive(
-		m_rightRoot, m_map, vertices, colors, normalTexels, &idx,
+		0,              m_map->height-1,
+		m_map->width-1, m_map->height-1);
+	scheduler->wait(group);
+
+	const size_t leftCount = left/9, rightCount = right/9;
+	if (leftCount != rightFirst) {
+		memmove(vertices + leftCount*9, vertices + rightFirst*9, sizeof(float)*9*rightCount);
+		if (normalTexels) {
+			memmove(normalTexels + leftCount*6, normalTexels + rightFirst*6,
+			        sizeof(float)*6*rightCount);
+		}
+	}
+
+	return leftCount + rightCount;
+}
+
+size_t TerrainPatch::getTessellationGrid(unsigned short *gridCoords, const Mat4x4f *clip)
+{
+	TRACE_SCOPE("TerrainPatch::getTessellationGrid");
+
+	// as in getTessellation().
+	const size_t rightFirst = m_leftLeaves*6;
+	int left = 0, right = 0;
+
+	TaskScheduler *scheduler = TaskScheduler::instance();
+	TaskGroup group;
+
+	scheduler->run(group, [&]() {
+		getTessellationGridRecursive(
+			m_leftRoot, gridCoords, &left, clip,
+			0,              m_map->height-1,
+			m_map->width-1, 0,
+			0,              0);
+	});
+	getTessellationGridRecursive(
+		m_rightRoot, gridCoords + rightFirst, &right, clip,
+		m_map->width-1, 0,
+		0,              m_map->height-1,
+		m_map->width-1, m_map->height-1);
+	scheduler->wait(group);
+
+	if ((size_t) left != rightFirst) {
+		memmove(gridCoords + left, gridCoords + rightFirst, sizeof(unsigned short)*right);
+	}
+
+	return (left + right)/6;
+}
+
+void TerrainPatch::getTessellationStrips(unsigned short *gridCoords, size_t stripLengths[2],
+                                         const Mat4x4f *clip)
+{
+	TRACE_SCOPE("TerrainPatch::getTessellationStrips");
+
+	stripLengths[0] = 0;
+	getTessellationStripRecursive(
+		m_leftRoot, gridCoords, &stripLengths[0], false, clip,
+		0,              m_map->height-1,
+		m_map->width-1, 0,
+		0,              0);
+
+	stripLengths[1] = 0;
+	getTessellationStripRecursive(
+		m_rightRoot, gridCoords + stripLengths[0]*2, &stripLengths[1], false, clip,
+		m_map->width-1, 0,
+		0,              m_map->height-1,
+		m_map->width-1, m_map->height-1);
+}
+
+size_t TerrainPatch::getTessellationCodes(unsigned int *pathCodes, const Mat4x4f *clip)
+{
+	TRACE_SCOPE("TerrainPatch::getTessellationCodes");
+
+	// as in getTessellation().
+	const size_t rightFirst = m_leftLeaves;
+	int left = 0, right = 0;
+
+	TaskScheduler *scheduler = TaskScheduler::instance();
+	TaskGroup group;
+
+	scheduler->run(group, [&]() {
+		getTessellationCodesRecursive(
+			m_leftRoot, pathCodes, &left, clip, 0, 1,
+			0,              m_map->height-1,
+			m_map->width-1, 0,
+			0,              0);
+	});
+	getTessellationCodesRecursive(
+		m_rightRoot, pathCodes + rightFirst, &right, clip, 1, 1,
 		m_map->width-1, 0,
 		0,              m_map->height-1,
 		m_map->width-1, m_map->height-1);
+	scheduler->wait(group);
+
+	if ((size_t) left != rightFirst) {
+		memmove(pathCodes + left, pathCodes + rightFirst, sizeof(unsigned int)*right);
+	}
+
+	return left + right;
+}
+
+size_t TerrainPatch::getSplitCodes(unsigned int *pathCodes)
+{
+	TRACE_SCOPE("TerrainPatch::getSplitCodes");
+
+	int idx = 0;
+	getSplitCodesRecursive(m_leftRoot, pathCodes, &idx, 0, 1);
+	getSplitCodesRecursive(m_rightRoot, pathCodes, &idx, 1, 1);
+
+	return idx;
+}
+
+bool TerrainPatch::isOutside(const Mat4x4f &clip,
+	int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y) const
+{
+	const int corners[6] = { left_x, left_y, right_x, right_y, apex_x, apex_y };
+
+	// bit per clip plane the corner is outside of.
+	unsigned int outside = 0x3f;
+
+	for (int i = 0; i < 3; ++i) {
+		int x = corners[i*2], y = corners[i*2+1];
+		Vec4f p = clip * Vec4f((float) x / m_map->width,
+		                       (float) y / m_map->height,
+		                       Heightmap_get(m_map, x, y), 1);
+
+		unsigned int code = 0;
+		if (p.x < -p.w) code |= 0x01;
+		if (p.x >  p.w) code |= 0x02;
+		if (p.y < -p.w) code |= 0x04;
+		if (p.y >  p.w) code |= 0x08;
+		if (p.z < -p.w) code |= 0x10;
+		if (p.z >  p.w) code |= 0x20;
+
+		outside &= code;
+		if (!outside)
+			return false;
+	}
+
+	return true;
+}
+
+bool TerrainPatch::isOccluded(
+	int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y) const
+{
+	if (!m_occlusionValid)
+		return false;
+
+	const int x0 = MIN(MIN(left_x, right_x), apex_x);
+	const int y0 = MIN(MIN(left_y, right_y), apex_y);
+	const int x1 = MAX(MAX(left_x, right_x), apex_x);
+	const int y1 = MAX(MAX(left_y, right_y), apex_y);
+
+	// blocks of the cells under the triangle, like getHeightRange().
+	const size_t bx0 = MIN((size_t) x0 >> m_occlusionLevel, m_occlusionWidth[0] - 1);
+	const size_t by0 = MIN((size_t) y0 >> m_occlusionLevel, m_occlusionHeight[0] - 1);
+	const size_t bx1 = MAX(MIN((size_t) MAX(x1 - 1, 0) >> m_occlusionLevel, m_occlusionWidth[0] - 1), bx0);
+	const size_t by1 = MAX(MIN((size_t) MAX(y1 - 1, 0) >> m_occlusionLevel, m_occlusionHeight[0] - 1), by0);
+
+	// within 2x2 nodes once the level is past the highest differing bit.
+	const size_t spread = MAX(bx1 - bx0, by1 - by0);
+	const size_t level = MIN(spread ? (size_t) (32 - __builtin_clz((unsigned int) spread)) : 0,
+	                         m_occlusionLevels - 1);
+
+	float hidden = FLT_MAX;
+	for (size_t y = by0 >> level; y <= (by1 >> level); ++y) {
+		for (size_t x = bx0 >> level; x <= (bx1 >> level); ++x) {
+			hidden = MIN(hidden, m_occlusion[m_occlusionOffset[level] + y*m_occlusionWidth[level] + x]);
+		}
+	}
+
+	// nothing is hidden at some block.
+	if (hidden == -FLT_MAX)
+		return false;
+
+	float lo, hi;
+	m_data->getHeightRange(x0, y0, x1, y1, &lo, &hi);
+
+	return hi < hidden;
+}
+
+bool TerrainPatch::isCulled(const Mat4x4f &clip,
+	int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y) const
+{
+	return isOutside(clip, left_x, left_y, right_x, right_y, apex_x, apex_y) ||
+	       isOccluded(left_x, left_y, right_x, right_y, apex_x, apex_y);
+}
+
+void TerrainPatch::computeOcclusion(const Vec3f *views, size_t viewCount, float errorMargin)
+{
+	TRACE_SCOPE("TerrainPatch::computeOcclusion");
+
+	const size_t blocks = m_occlusionWidth[0]*m_occlusionHeight[0];
+	std::fill(m_occlusion, m_occlusion + blocks, FLT_MAX);
+
+	for (size_t i = 0; i < viewCount; ++i) {
+		computeHorizon(views[i], errorMargin);
+	}
+
+	for (size_t level = 1; level < m_occlusionLevels; ++level) {
+		const float *below = &m_occlusion[m_occlusionOffset[level-1]];
+		float *nodes = &m_occlusion[m_occlusionOffset[level]];
+
+		for (size_t y = 0; y < m_occlusionHeight[level]; ++y) {
+			for (size_t x = 0; x < m_occlusionWidth[level]; ++x) {
+				float hidden = FLT_MAX;
+				for (size_t cy = y*2; cy < MIN(y*2+2, m_occlusionHeight[level-1]); ++cy) {
+					for (size_t cx = x*2; cx < MIN(x*2+2, m_occlusionWidth[level-1]); ++cx) {
+						hidden = MIN(hidden, below[cy*m_occlusionWidth[level-1] + cx]);
+					}
+				}
+				nodes[y*m_occlusionWidth[level] + x] = hidden;
+			}
+		}
+	}
+
+	m_occlusionValid = true;
+}
+
+void TerrainPatch::computeHorizon(const Vec3f &view, float errorMargin)
+{
+	TRACE_SCOPE("TerrainPatch::computeHorizon");
+
+	const size_t width = m_occlusionWidth[0];
+	const size_t height = m_occlusionHeight[0];
+	const size_t blocks = width*height;
+	const float size = (float) (1 << m_occlusionLevel);
+
+	// grid space, heights are the same.
+	const float eyeX = view.x * m_map->width;
+	const float eyeY = view.y * m_map->height;
+	const float eyeZ = view.z;
+
+	m_blockNear.resize(blocks);
+	m_blockFar.resize(blocks);
+	m_blockOrder.resize(blocks);
+
+	// blocks by their near distance, in steps of a block.
+	const size_t buckets = (size_t) ((m_map->width + m_map->height) / size) + 2;
+	m_bucketStart.assign(buckets + 1, 0);
+
+	for (size_t by = 0; by < height; ++by) {
+		const float y0 = by*size, y1 = MIN((by+1)*size, m_map->height - 1.0f);
+		const float nearY = MAX(MAX(y0 - eyeY, eyeY - y1), 0.0f);
+		const float farY = MAX(fabsf(eyeY - y0), fabsf(eyeY - y1));
+
+		for (size_t bx = 0; bx < width; ++bx) {
+			const float x0 = bx*size, x1 = MIN((bx+1)*size, m_map->width - 1.0f);
+			const float nearX = MAX(MAX(x0 - eyeX, eyeX - x1), 0.0f);
+			const float farX = MAX(fabsf(eyeX - x0), fabsf(eyeX - x1));
+
+			const size_t i = by*width + bx;
+			m_blockNear[i] = sqrtf(nearX*nearX + nearY*nearY);
+			m_blockFar[i] = sqrtf(farX*farX + farY*farY);
+			m_bucketStart[MIN((size_t) (m_blockNear[i] / size), buckets - 1) + 1]++;
+		}
+	}
+
+	for (size_t b = 0; b < buckets; ++b) {
+		m_bucketStart[b+1] += m_bucketStart[b];
+	}
+	for (size_t i = 0; i < blocks; ++i) {
+		m_blockOrder[m_bucketStart[MIN((size_t) (m_blockNear[i] / size), buckets - 1)]++] = i;
+	}
+
+	std::fill(m_horizon, m_horizon + HORIZON_BINS, -FLT_MAX);
+
+	// occluders waiting for the sweep, linked by the bucket of their far
+	// distance.
+	m_occluders.clear();
+	m_occluderHead.assign(buckets, -1);
+
+	const float binsPerUnit = HORIZON_BINS / 4.0f;
+	size_t bucket = 0;
+
+	for (size_t n = 0; n < blocks; ++n) {
+		const size_t i = m_blockOrder[n];
+		const float near = m_blockNear[i], far = m_blockFar[i];
+
+		// an occluder may only hide blocks entirely behind it, so it is
+		// added once the sweep is past its far distance.
+		const size_t current = (size_t) (near / size);
+		for (; bucket < current; ++bucket) {
+			for (int o = m_occluderHead[bucket+1]; o >= 0; o = m_occluders[o].next) {
+				const Occluder &occluder = m_occluders[o];
+				for (int b = occluder.firstBin; b <= occluder.lastBin; ++b) {
+					float &horizon = m_horizon[b & (HORIZON_BINS - 1)];
+					horizon = MAX(horizon, occluder.slope);
+				}
+			}
+		}
+
+		// the view is above the block, it is neither hidden nor hides
+		// anything in every direction.
+		if (near <= 0) {
+			m_occlusion[i] = -FLT_MAX;
+			continue;
+		}
+
+		const size_t bx = i % width, by = i / width;
+		const float x0 = bx*size - eyeX, x1 = MIN((bx+1)*size, m_map->width - 1.0f) - eyeX;
+		const float y0 = by*size - eyeY, y1 = MIN((by+1)*size, m_map->height - 1.0f) - eyeY;
+
+		// azimuths of the block, around its center to handle the wrap.
+		const float center = pseudo_angle((x0 + x1)*0.5f, (y0 + y1)*0.5f);
+		const float corners[4] = {
+			pseudo_angle(x0, y0), pseudo_angle(x1, y0),
+			pseudo_angle(x0, y1), pseudo_angle(x1, y1)
+		};
+		float first = 0, last = 0;
+		for (int c = 0; c < 4; ++c) {
+			float delta = corners[c] - center;
+			if (delta > 2)
+				delta -= 4;
+			else if (delta < -2)
+				delta += 4;
+			first = MIN(first, delta);
+			last = MAX(last, delta);
+		}
+		first = (center + first)*binsPerUnit;
+		last = (center + last)*binsPerUnit;
+
+		// lowest horizon over every bin the block touches.
+		float horizon = FLT_MAX;
+		for (int b = (int) floorf(first - 0.01f); b <= (int) floorf(last + 0.01f); ++b) {
+			horizon = MIN(horizon, m_horizon[b & (HORIZON_BINS - 1)]);
+		}
+
+		float lo, hi;
+		m_data->getHeightRange(bx << m_occlusionLevel, by << m_occlusionLevel,
+		                       MIN((bx+1) << m_occlusionLevel, m_map->width - 1),
+		                       MIN((by+1) << m_occlusionLevel, m_map->height - 1),
+		                       &lo, &hi);
+
+		// heights below the horizon at the whole block are hidden. If none
+		// of the block is, neither is anything overlapping it, which lets
+		// isOccluded() stop at the coarse levels.
+		float hidden = -FLT_MAX;
+		if (horizon > -FLT_MAX) {
+			hidden = eyeZ + horizon*(horizon >= 0 ? near : far);
+		}
+		if (hidden <= lo) {
+			hidden = -FLT_MAX;
+		}
+		m_occlusion[i] = MIN(m_occlusion[i], hidden);
+
+		// as an occluder the block is its lowest height at its worst
+		// distance, lowered by the variance the tessellation leaves at
+		// that distance, see tessellateRecursive().
+
+		const float distance = (far + size*2) / m_map->width;
+		lo -= errorMargin*(1 + distance*distance*m_map->width/128.0f);
+
+		const float slope = (lo - eyeZ) / (lo >= eyeZ ? far : near);
+		const int firstBin = (int) ceilf(first + 0.01f);
+		const int lastBin = (int) floorf(last - 0.01f) - 1;
+
+		if (slope > horizon && firstBin <= lastBin && near >= size*OCCLUDER_MIN_BLOCKS) {
+			// far is past near, so always in a later bucket.
+			const size_t after = MIN((size_t) ceilf(far / size), buckets - 1);
+			Occluder occluder = { slope, firstBin, lastBin, m_occluderHead[after] };
+			m_occluderHead[after] = (int) m_occluders.size();
+			m_occluders.push_back(occluder);
+		}
+	}
 }
 
 BTTNode *TerrainPatch::allocateNode()
 {
 	BTTNode *tri;
 
-	if (m_poolNext >= m_poolSize)
+	if (m_poolNext >= m_poolSize) {
+		TESSELLATION_STAT(m_stats.poolExhausted++);
 		return NULL;
+	}
 
 	tri = &m_triPool[m_poolNext++];
 	tri->left_child = tri->right_child = NULL;
@@ -139,13 +749,20 @@ BTTNode *TerrainPatch::allocateNode()
 	return tri;
 }
 
-void TerrainPatch::split(BTTNode *node)
+void TerrainPatch::split(BTTNode *node, size_t depth)
 {
+	TRACE_SCOPE_FINE("TerrainPatch::split");
+
 	if (node->left_child)
 		return;
 
-	if (node->base_neighbor && node->base_neighbor->base_neighbor != node)
-		split(node->base_neighbor);
+	TESSELLATION_STAT(
+		m_stats.maxForcedSplitDepth = MAX(m_stats.maxForcedSplitDepth, depth));
+
+	if (node->base_neighbor && node->base_neighbor->base_neighbor != node) {
+		TESSELLATION_STAT(m_stats.forcedSplits++);
+		split(node->base_neighbor, depth+1);
+	}
 
 	node->left_child = allocateNode();
 	node->right_child = allocateNode();
@@ -188,7 +805,8 @@ void TerrainPatch::split(BTTNode *node)
 			node->left_child->right_neighbor = node->base_neighbor->right_child;
 			node->right_child->left_neighbor = node->base_neighbor->left_child;
 		} else {
-			split(node->base_neighbor);
+			// the other half of the diamond, not a forced split.
+			split(node->base_neighbor, depth);
 		}
 	} else {
 		// edge triangle
@@ -198,69 +816,66 @@ void TerrainPatch::split(BTTNode *node)
 }
 
 void TerrainPatch::tessellateRecursive(
-	BTTNode *node, const Vec3f &view, float errorMargin,
+	BTTNode *node, const Vec3f *views, size_t viewCount, float errorMargin,
 	int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
-	float *variance_tree, int variance_idx)
+	const float *variance_tree, int variance_idx)
 {
 	float center_x = (left_x + right_x) * 0.5f;
 	float center_y = (left_y + right_y) * 0.5f;
 
-	if (variance_idx < m_varianceSize) {
-		float a = center_x/m_map->width - view.x;
-		float b = center_y/m_map->height - view.y;
-		float distance = 1 + ((a*a + b*b)*m_map->width/128.0f);
+	if ((size_t) variance_idx < m_data->getVarianceSize()) {
+		// closest view has the highest priority.
+		float nearest = FLT_MAX;
+		for (size_t i = 0; i < viewCount; ++i) {
+			float a = center_x/m_map->width - views[i].x;
+			float b = center_y/m_map->height - views[i].y;
+			nearest = MIN(nearest, a*a + b*b);
+		}
+
+		float distance = 1 + (nearest*m_map->width/128.0f);
 		float variance = variance_tree[variance_idx]/distance;
 
 		if (variance > errorMargin) {
+			// a hidden triangle is left whole, the extraction drops it.
+			if (isOccluded(left_x, left_y, right_x, right_y, apex_x, apex_y)) {
+				TESSELLATION_STAT(m_stats.occludedNodes++);
+				return;
+			}
+
+			TESSELLATION_STAT(m_stats.splits++);
 			split(node);
 			if (node->left_child &&
 			   ((abs(left_x - right_x) >= 3) || (abs(left_y - right_y) >= 3)))
 			{
 				tessellateRecursive(
-					node->left_child, view, errorMargin,
+					node->left_child, views, viewCount, errorMargin,
 					apex_x, apex_y, left_x, left_y, center_x, center_y,
 					variance_tree, (variance_idx<<1));
 				tessellateRecursive(
-					node->right_child, view, errorMargin,
+					node->right_child, views, viewCount, errorMargin,
 					right_x, right_y, apex_x, apex_y, center_x, center_y,
 					variance_tree, (variance_idx<<1)+1);
 			}
 		}
+	} else {
+		TESSELLATION_STAT(m_stats.varianceCutoffs++);
 	}
 }
 
-void TerrainPatch::computeVarianceRecursive(
-	int maxTessellationLevels, int level, float *varianceTree, int idx, Heightmap *map,
-	int left_x,  int left_y,  float left_z,
-	int right_x, int right_y, float right_z,
-	int apex_x,  int apex_y,  float apex_z)
+size_t TerrainPatch::countLeafDepths(BTTNode *node, size_t depth)
 {
-	int center_x = (left_x + right_x) / 2;
-	int center_y = (left_y + right_y) / 2;
-	float center_z = Heightmap_get(map, center_x, center_y);
-
-	if (level < maxTessellationLevels) {
-		computeVarianceRecursive(
-			maxTessellationLevels, level+1, varianceTree, (idx<<1), map,
-			apex_x, apex_y, apex_z,
-			left_x, left_y, left_z,
-			center_x, center_y, center_z);
-		computeVarianceRecursive(
-			maxTessellationLevels, level+1, varianceTree, (idx<<1)+1, map,
-			right_x, right_y, right_z,
-			apex_x, apex_y, apex_z,
-			center_x, center_y, center_z);
-
-		varianceTree[idx] = MAX(varianceTree[(idx<<1)],
-		                        varianceTree[(idx<<1)+1]);
-	} else {
-		varianceTree[idx] = fabs(center_z - ((left_z + right_z)*0.5));
+	if (node->left_child) {
+		return countLeafDepths(node->left_child, depth+1) +
+		       countLeafDepths(node->right_child, depth+1);
 	}
+
+	m_stats.leafDepths[MIN(depth, TESSELLATION_STATS_MAX_DEPTH-1)]++;
+	return 1;
 }
 
 void TerrainPatch::getTessellationRecursive(
 	BTTNode *node, Heightmap *map,
-	float *vertices, float *colors, float *normalTexels, int *idx,
+	float *vertices, float *normalTexels, int *idx, const Mat4x4f *clip,
 	int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y)
 {
 	if (node->left_child) {
@@ -268,12 +883,12 @@ void TerrainPatch::getTessellationRecursive(
 		int center_y = (left_y + right_y) / 2;
 
 		getTessellationRecursive(
-			node->left_child, map, vertices, colors, normalTexels, idx,
+			node->left_child, map, vertices, normalTexels, idx, clip,
 			apex_x, apex_y, left_x, left_y, center_x, center_y);
 		getTessellationRecursive(
-			node->right_child, map, vertices, colors, normalTexels, idx,
+			node->right_child, map, vertices, normalTexels, idx, clip,
 			right_x, right_y, apex_x, apex_y, center_x, center_y);
-	} else {
+	} else if (!clip || !isCulled(*clip, left_x, left_y, right_x, right_y, apex_x, apex_y)) {
 		// we're at leaf
 		vertices[*idx+0] = (float) left_x / map->width;
 		vertices[*idx+1] = (float) left_y / map->height;
@@ -285,23 +900,113 @@ void TerrainPatch::getTessellationRecursive(
 		vertices[*idx+7] = (float) apex_y / map->height;
 		vertices[*idx+8] = Heightmap_get(map, apex_x, apex_y);
 
-		colors[*idx+0] = 1;
-		colors[*idx+1] = 1;
-		colors[*idx+2] = 1;
-		colors[*idx+3] = 1;
-		colors[*idx+4] = 1;
-		colors[*idx+5] = 1;
-		colors[*idx+6] = 1;
-		colors[*idx+7] = 1;
-		colors[*idx+8] = 1;
-
-		normalTexels[(*idx/9)*6+0] = (float) left_x / map->width;
-		normalTexels[(*idx/9)*6+1] = (float) left_y / map->height;
-		normalTexels[(*idx/9)*6+2] = (float) right_x / map->width;
-		normalTexels[(*idx/9)*6+3] = (float) right_y / map->height;
-		normalTexels[(*idx/9)*6+4] = (float) apex_x / map->width;
-		normalTexels[(*idx/9)*6+5] = (float) apex_y / map->height;
+		if (normalTexels) {
+			normalTexels[(*idx/9)*6+0] = (float) left_x / map->width;
+			normalTexels[(*idx/9)*6+1] = (float) left_y / map->height;
+			normalTexels[(*idx/9)*6+2] = (float) right_x / map->width;
+			normalTexels[(*idx/9)*6+3] = (float) right_y / map->height;
+			normalTexels[(*idx/9)*6+4] = (float) apex_x / map->width;
+			normalTexels[(*idx/9)*6+5] = (float) apex_y / map->height;
+		}
 
 		*idx += 9;
 	}
 }
+
+void TerrainPatch::getTessellationGridRecursive(
+	BTTNode *node, unsigned short *gridCoords, int *idx, const Mat4x4f *clip,
+	int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y)
+{
+	if (node->left_child) {
+		int center_x = (left_x + right_x) / 2;
+		int center_y = (left_y + right_y) / 2;
+
+		getTessellationGridRecursive(
+			node->left_child, gridCoords, idx, clip,
+			apex_x, apex_y, left_x, left_y, center_x, center_y);
+		getTessellationGridRecursive(
+			node->right_child, gridCoords, idx, clip,
+			right_x, right_y, apex_x, apex_y, center_x, center_y);
+	} else if (!clip || !isCulled(*clip, left_x, left_y, right_x, right_y, apex_x, apex_y)) {
+		// we're at leaf
+		gridCoords[*idx+0] = left_x;
+		gridCoords[*idx+1] = left_y;
+		gridCoords[*idx+2] = right_x;
+		gridCoords[*idx+3] = right_y;
+		gridCoords[*idx+4] = apex_x;
+		gridCoords[*idx+5] = apex_y;
+
+		*idx += 6;
+	}
+}
+
+void TerrainPatch::getTessellationCodesRecursive(
+	BTTNode *node, unsigned int *pathCodes, int *idx, const Mat4x4f *clip,
+	unsigned int path, unsigned int steps,
+	int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y)
+{
+	if (node->left_child) {
+		int center_x = (left_x + right_x) / 2;
+		int center_y = (left_y + right_y) / 2;
+
+		getTessellationCodesRecursive(
+			node->left_child, pathCodes, idx, clip, (path<<1), steps+1,
+			apex_x, apex_y, left_x, left_y, center_x, center_y);
+		getTessellationCodesRecursive(
+			node->right_child, pathCodes, idx, clip, (path<<1)+1, steps+1,
+			right_x, right_y, apex_x, apex_y, center_x, center_y);
+	} else if (!clip || !isCulled(*clip, left_x, left_y, right_x, right_y, apex_x, apex_y)) {
+		// we're at leaf
+		pathCodes[*idx] = (steps << PATH_CODE_PATH_BITS) | path;
+		*idx += 1;
+	}
+}
+
+void TerrainPatch::getSplitCodesRecursive(
+	BTTNode *node, unsigned int *pathCodes, int *idx,
+	unsigned int path, unsigned int steps)
+{
+	if (node->left_child) {
+		pathCodes[*idx] = (steps << PATH_CODE_PATH_BITS) | path;
+		*idx += 1;
+
+		getSplitCodesRecursive(node->left_child, pathCodes, idx, (path<<1), steps+1);
+		getSplitCodesRecursive(node->right_child, pathCodes, idx, (path<<1)+1, steps+1);
+	}
+}
+
+void TerrainPatch::getTessellationStripRecursive(
+	BTTNode *node, unsigned short *strip, size_t *length, bool reverse, const Mat4x4f *clip,
+	int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y)
+{
+	if (node->left_child) {
+		int center_x = (left_x + right_x) / 2;
+		int center_y = (left_y + right_y) / 2;
+
+		// children are visited in alternating order every level, this
+		// makes consecutive leaves share an edge.
+		if (!reverse) {
+			getTessellationStripRecursive(
+				node->left_child, strip, length, !reverse, clip,
+				apex_x, apex_y, left_x, left_y, center_x, center_y);
+			getTessellationStripRecursive(
+				node->right_child, strip, length, !reverse, clip,
+				right_x, right_y, apex_x, apex_y, center_x, center_y);
+		} else {
+			getTessellationStripRecursive(
+				node->right_child, strip, length, !reverse, clip,
+				right_x, right_y, apex_x, apex_y, center_x, center_y);
+			getTessellationStripRecursive(
+				node->left_child, strip, length, !reverse, clip,
+				apex_x, apex_y, left_x, left_y, center_x, center_y);
+		}
+	} else if (!clip || !isCulled(*clip, left_x, left_y, right_x, right_y, apex_x, apex_y)) {
+		// we're at leaf
+		const int tri[6] = {
+			left_x, left_y,
+			right_x, right_y,
+			apex_x, apex_y
+		};
+		stripAppendTriangle(strip, length, tri);
+	}
+}
@@ -3,20 +3,70 @@
 
 #include "heightmap.h"
 #include "binary_triangle_tree.h"
+#include "terrain_data.hpp"
 
+#include "math/mat4x4.hpp"
 #include "math/vec3.hpp"
 
+#include <atomic>
+#include <vector>
+
+// path code layout, see TerrainPatch::getTessellationCodes
+#define PATH_CODE_STEP_BITS 5
+#define PATH_CODE_PATH_BITS (32 - PATH_CODE_STEP_BITS)
+
+// deepest leaf level tracked by the statistics
+#define TESSELLATION_STATS_MAX_DEPTH 32
+
+/**
+ * Statistics of the latest tessellation.
+ *
+ * Counted only when ROAM_TESSELLATION_STATS is defined, otherwise zero.
+ */
+struct TessellationStats
+{
+	// splits requested by the error metric.
+	size_t splits;
+
+	// splits forced on base neighbors to keep the mesh continuous.
+	size_t forcedSplits;
+
+	// deepest chain of forced splits caused by a single split.
+	size_t maxForcedSplitDepth;
+
+	// nodes allocated from pool, and failed allocations.
+	size_t poolUsed;
+	size_t poolExhausted;
+
+	// refinements stopped because variance tree has no deeper levels.
+	size_t varianceCutoffs;
+
+	// refinements stopped because the node is hidden behind terrain.
+	size_t occludedNodes;
+
+	// number of leaves per tree depth.
+	size_t leafDepths[TESSELLATION_STATS_MAX_DEPTH];
+};
+
+/**
+ * Tessellation of a terrain for a single view.
+ *
+ * The terrain itself lives in a shared TerrainData, a patch only holds
+ * its node pool and the result. Patches sharing the data may tessellate
+ * concurrently from different threads, a single patch may not.
+ */
 class TerrainPatch
 {
 private:
+	TerrainData *m_data;
+
+	// heightmap of m_data, read-only.
 	Heightmap *m_map;
 
-	size_t m_worldX, m_worldY;
+	// data offered by other threads, switched to by swapData().
+	std::atomic<TerrainData *> m_pendingData;
 
-	// left and right 'variance' trees
-	float *m_leftVariance;
-	float *m_rightVariance;
-	size_t m_varianceSize;
+	size_t m_worldX, m_worldY;
 
 	// amount of error allowed
 	float m_varianceLimit; 
@@ -34,19 +84,69 @@ private:
 	size_t m_poolSize;
 	size_t m_poolNext;
 
+	TessellationStats m_stats;
+
+	// occlusion culling, see setOcclusionCulling(). Valid once computed
+	// for the latest tessellate().
+	bool m_occlusionCulling;
+	bool m_occlusionValid;
+
+	// level of the height bounds pyramid whose nodes are the occlusion
+	// blocks.
+	size_t m_occlusionLevel;
+
+	// height below which a block is hidden from all views, and the minimum
+	// of 2x2 nodes of the level below at the others.
+	float *m_occlusion;
+	size_t m_occlusionLevels;
+	size_t m_occlusionOffset[HEIGHT_BOUNDS_MAX_LEVELS];
+	size_t m_occlusionWidth[HEIGHT_BOUNDS_MAX_LEVELS];
+	size_t m_occlusionHeight[HEIGHT_BOUNDS_MAX_LEVELS];
+
+	// highest elevation slope per azimuth bin from the view.
+	float *m_horizon;
+
+	struct Occluder
+	{
+		float slope;
+		int firstBin, lastBin;
+
+		// next occluder of the same bucket, -1 at the end.
+		int next;
+	};
+
+	// scratch of computeHorizon().
+	std::vector<float> m_blockNear, m_blockFar;
+	std::vector<unsigned int> m_blockOrder;
+	std::vector<size_t> m_bucketStart;
+	std::vector<Occluder> m_occluders;
+	std::vector<int> m_occluderHead;
+
 public:
 	/**
 	 * Initialise terrain patch.
 	 *
+	 * Loads a private copy of the terrain, load a TerrainData instead to
+	 * share one between patches.
+	 *
 	 * @param filename to read the map from
 	 * @param x offset on world
 	 * @param y offset on world
 	 */
 	TerrainPatch(const char *fn, int offset_x = 0, int offset_y = 0);
+
+	/**
+	 * Initialise terrain patch for a shared terrain.
+	 *
+	 * @param data, a reference is retained until the patch is deleted
+	 * @param number of nodes in the pool
+	 */
+	TerrainPatch(TerrainData *data, size_t poolSize = 100000);
 	~TerrainPatch();
 
 	/**
-	 * Debug print the terrain patch data
+	 * Debug print the terrain patch data and statistics of the latest
+	 * tessellation.
 	 */
 	void print() const;
 
@@ -54,11 +154,34 @@ public:
 	 * Compute variance trees for the given patch.
 	 *
 	 * This is called once for patches, and after every modification on heightmap.
+	 * Same as TerrainData::computeVariance, so it affects all patches
+	 * sharing the data.
 	 *
 	 * @param tessellation max levels
 	 */
 	void computeVariance(int maxTessellationLevels = 14);
 
+	/**
+	 * Offer other data to switch to, e.g. a finer level of the same
+	 * terrain being loaded in the background. The patch keeps tessellating
+	 * the current data until swapData(), data offered before and not
+	 * swapped in yet is dropped. Thread-safe.
+	 *
+	 * Variance must already be computed.
+	 *
+	 * @param data, a reference is retained
+	 */
+	void offerData(TerrainData *data);
+
+	/**
+	 * Switch to the latest offered data, if any. Called between frames by
+	 * the thread tessellating, the tessellation is reset.
+	 *
+	 * @return true if the data changed, along with the heightmap and its
+	 *         size.
+	 */
+	bool swapData();
+
 	/**
 	 * Resets the tessellation for the next frame.
 	 */
@@ -72,6 +195,39 @@ public:
 	 */
 	void tessellate(const Vec3f &view, float errorMargin = 0.001);
 
+	/**
+	 * Tessellate the terrain patch for many views at once, e.g. split
+	 * screen or shadow cascades.
+	 *
+	 * The result satisfies the error margin for every view: a triangle is
+	 * split when any of the views would split it. Views are then drawn
+	 * from the same result, each culling with its own matrix at
+	 * extraction.
+	 *
+	 * @param viewer positions
+	 * @param number of views
+	 * @param allowed error margin
+	 */
+	void tessellate(const Vec3f *views, size_t viewCount, float errorMargin = 0.001);
+
+	/**
+	 * Skip terrain hidden behind other terrain.
+	 *
+	 * Every tessellate() first sweeps blocks of the heightmap front to
+	 * back from each view, keeping a horizon: the highest elevation angle
+	 * per azimuth of the terrain passed so far. Nodes whose height bounds
+	 * are below the horizon of every view are not refined, and their
+	 * leaves are dropped at extraction along with the ones outside the
+	 * view. The horizon only takes the lowest point of each block and is
+	 * lowered by the error the tessellation allows there, so visible
+	 * terrain is kept. Views are in patch space, including the height.
+	 *
+	 * Disabled by default.
+	 */
+	void setOcclusionCulling(bool enabled);
+
+	bool occlusionCulling() const;
+
 	/**
 	 * Get the tesselation result into vertices array
 	 *
@@ -79,18 +235,104 @@ public:
 	 * (left_num_leaves + right_num_leaves)*(number of elements per triangle)
 	 * as no bounds are tested
 	 *
+	 * Triangles are culled when the optional clip matrix is given, see
+	 * isOutside() and setOcclusionCulling().
+	 *
 	 * @param vertices
-	 * @param colors
-	 * @param normalTexels
+	 * @param normalTexels or NULL
+	 * @param clip matrix or NULL
+	 *
+	 * @return number of triangles written
+	 */
+	size_t getTessellation(float *vertices, float *normalTexels, const Mat4x4f *clip = NULL);
+
+	/**
+	 * Get the tessellation result as heightmap grid coordinates.
+	 *
+	 * Each triangle is written as three (x, y) pairs, so the given array
+	 * must hold at least (left_num_leaves + right_num_leaves)*6 elements.
+	 * Heights are expected to be fetched from the heightmap on the GPU.
+	 * Coordinates are 16-bit, so the map may be at most 65536 wide.
+	 *
+	 * @param gridCoords
+	 * @param clip matrix or NULL
+	 *
+	 * @return number of triangles written
+	 */
+	size_t getTessellationGrid(unsigned short *gridCoords, const Mat4x4f *clip = NULL);
+
+	/**
+	 * Get the tessellation result as generalized triangle strips of
+	 * heightmap grid coordinates.
+	 *
+	 * Leaves are visited in Sierpinski order, i.e. the order of children
+	 * alternates every level, so consecutive triangles share an edge and
+	 * usually a triangle adds a single vertex to the strip. When the
+	 * shared edge is not the last strip edge a vertex is repeated (swap),
+	 * and when no edge is shared the strip is restarted with degenerate
+	 * triangles.
+	 *
+	 * Left and right trees are written as two strips, one after another.
+	 * The given array must hold at least maxStripVertices()*2 elements.
+	 *
+	 * @param gridCoords
+	 * @param stripLengths number of vertices in left and right strips
+	 * @param clip matrix or NULL
+	 */
+	void getTessellationStrips(unsigned short *gridCoords, size_t stripLengths[2],
+	                           const Mat4x4f *clip = NULL);
+
+	/**
+	 * Get the tessellation result as a single path code per triangle.
+	 *
+	 * A code is the path from the root to the leaf: the number of steps
+	 * is stored in the highest PATH_CODE_STEP_BITS bits and the steps in
+	 * the rest, first step being the most significant. The first step
+	 * selects the left (0) or right (1) tree, the following ones the left
+	 * (0) or right (1) child. Corners are reconstructed on the GPU.
+	 *
+	 * The given array must hold at least left_num_leaves + right_num_leaves
+	 * elements.
+	 *
+	 * @param pathCodes
+	 * @param clip matrix or NULL
+	 *
+	 * @return number of triangles written
+	 */
+	size_t getTessellationCodes(unsigned int *pathCodes, const Mat4x4f *clip = NULL);
+
+	/**
+	 * Get the split nodes, i.e. all nodes that are not leaves, as path
+	 * codes in depth-first order.
+	 *
+	 * Together with the two roots they describe the whole tessellation:
+	 * the leaves are the children of split nodes that are not split
+	 * themselves. The given array must hold at least amountOfLeaves()
+	 * elements.
+	 *
+	 * @param pathCodes
+	 * @return number of codes written
 	 */
-	void getTessellation(float *vertices, float *colors, float *normalTexels);
+	size_t getSplitCodes(unsigned int *pathCodes);
 
 	size_t amountOfLeaves() const;
 
 	size_t poolSize() const;
 
+	/**
+	 * Statistics of the latest reset() + tessellate().
+	 */
+	const TessellationStats &stats() const;
+
+	/**
+	 * Upper bound of vertices written by getTessellationStrips.
+	 */
+	size_t maxStripVertices() const;
+
 	Heightmap *getHeightmap();
 
+	TerrainData *getData();
+
 private:
 	// PRIVATE FUNCTIONS
 
@@ -107,23 +349,86 @@ private:
 	 *  1. The Node is part of a Diamond - Split the node and its Base Neighbor.
 	 *  2. The Node is on the edge of the mesh - Trivial, only split the node.
 	 *  3. The Node is not part of a Diamond - Force Split the Base Neighbor.
+	 *
+	 * @param node to split
+	 * @param depth of forced splits leading to this split
+	 */
+	void split(BTTNode *node, size_t depth = 0);
+
+	/**
+	 * Count leaves of the given tree into the leaf depth histogram.
+	 *
+	 * @return number of leaves
+	 */
+	size_t countLeafDepths(BTTNode *node, size_t depth);
+
+	void init();
+
+	/**
+	 * Size the occlusion blocks for the heightmap.
+	 */
+	void layoutOcclusion();
+
+	/**
+	 * Test if the triangle is outside the view volume.
+	 *
+	 * Triangle is outside when all its corners are outside the same clip
+	 * plane. This is conservative, some triangles outside the view are kept.
+	 *
+	 * @param clip matrix from patch coordinates (x / width, y / height,
+	 *        height) into clip space.
 	 */
-	void split(BTTNode *node);
+	bool isOutside(const Mat4x4f &clip,
+	               int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y) const;
+
+	/**
+	 * Test if the triangle and everything below it is hidden from all the
+	 * views of the latest tessellation, see setOcclusionCulling().
+	 */
+	bool isOccluded(int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y) const;
+
+	/**
+	 * Test if a leaf is dropped at extraction.
+	 */
+	bool isCulled(const Mat4x4f &clip,
+	              int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y) const;
+
+	/**
+	 * Compute the occlusion blocks for the views.
+	 */
+	void computeOcclusion(const Vec3f *views, size_t viewCount, float errorMargin);
+
+	/**
+	 * Sweep the blocks front to back from the view, lowering the hidden
+	 * heights of level 0 of m_occlusion to what is hidden from it.
+	 */
+	void computeHorizon(const Vec3f &view, float errorMargin);
 
 	void tessellateRecursive(
-		BTTNode *node, const Vec3f &view, float errorMargin,
+		BTTNode *node, const Vec3f *views, size_t viewCount, float errorMargin,
 		int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
-		float *variance, int variance_idx);
-
-	void computeVarianceRecursive(
-		int maxTessellationLevels, int level, float *varianceTree, int idx, Heightmap *map,
-		int left_x,  int left_y,  float left_z,
-		int right_x, int right_y, float right_z,
-		int apex_x,  int apex_y,  float apex_z);
+		const float *variance, int variance_idx);
 
 	void getTessellationRecursive(
 		BTTNode *node, Heightmap *map,
-		float *vertices, float *colors, float *normalTexels, int *idx,
+		float *vertices, float *normalTexels, int *idx, const Mat4x4f *clip,
+		int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y);
+
+	void getTessellationGridRecursive(
+		BTTNode *node, unsigned short *gridCoords, int *idx, const Mat4x4f *clip,
+		int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y);
+
+	void getTessellationCodesRecursive(
+		BTTNode *node, unsigned int *pathCodes, int *idx, const Mat4x4f *clip,
+		unsigned int path, unsigned int steps,
+		int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y);
+
+	void getSplitCodesRecursive(
+		BTTNode *node, unsigned int *pathCodes, int *idx,
+		unsigned int path, unsigned int steps);
+
+	void getTessellationStripRecursive(
+		BTTNode *node, unsigned short *strip, size_t *length, bool reverse, const Mat4x4f *clip,
 		int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y);
 
 };
@@ -138,9 +443,30 @@ inline size_t TerrainPatch::poolSize() const
 	return m_poolSize;
 }
 
+inline const TessellationStats &TerrainPatch::stats() const
+{
+	return m_stats;
+}
+
+inline bool TerrainPatch::occlusionCulling() const
+{
+	return m_occlusionCulling;
+}
+
+inline size_t TerrainPatch::maxStripVertices() const
+{
+	// first triangle takes 3 vertices, restart takes 5 at most.
+	return m_poolSize*5;
+}
+
 inline Heightmap *TerrainPatch::getHeightmap()
 {
 	return m_map;
 }
 
+inline TerrainData *TerrainPatch::getData()
+{
+	return m_data;
+}
+
 #endif // TERRAIN_PATCH_H
@@ -0,0 +1,215 @@
+#include "terrain_tile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// sections start on their own cache lines.
+#define TERRAIN_TILE_ALIGN 64
+
+struct TerrainTile
+{
+	const unsigned char *base;
+	size_t size;
+
+	const TerrainTileHeader *header;
+};
+
+static uint64_t align_up(uint64_t size)
+{
+	return (size + TERRAIN_TILE_ALIGN - 1) & ~(uint64_t) (TERRAIN_TILE_ALIGN - 1);
+}
+
+size_t TerrainTile_level_size(const TerrainTileHeader *header, size_t level)
+{
+	return ((header->size - 1) >> level) + 1;
+}
+
+static uint64_t pyramid_floats(const TerrainTileHeader *header)
+{
+	uint64_t floats = 0;
+	size_t level;
+
+	for (level = 1; level < header->pyramid_levels; ++level) {
+		size_t size = TerrainTile_level_size(header, level);
+		floats += size*size;
+	}
+
+	return floats;
+}
+
+/**
+ * @return non-zero if the sections follow each other without overlapping.
+ */
+static int sections_valid(const TerrainTileHeader *header)
+{
+	const uint64_t points = (uint64_t) header->size*header->size;
+
+	return header->heights >= sizeof(TerrainTileHeader) &&
+	       header->normals >= header->heights + sizeof(float)*points &&
+	       header->left_variance >= header->normals + sizeof(float)*3*points &&
+	       header->right_variance >= header->left_variance + sizeof(float)*header->variance_size &&
+	       header->bounds >= header->right_variance + sizeof(float)*header->variance_size &&
+	       header->pyramid >= header->bounds + sizeof(float)*header->bounds_size &&
+	       header->file_size == header->pyramid + sizeof(float)*pyramid_floats(header);
+}
+
+static int write_section(FILE *fd, const void *data, uint64_t offset, uint64_t bytes)
+{
+	static const unsigned char zeros[TERRAIN_TILE_ALIGN] = {0};
+	long position = ftell(fd);
+
+	// pad up to the section.
+	if (position < 0 || (uint64_t) position > offset ||
+	    fwrite(zeros, 1, offset - position, fd) != offset - position) {
+		return -1;
+	}
+
+	return fwrite(data, 1, bytes, fd) == bytes ? 0 : -1;
+}
+
+int TerrainTile_write(const char *filename, TerrainTileHeader *header,
+                      const float *heights, const float *normals,
+                      const float *leftVariance, const float *rightVariance,
+                      const float *bounds, const float *pyramid)
+{
+	const uint64_t points = (uint64_t) header->size*header->size;
+
+	header->magic = TERRAIN_TILE_MAGIC;
+	header->version = TERRAIN_TILE_VERSION;
+	header->heights = align_up(sizeof(TerrainTileHeader));
+	header->normals = align_up(header->heights + sizeof(float)*points);
+	header->left_variance = align_up(header->normals + sizeof(float)*3*points);
+	header->right_variance = align_up(header->left_variance + sizeof(float)*header->variance_size);
+	header->bounds = align_up(header->right_variance + sizeof(float)*header->variance_size);
+	header->pyramid = align_up(header->bounds + sizeof(float)*header->bounds_size);
+	header->file_size = header->pyramid + sizeof(float)*pyramid_floats(header);
+
+	size_t length = strlen(filename);
+	char *partial = malloc(length + sizeof(".part"));
+	memcpy(partial, filename, length);
+	memcpy(partial + length, ".part", sizeof(".part"));
+
+	FILE *fd = fopen(partial, "wb");
+	if (!fd) {
+		printf("Unable to create file %s : %s\n", partial, strerror(errno));
+		free(partial);
+		return -1;
+	}
+
+	int result = 0;
+	result |= write_section(fd, header, 0, sizeof(TerrainTileHeader));
+	result |= write_section(fd, heights, header->heights, sizeof(float)*points);
+	result |= write_section(fd, normals, header->normals, sizeof(float)*3*points);
+	result |= write_section(fd, leftVariance, header->left_variance,
+	                        sizeof(float)*header->variance_size);
+	result |= write_section(fd, rightVariance, header->right_variance,
+	                        sizeof(float)*header->variance_size);
+	result |= write_section(fd, bounds, header->bounds, sizeof(float)*header->bounds_size);
+	result |= write_section(fd, pyramid, header->pyramid, header->file_size - header->pyramid);
+
+	if (fclose(fd) != 0 || result != 0 || rename(partial, filename) != 0) {
+		printf("Unable to write tile %s : %s\n", filename, strerror(errno));
+		unlink(partial);
+		free(partial);
+		return -1;
+	}
+
+	free(partial);
+
+	return 0;
+}
+
+int TerrainTile_is_tile(const char *filename)
+{
+	uint32_t magic = 0;
+	FILE *fd = fopen(filename, "rb");
+	if (!fd)
+		return 0;
+
+	size_t read = fread(&magic, sizeof(magic), 1, fd);
+	fclose(fd);
+
+	return read == 1 && magic == TERRAIN_TILE_MAGIC;
+}
+
+TerrainTile *TerrainTile_open(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Unable to open file %s : %s\n", filename, strerror(errno));
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(TerrainTileHeader)) {
+		printf("Tile %s is too small\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		printf("Unable to map file %s : %s\n", filename, strerror(errno));
+		return NULL;
+	}
+
+	const TerrainTileHeader *header = (const TerrainTileHeader *) base;
+	if (header->magic != TERRAIN_TILE_MAGIC ||
+	    header->version != TERRAIN_TILE_VERSION ||
+	    header->size < 3 || ((header->size - 1) & (header->size - 2)) != 0 ||
+	    header->pyramid_levels == 0 ||
+	    TerrainTile_level_size(header, header->pyramid_levels - 1) < 2 ||
+	    header->file_size != (uint64_t) st.st_size ||
+	    !sections_valid(header)) {
+		printf("%s is not a valid tile\n", filename);
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	TerrainTile *tile = malloc(sizeof(TerrainTile));
+	tile->base = (const unsigned char *) base;
+	tile->size = st.st_size;
+	tile->header = header;
+
+	return tile;
+}
+
+void TerrainTile_close(TerrainTile *tile)
+{
+	munmap((void *) tile->base, tile->size);
+	free(tile);
+}
+
+const TerrainTileHeader *TerrainTile_header(const TerrainTile *tile)
+{
+	return tile->header;
+}
+
+const float *TerrainTile_section(const TerrainTile *tile, uint64_t offset)
+{
+	return (const float *) (tile->base + offset);
+}
+
+const float *TerrainTile_level(const TerrainTile *tile, size_t level)
+{
+	const TerrainTileHeader *header = tile->header;
+	const float *heights = TerrainTile_section(tile, header->pyramid);
+	size_t i;
+
+	if (level == 0)
+		return TerrainTile_section(tile, header->heights);
+
+	for (i = 1; i < level; ++i) {
+		size_t size = TerrainTile_level_size(header, i);
+		heights += size*size;
+	}
+
+	return heights;
+}
@@ -0,0 +1,127 @@
+#ifndef TERRAIN_TILE_H
+#define TERRAIN_TILE_H
+
+#include "heightmap.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TERRAIN_TILE_MAGIC   0x454c5452 // "RTLE"
+#define TERRAIN_TILE_VERSION 1
+
+/**
+ * Baked tile file, written by roam-bake (tools/bake.cpp) and loaded by
+ * TerrainData::load() instead of a text heightmap.
+ *
+ * A tile is size x size grid points, size being 2^n + 1, and shares its
+ * last row and column with the next tile. The header is followed by float
+ * sections at the given byte offsets, each 64 byte aligned:
+ *
+ *  heights:        size x size normalized heights, like Heightmap.map
+ *  normals:        3 floats per height, like Heightmap.normal_map
+ *  left_variance:  variance_size floats, see TerrainData::computeVariance()
+ *  right_variance: variance_size floats
+ *  bounds:         bounds_size floats, the min/max height bounds pyramid
+ *  pyramid:        heights of every other grid point of the level below,
+ *                  for levels 1 to pyramid_levels - 1 one after the other,
+ *                  see TerrainTile_level_size()
+ */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+
+	uint32_t size;
+
+	// position in the grid of tiles baked from one raster.
+	uint32_t tile_x, tile_y;
+	uint32_t tiles_x, tiles_y;
+
+	uint32_t variance_levels;
+	uint32_t pyramid_levels;
+	uint32_t padding;
+
+	uint64_t variance_size;
+	uint64_t bounds_size;
+
+	// range of the normalized heights of the tile, and of the raster
+	// before normalizing.
+	float min_z, max_z;
+	float source_min_z, source_max_z;
+
+	uint64_t histogram[HEIGHTMAP_HISTOGRAM_BINS];
+
+	// byte offsets of the sections, and of the end of the file.
+	uint64_t heights;
+	uint64_t normals;
+	uint64_t left_variance;
+	uint64_t right_variance;
+	uint64_t bounds;
+	uint64_t pyramid;
+	uint64_t file_size;
+} TerrainTileHeader;
+
+typedef struct TerrainTile TerrainTile;
+
+/**
+ * Grid points per side of a pyramid level, level 0 being the tile itself.
+ */
+size_t TerrainTile_level_size(const TerrainTileHeader *header, size_t level);
+
+/**
+ * Fill in the section offsets and write the tile. The file is written
+ * next to filename and renamed over it once complete, so readers never
+ * see a partial tile.
+ *
+ * @param filename
+ * @param header everything but magic, version and the offsets filled in
+ * @param heights
+ * @param normals
+ * @param leftVariance
+ * @param rightVariance
+ * @param bounds
+ * @param pyramid levels 1 and up, one after the other
+ * @return 0 on success, -1 on failure.
+ */
+int TerrainTile_write(const char *filename, TerrainTileHeader *header,
+                      const float *heights, const float *normals,
+                      const float *leftVariance, const float *rightVariance,
+                      const float *bounds, const float *pyramid);
+
+/**
+ * @return non-zero if the file starts like a tile, without complaining
+ *         when it doesn't.
+ */
+int TerrainTile_is_tile(const char *filename);
+
+/**
+ * Map a tile for reading and check its header.
+ *
+ * @param filename
+ * @return tile, NULL on failure.
+ */
+TerrainTile *TerrainTile_open(const char *filename);
+
+void TerrainTile_close(TerrainTile *tile);
+
+const TerrainTileHeader *TerrainTile_header(const TerrainTile *tile);
+
+/**
+ * Section of the mapped tile, e.g. TerrainTile_section(tile, header->normals).
+ */
+const float *TerrainTile_section(const TerrainTile *tile, uint64_t offset);
+
+/**
+ * Heights of a pyramid level, TerrainTile_level_size() squared.
+ */
+const float *TerrainTile_level(const TerrainTile *tile, size_t level);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // TERRAIN_TILE_H
@@ -0,0 +1,192 @@
+#include "tessellation_stream.hpp"
+#include "terrain_patch.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <math.h>
+
+// steps of a code are stored in PATH_CODE_STEP_BITS bits.
+#define MAX_STEPS ((1u << PATH_CODE_STEP_BITS) - 1)
+
+/**
+ * Read values written as differences to the previous one.
+ *
+ * @return 0 on success, -1 on malformed data.
+ */
+static int get_sorted(const unsigned char *data, size_t size, size_t *pos,
+                      std::vector<unsigned int> &values)
+{
+	uint64_t count;
+	if (stream_get_varint(data, size, pos, &count) != 0)
+		return -1;
+
+	// every value takes at least a byte.
+	if (count > size - *pos)
+		return -1;
+
+	values.clear();
+
+	uint64_t value = 0;
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t delta;
+		if (stream_get_varint(data, size, pos, &delta) != 0)
+			return -1;
+
+		value += delta;
+		if (value > 0xffffffffu)
+			return -1;
+
+		values.push_back((unsigned int) value);
+	}
+
+	return 0;
+}
+
+static bool is_valid_code(unsigned int code)
+{
+	unsigned int steps = code >> PATH_CODE_PATH_BITS;
+	unsigned int path = code & ((1u << PATH_CODE_PATH_BITS) - 1);
+
+	return steps >= 1 && (path >> steps) == 0;
+}
+
+TessellationDecoder::TessellationDecoder()
+	: m_width(0)
+	, m_height(0)
+	, m_frame(0)
+{
+}
+
+int TessellationDecoder::decode(const unsigned char *data, size_t size)
+{
+	if (size < 1)
+		return -1;
+
+	switch (data[0]) {
+	case TESSELLATION_STREAM_HEADER:
+		return decodeHeader(data, size, 1);
+	case TESSELLATION_STREAM_FRAME:
+		return decodeFrame(data, size, 1);
+	default:
+		return -1;
+	}
+}
+
+int TessellationDecoder::decodeHeader(const unsigned char *data, size_t size, size_t pos)
+{
+	uint64_t width, height;
+	if (stream_get_varint(data, size, &pos, &width) != 0 ||
+	    stream_get_varint(data, size, &pos, &height) != 0) {
+		return -1;
+	}
+
+	// grid coordinates are 16-bit elsewhere too.
+	if (width < 2 || height < 2 || width > 65536 || height > 65536)
+		return -1;
+
+	m_width = width;
+	m_height = height;
+
+	// a header starts the stream over.
+	m_splits.clear();
+	m_vertices.clear();
+	m_heights.assign(m_width*m_height, NAN);
+
+	return 0;
+}
+
+int TessellationDecoder::decodeFrame(const unsigned char *data, size_t size, size_t pos)
+{
+	if (m_width == 0)
+		return -1;
+
+	uint64_t frame;
+	if (stream_get_varint(data, size, &pos, &frame) != 0)
+		return -1;
+
+	std::vector<unsigned int> merges, splits;
+	if (get_sorted(data, size, &pos, merges) != 0 ||
+	    get_sorted(data, size, &pos, splits) != 0) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < splits.size(); ++i) {
+		if (!is_valid_code(splits[i]))
+			return -1;
+	}
+
+	std::vector<unsigned int> vertices;
+	if (get_sorted(data, size, &pos, vertices) != 0)
+		return -1;
+
+	for (size_t i = 0; i < vertices.size(); ++i) {
+		if (vertices[i] >= m_heights.size())
+			return -1;
+
+		if (stream_get_float(data, size, &pos, &m_heights[vertices[i]]) != 0)
+			return -1;
+	}
+
+	// (previous - merges) + splits, all sorted.
+	m_scratch.clear();
+	std::set_difference(m_splits.begin(), m_splits.end(),
+	                    merges.begin(), merges.end(),
+	                    std::back_inserter(m_scratch));
+	m_splits.clear();
+	std::set_union(m_scratch.begin(), m_scratch.end(),
+	               splits.begin(), splits.end(),
+	               std::back_inserter(m_splits));
+
+	m_frame = frame;
+
+	// same roots as TerrainPatch.
+	m_vertices.clear();
+	rebuildRecursive(
+		0, 1,
+		0,         m_height-1,
+		m_width-1, 0,
+		0,         0);
+	rebuildRecursive(
+		1, 1,
+		m_width-1, 0,
+		0,         m_height-1,
+		m_width-1, m_height-1);
+
+	return 0;
+}
+
+void TessellationDecoder::rebuildRecursive(
+	unsigned int path, unsigned int steps,
+	int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y)
+{
+	unsigned int code = (steps << PATH_CODE_PATH_BITS) | path;
+
+	if (steps < MAX_STEPS && std::binary_search(m_splits.begin(), m_splits.end(), code)) {
+		int center_x = (left_x + right_x) / 2;
+		int center_y = (left_y + right_y) / 2;
+
+		rebuildRecursive(
+			(path<<1), steps+1,
+			apex_x, apex_y, left_x, left_y, center_x, center_y);
+		rebuildRecursive(
+			(path<<1)+1, steps+1,
+			right_x, right_y, apex_x, apex_y, center_x, center_y);
+	} else {
+		const int corners[6] = { left_x, left_y, right_x, right_y, apex_x, apex_y };
+
+		for (int i = 0; i < 3; ++i) {
+			int x = corners[i*2], y = corners[i*2+1];
+			m_vertices.push_back((float) x / m_width);
+			m_vertices.push_back((float) y / m_height);
+			m_vertices.push_back(getHeight(x, y));
+		}
+	}
+}
+
+float TessellationDecoder::getHeight(int x, int y) const
+{
+	float height = m_heights[y*m_width + x];
+
+	// never sent, only with a broken stream.
+	return isnan(height) ? 0 : height;
+}
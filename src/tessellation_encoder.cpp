@@ -0,0 +1,100 @@
+#include "tessellation_stream.hpp"
+#include "terrain_patch.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+/**
+ * Write sorted values as differences to the previous one.
+ */
+static void put_sorted(std::vector<unsigned char> &out, const std::vector<unsigned int> &values)
+{
+	stream_put_varint(out, values.size());
+
+	unsigned int previous = 0;
+	for (size_t i = 0; i < values.size(); ++i) {
+		stream_put_varint(out, values[i] - previous);
+		previous = values[i];
+	}
+}
+
+TessellationEncoder::TessellationEncoder(TerrainPatch *patch)
+	: m_patch(patch)
+	, m_codes(patch->poolSize())
+	, m_grid(patch->poolSize()*6)
+{
+	Heightmap *map = patch->getHeightmap();
+	m_sentVertices.resize(map->width*map->height);
+}
+
+void TessellationEncoder::reset()
+{
+	Heightmap *map = m_patch->getHeightmap();
+
+	m_previous.clear();
+	m_sentVertices.assign(map->width*map->height, false);
+}
+
+void TessellationEncoder::encodeHeader(std::vector<unsigned char> &out)
+{
+	Heightmap *map = m_patch->getHeightmap();
+
+	out.clear();
+	out.push_back(TESSELLATION_STREAM_HEADER);
+	stream_put_varint(out, map->width);
+	stream_put_varint(out, map->height);
+}
+
+void TessellationEncoder::encodeFrame(uint64_t frame, std::vector<unsigned char> &out)
+{
+	TRACE_SCOPE("TessellationEncoder::encodeFrame");
+
+	Heightmap *map = m_patch->getHeightmap();
+
+	size_t count = m_patch->getSplitCodes(&m_codes[0]);
+	m_current.assign(m_codes.begin(), m_codes.begin() + count);
+	std::sort(m_current.begin(), m_current.end());
+
+	out.clear();
+	out.push_back(TESSELLATION_STREAM_FRAME);
+	stream_put_varint(out, frame);
+
+	// nodes no longer split are merges, new ones are splits.
+	m_codes.clear();
+	std::set_difference(m_previous.begin(), m_previous.end(),
+	                    m_current.begin(), m_current.end(),
+	                    std::back_inserter(m_codes));
+	put_sorted(out, m_codes);
+
+	m_codes.clear();
+	std::set_difference(m_current.begin(), m_current.end(),
+	                    m_previous.begin(), m_previous.end(),
+	                    std::back_inserter(m_codes));
+	put_sorted(out, m_codes);
+
+	// scratch is sized for the pool again for the next frame.
+	m_codes.resize(m_patch->poolSize());
+
+	// heights the receiver doesn't have yet.
+	size_t triangles = m_patch->getTessellationGrid(&m_grid[0]);
+
+	m_vertices.clear();
+	for (size_t i = 0; i < triangles*3; ++i) {
+		unsigned int index = m_grid[i*2+1]*map->width + m_grid[i*2];
+		if (!m_sentVertices[index]) {
+			m_sentVertices[index] = true;
+			m_vertices.push_back(index);
+		}
+	}
+	std::sort(m_vertices.begin(), m_vertices.end());
+
+	put_sorted(out, m_vertices);
+	// heights follow all indices, so the index deltas stay together.
+	for (size_t i = 0; i < m_vertices.size(); ++i) {
+		unsigned int index = m_vertices[i];
+		stream_put_float(out, Heightmap_get(map, index % map->width, index / map->width));
+	}
+
+	m_previous.swap(m_current);
+}
@@ -0,0 +1,228 @@
+#ifndef TESSELLATION_STREAM_HPP
+#define TESSELLATION_STREAM_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+class TerrainPatch;
+
+/*
+ * Tessellation stream
+ *
+ * Frames are sent as changes to the previous frame's binary triangle tree.
+ * The tree is described by its split nodes as path codes (see
+ * TerrainPatch::getSplitCodes()), so a frame lists the nodes merged back
+ * into leaves and the nodes split since the previous frame. Heights of grid
+ * vertices are sent only the first time a leaf uses them.
+ *
+ * Every message starts with a type byte:
+ *
+ *   'H' header:  varint width, varint height
+ *   'F' frame:   varint frame number
+ *                varint merge count, merged codes
+ *                varint split count, split codes
+ *                varint vertex count, vertex indices (y*width + x),
+ *                float height per vertex (little-endian)
+ *
+ * Codes and vertex indices are sorted and written as varint differences to
+ * the previous one, first one as is.
+ */
+
+#define TESSELLATION_STREAM_HEADER 'H'
+#define TESSELLATION_STREAM_FRAME  'F'
+
+/**
+ * Append value as a LEB128 varint.
+ */
+inline void stream_put_varint(std::vector<unsigned char> &out, uint64_t value)
+{
+	while (value >= 0x80) {
+		out.push_back((unsigned char) (value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((unsigned char) value);
+}
+
+/**
+ * Read a varint at *pos, advancing it.
+ *
+ * @return 0 on success, -1 if the data ends or the varint is too long.
+ */
+inline int stream_get_varint(const unsigned char *data, size_t size, size_t *pos, uint64_t *value)
+{
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*pos >= size)
+			return -1;
+
+		unsigned char byte = data[(*pos)++];
+		*value |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Append a float as little-endian IEEE 754.
+ */
+inline void stream_put_float(std::vector<unsigned char> &out, float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	for (int i = 0; i < 4; ++i) {
+		out.push_back((unsigned char) (bits >> (i*8)));
+	}
+}
+
+/**
+ * Read a float at *pos, advancing it.
+ *
+ * @return 0 on success, -1 if the data ends.
+ */
+inline int stream_get_float(const unsigned char *data, size_t size, size_t *pos, float *value)
+{
+	if (*pos > size || size - *pos < 4)
+		return -1;
+
+	uint32_t bits = 0;
+	for (int i = 0; i < 4; ++i) {
+		bits |= (uint32_t) data[(*pos)++] << (i*8);
+	}
+	memcpy(value, &bits, sizeof(bits));
+
+	return 0;
+}
+
+/**
+ * Encodes the tessellation of a patch into stream messages.
+ *
+ * Keeps the tree and the vertices the receiving side has, so one encoder
+ * serves a single receiver.
+ */
+class TessellationEncoder
+{
+private:
+	TerrainPatch *m_patch;
+
+	// sorted split codes of the previous frame, and the current one.
+	std::vector<unsigned int> m_previous;
+	std::vector<unsigned int> m_current;
+
+	// grid vertices whose height the receiver has.
+	std::vector<bool> m_sentVertices;
+
+	// scratch for extraction
+	std::vector<unsigned int> m_codes;
+	std::vector<unsigned short> m_grid;
+	std::vector<unsigned int> m_vertices;
+
+public:
+	TessellationEncoder(TerrainPatch *patch);
+
+	/**
+	 * Forget what the receiver has, e.g. for a new receiver or after the
+	 * patch switched data, see TerrainPatch::swapData(). The next frame is
+	 * encoded against an empty tree.
+	 */
+	void reset();
+
+	/**
+	 * Encode the header message, must be sent before the first frame.
+	 */
+	void encodeHeader(std::vector<unsigned char> &out);
+
+	/**
+	 * Encode the current tessellation of the patch as a frame message.
+	 *
+	 * @param frame number, passed to the receiver
+	 * @param out message, replaced
+	 */
+	void encodeFrame(uint64_t frame, std::vector<unsigned char> &out);
+};
+
+/**
+ * Rebuilds the tessellation from stream messages.
+ */
+class TessellationDecoder
+{
+private:
+	size_t m_width, m_height;
+
+	// sorted split codes of the latest frame.
+	std::vector<unsigned int> m_splits;
+	std::vector<unsigned int> m_scratch;
+
+	// known heights, NaN for vertices not received yet.
+	std::vector<float> m_heights;
+
+	// leaves of the latest frame, 9 floats per triangle.
+	std::vector<float> m_vertices;
+	uint64_t m_frame;
+
+public:
+	TessellationDecoder();
+
+	/**
+	 * Apply a message.
+	 *
+	 * @param data
+	 * @param size
+	 * @return 0 on success, -1 on a malformed message.
+	 */
+	int decode(const unsigned char *data, size_t size);
+
+	/**
+	 * Triangles of the latest frame in the same format and order as
+	 * TerrainPatch::getTessellation(): (x/width, y/height, height) per
+	 * corner, 9 floats per triangle.
+	 */
+	const std::vector<float> &getVertices() const;
+
+	size_t getTriangleCount() const;
+
+	uint64_t getFrame() const;
+
+	size_t getWidth() const;
+	size_t getHeight() const;
+
+private:
+	int decodeHeader(const unsigned char *data, size_t size, size_t pos);
+	int decodeFrame(const unsigned char *data, size_t size, size_t pos);
+
+	void rebuildRecursive(
+		unsigned int path, unsigned int steps,
+		int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y);
+
+	float getHeight(int x, int y) const;
+};
+
+inline const std::vector<float> &TessellationDecoder::getVertices() const
+{
+	return m_vertices;
+}
+
+inline size_t TessellationDecoder::getTriangleCount() const
+{
+	return m_vertices.size()/9;
+}
+
+inline uint64_t TessellationDecoder::getFrame() const
+{
+	return m_frame;
+}
+
+inline size_t TessellationDecoder::getWidth() const
+{
+	return m_width;
+}
+
+inline size_t TessellationDecoder::getHeight() const
+{
+	return m_height;
+}
+
+#endif // TESSELLATION_STREAM_HPP
@@ -0,0 +1,174 @@
+#include "trace.hpp"
+
+#ifdef ROAM_TRACING
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <vector>
+
+namespace {
+
+// fields are atomic as write() reads them while the thread records,
+// relaxed accesses are plain loads and stores.
+struct TraceEvent
+{
+	std::atomic<const char *> name;
+	std::atomic<int64_t> start;
+	std::atomic<int64_t> duration;
+};
+
+/**
+ * Ring of the newest events of a thread. Event i is in events[i %
+ * BUFFER_EVENTS], recorded counts the events finished and recording the
+ * ones started, like the sequence counter of a seqlock.
+ */
+struct TraceBuffer
+{
+	TraceEvent events[Trace::BUFFER_EVENTS];
+	std::atomic<uint64_t> recorded;
+	std::atomic<uint64_t> recording;
+	std::atomic<const char *> threadName;
+	int tid;
+
+	// events before this are written already, only used by write().
+	uint64_t written;
+};
+
+// copy of an event taken by write().
+struct Event
+{
+	const char *name;
+	int64_t start;
+	int64_t duration;
+};
+
+// buffers are never freed, threads may record until the very end.
+std::mutex registryMutex;
+std::vector<TraceBuffer *> registry;
+
+thread_local TraceBuffer *threadBuffer = NULL;
+
+const int64_t epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::steady_clock::now().time_since_epoch()).count();
+
+TraceBuffer *getThreadBuffer()
+{
+	if (threadBuffer == NULL) {
+		TraceBuffer *buffer = new TraceBuffer;
+		buffer->recorded = 0;
+		buffer->recording = 0;
+		buffer->threadName = NULL;
+		buffer->written = 0;
+
+		std::lock_guard<std::mutex> lock(registryMutex);
+		buffer->tid = registry.size() + 1;
+		registry.push_back(buffer);
+		threadBuffer = buffer;
+	}
+
+	return threadBuffer;
+}
+
+} // namespace
+
+int64_t Trace::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count() - epoch;
+}
+
+void Trace::complete(const char *name, int64_t start)
+{
+	int64_t end = now();
+	TraceBuffer *buffer = getThreadBuffer();
+
+	// only this thread records into the buffer.
+	uint64_t idx = buffer->recorded.load(std::memory_order_relaxed);
+	buffer->recording.store(idx + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	TraceEvent &e = buffer->events[idx % BUFFER_EVENTS];
+	e.name.store(name, std::memory_order_relaxed);
+	e.start.store(start, std::memory_order_relaxed);
+	e.duration.store(end - start, std::memory_order_relaxed);
+	buffer->recorded.store(idx + 1, std::memory_order_release);
+}
+
+void Trace::setThreadName(const char *name)
+{
+	getThreadBuffer()->threadName.store(name, std::memory_order_release);
+}
+
+int Trace::write(const char *filename)
+{
+	FILE *fd = fopen(filename, "w");
+	if (!fd) {
+		printf("Unable to open file %s for writing\n", filename);
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(registryMutex);
+
+	fprintf(fd, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	bool first = true;
+	size_t total = 0, dropped = 0;
+
+	std::vector<Event> events;
+
+	for (size_t b = 0; b < registry.size(); ++b) {
+		TraceBuffer *buffer = registry[b];
+
+		// copy what is recorded, then drop what the thread has started
+		// overwriting meanwhile.
+		uint64_t end = buffer->recorded.load(std::memory_order_acquire);
+		uint64_t begin = std::max(buffer->written, end - std::min<uint64_t>(end, BUFFER_EVENTS));
+
+		events.resize(end - begin);
+		for (uint64_t i = begin; i < end; ++i) {
+			const TraceEvent &e = buffer->events[i % BUFFER_EVENTS];
+			events[i - begin].name = e.name.load(std::memory_order_relaxed);
+			events[i - begin].start = e.start.load(std::memory_order_relaxed);
+			events[i - begin].duration = e.duration.load(std::memory_order_relaxed);
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t recording = buffer->recording.load(std::memory_order_relaxed);
+		uint64_t valid = std::max(begin, recording - std::min<uint64_t>(recording, BUFFER_EVENTS));
+
+		const char *threadName = buffer->threadName.load(std::memory_order_acquire);
+		if (threadName) {
+			fprintf(fd, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\","
+			        "\"args\":{\"name\":\"%s\"}}",
+			        first ? "" : ",\n", buffer->tid, threadName);
+			first = false;
+		}
+
+		// chrome expects microseconds.
+		for (uint64_t i = std::min(valid, end); i < end; ++i) {
+			const Event &e = events[i - begin];
+			fprintf(fd, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"name\":\"%s\","
+			        "\"ts\":%.3f,\"dur\":%.3f}",
+			        first ? "" : ",\n", buffer->tid, e.name,
+			        e.start / 1000.0, e.duration / 1000.0);
+			first = false;
+		}
+
+		total += end - std::min(valid, end);
+		dropped += std::min(valid, end) - buffer->written;
+
+		buffer->written = end;
+	}
+
+	fprintf(fd, "\n]}\n");
+	fclose(fd);
+
+	printf("wrote %zu trace events (%zu dropped) into %s\n", total, dropped, filename);
+
+	return 0;
+}
+
+#endif // ROAM_TRACING
@@ -0,0 +1,109 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+/**
+ * Scoped trace markers written as Chrome/Perfetto trace-event JSON.
+ *
+ * Tracing is compiled in only when ROAM_TRACING is defined (cmake
+ * -DROAM_TRACING=ON), otherwise the macros expand to nothing.
+ *
+ * Each thread records into its own fixed size ring buffer, so recording
+ * takes no locks. When the buffer is full the oldest events are
+ * overwritten, the newest are kept.
+ *
+ * TRACE_SCOPE_FINE is meant for hot functions called thousands of times per
+ * frame, it's recorded only when ROAM_TRACING_FINE is also defined.
+ *
+ *   void foo()
+ *   {
+ *       TRACE_SCOPE("foo");
+ *       ...
+ *   }
+ *
+ *   TRACE_WRITE("trace.json");
+ */
+
+#ifdef ROAM_TRACING
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// name must be a string literal, or otherwise outlive the trace.
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) Trace::setThreadName(name)
+#define TRACE_WRITE(filename) Trace::write(filename)
+
+#ifdef ROAM_TRACING_FINE
+#define TRACE_SCOPE_FINE(name) TRACE_SCOPE(name)
+#else
+#define TRACE_SCOPE_FINE(name) do {} while (0)
+#endif
+
+class Trace
+{
+public:
+	// maximum number of events kept per thread.
+	static const size_t BUFFER_EVENTS = 1 << 16;
+
+	/**
+	 * @return current time in nanoseconds.
+	 */
+	static int64_t now();
+
+	/**
+	 * Record a complete event that started at the given time and ends now.
+	 *
+	 * @param name of the event
+	 * @param start time from now()
+	 */
+	static void complete(const char *name, int64_t start);
+
+	/**
+	 * Name the calling thread's track in the trace.
+	 */
+	static void setThreadName(const char *name);
+
+	/**
+	 * Write the events of all threads recorded since the previous write
+	 * into the given file.
+	 *
+	 * Other threads may keep recording meanwhile, events they overwrite
+	 * before they are written are counted as dropped.
+	 *
+	 * @return 0 on success, != 0 on failure.
+	 */
+	static int write(const char *filename);
+};
+
+class TraceScope
+{
+private:
+	const char *m_name;
+	int64_t m_start;
+
+public:
+	TraceScope(const char *name)
+		: m_name(name)
+		, m_start(Trace::now())
+	{
+	}
+
+	~TraceScope()
+	{
+		Trace::complete(m_name, m_start);
+	}
+};
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_SCOPE_FINE(name) do {} while (0)
+#define TRACE_THREAD_NAME(name) do {} while (0)
+#define TRACE_WRITE(filename) do {} while (0)
+
+#endif // ROAM_TRACING
+
+#endif // TRACE_HPP
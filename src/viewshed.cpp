@@ -0,0 +1,256 @@
+#include "viewshed.hpp"
+#include "task_scheduler.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define OCTANT_MIRROR_X 1
+#define OCTANT_MIRROR_Y 2
+#define OCTANT_ROWS 4
+#define OCTANT_COUNT 8
+
+// rings swept across rows are first copied out this many at a time, so
+// each row of the heightmap is touched once per block instead of per ring.
+#define RING_BLOCK 16
+
+Viewshed::Viewshed(size_t width, size_t height)
+	: m_width(width)
+	, m_height(height)
+	, m_stride((width + 63) / 64)
+{
+	m_bits = new uint64_t[m_stride*m_height];
+	clear();
+}
+
+Viewshed::~Viewshed()
+{
+	delete[] m_bits;
+}
+
+void Viewshed::clear()
+{
+	memset(m_bits, 0, m_stride*m_height*sizeof(uint64_t));
+}
+
+size_t Viewshed::countVisible() const
+{
+	size_t count = 0;
+	for (size_t i = 0; i < m_stride*m_height; ++i) {
+		count += __builtin_popcountll(m_bits[i]);
+	}
+	return count;
+}
+
+void Viewshed::setVisible(size_t x, size_t y)
+{
+	m_bits[y*m_stride + x/64] |= (uint64_t) 1 << (x%64);
+}
+
+/**
+ * Or bits into a word shared with the other octants.
+ */
+static inline void or_word(uint64_t *word, uint64_t bits)
+{
+	if (bits) {
+		__atomic_fetch_or(word, bits, __ATOMIC_RELAXED);
+	}
+}
+
+int Viewshed::compute(const Heightmap *map, const ViewshedObserver &observer)
+{
+	Viewshed *viewshed = this;
+	return compute(map, &observer, &viewshed, 1);
+}
+
+int Viewshed::compute(const Heightmap *map, const ViewshedObserver *observers,
+                      Viewshed **viewsheds, size_t count)
+{
+	TRACE_SCOPE("Viewshed::compute");
+
+	for (size_t i = 0; i < count; ++i) {
+		const ViewshedObserver &observer = observers[i];
+
+		if (viewsheds[i]->m_width != map->width || viewsheds[i]->m_height != map->height) {
+			printf("Viewshed is %zu x %zu but the heightmap %zu x %zu\n",
+			       viewsheds[i]->m_width, viewsheds[i]->m_height, map->width, map->height);
+			return -1;
+		}
+
+		if (observer.x < 0 || observer.y < 0 ||
+		    (size_t) observer.x >= map->width || (size_t) observer.y >= map->height) {
+			printf("Observer (%d, %d) is outside the heightmap\n", observer.x, observer.y);
+			return -1;
+		}
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		viewsheds[i]->clear();
+		viewsheds[i]->setVisible(observers[i].x, observers[i].y);
+	}
+
+	// octants take very different times with off-center observers, so
+	// each is a task of its own.
+	TaskScheduler::instance()->parallelFor(0, count*OCTANT_COUNT, 1,
+		[=](size_t begin, size_t end) {
+			for (size_t task = begin; task < end; ++task) {
+				size_t i = task / OCTANT_COUNT;
+				viewsheds[i]->computeOctant(map, observers[i], task % OCTANT_COUNT);
+			}
+		});
+
+	return 0;
+}
+
+void Viewshed::computeOctant(const Heightmap *map, const ViewshedObserver &observer, int octant)
+{
+	TRACE_SCOPE("Viewshed::computeOctant");
+
+	const bool rows = octant & OCTANT_ROWS;
+	const long sx = (octant & OCTANT_MIRROR_X) ? -1 : 1;
+	const long sy = (octant & OCTANT_MIRROR_Y) ? -1 : 1;
+	const long ox = observer.x, oy = observer.y;
+
+	// rows are map->height apart, see Heightmap_get.
+	const size_t mapStride = map->height;
+
+	// a ring is the column (or row) of cells k steps away from the
+	// observer, and j counts the cells along it from the axis.
+	const long maxX = sx > 0 ? (long) map->width - 1 - ox : ox;
+	const long maxY = sy > 0 ? (long) map->height - 1 - oy : oy;
+	long maxK = rows ? maxY : maxX;
+	const long maxJ = rows ? maxX : maxY;
+	if (observer.radius > 0) {
+		maxK = std::min<long>(maxK, observer.radius);
+	}
+
+	if (maxK < 1) {
+		return;
+	}
+
+	// one step along the ring and one ring outwards in the heightmap.
+	const long mapStepJ = rows ? sx : sy*(long) mapStride;
+	const long mapStepK = rows ? sy*(long) mapStride : sx;
+
+	const float eye = map->map[oy*mapStride + ox] + observer.observerHeight;
+	const float target = observer.targetHeight;
+
+	// height the line of sight has to clear at the cells of the previous
+	// and current ring.
+	std::vector<float> previous(maxK + 2), current(maxK + 2);
+
+	// visible bits not yet written to the bitmap. With rings along rows
+	// they gather in one word per ring, otherwise in one word per row
+	// until the rings move to the next word.
+	std::vector<uint64_t> pending(rows ? 0 : maxK + 1, 0);
+	long pendingWord = -1;
+	long pendingCount = 0;
+
+	// heights of a block of rings across rows, ring after ring.
+	const long blockStride = std::min(maxK, maxJ) + 1;
+	std::vector<float> block(rows ? 0 : RING_BLOCK*blockStride);
+
+	for (long k = 1; k <= maxK; ++k) {
+		const long count = std::min(k, maxJ) + 1;
+		const float *ringHeights = &map->map[oy*mapStride + ox + k*mapStepK];
+		long ringStep = mapStepJ;
+
+		if (!rows) {
+			const long first = k - (k - 1) % RING_BLOCK;
+
+			if (k == first) {
+				const long rings = std::min<long>(RING_BLOCK, maxK - k + 1);
+				const long cells = std::min(k + rings - 1, maxJ) + 1;
+
+				for (long j = 0; j < cells; ++j) {
+					const float *cell = &map->map[(oy + sy*j)*mapStride + ox + sx*k];
+					for (long r = 0; r < rings; ++r) {
+						block[r*blockStride + j] = cell[r*sx];
+					}
+				}
+			}
+
+			ringHeights = &block[(k - first)*blockStride];
+			ringStep = 1;
+		}
+
+		// line of sight through the previous ring extended by k/(k-1).
+		const float scale = k > 1 ? (float) k / (k - 1) : 0;
+
+		// the ray to cell j crosses the previous ring at j*(k-1)/k, which is
+		// cell j0 plus remainder/k.
+		long j0 = 0, remainder = 0;
+		const float invK = 1.0f / k;
+
+		// bitmap word of the ring, or of the cell along the ring.
+		const long x = ox + sx*k, y = oy + sy*k;
+		uint64_t *row = rows ? &m_bits[y*m_stride] : NULL;
+		long word = rows ? -1 : x/64;
+		uint64_t bits = 0;
+
+		if (!rows && word != pendingWord) {
+			for (long j = 0; j < pendingCount; ++j) {
+				or_word(&m_bits[(oy + sy*j)*m_stride + pendingWord], pending[j]);
+				pending[j] = 0;
+			}
+			pendingWord = word;
+		}
+		if (!rows) {
+			pendingCount = count;
+		}
+
+		for (long j = 0; j < count; ++j) {
+			const float z = ringHeights[j*ringStep];
+			float clear = z;
+			bool visible = true;
+
+			if (k > 1) {
+				float before = previous[j0];
+				if (remainder) {
+					before += (previous[j0 + 1] - before)*(remainder*invK);
+				}
+				const float sight = eye + (before - eye)*scale;
+				visible = z + target >= sight;
+				clear = std::max(z, sight);
+			}
+
+			current[j] = clear;
+
+			remainder += k - 1;
+			if (remainder >= k) {
+				remainder -= k;
+				j0++;
+			}
+
+			if (!visible) {
+				continue;
+			}
+
+			if (rows) {
+				const long cellX = ox + sx*j;
+				if (cellX/64 != word) {
+					if (word >= 0) {
+						or_word(&row[word], bits);
+					}
+					word = cellX/64;
+					bits = 0;
+				}
+				bits |= (uint64_t) 1 << (cellX%64);
+			} else {
+				pending[j] |= (uint64_t) 1 << (x%64);
+			}
+		}
+
+		if (rows && word >= 0) {
+			or_word(&row[word], bits);
+		}
+
+		previous.swap(current);
+	}
+
+	for (long j = 0; j < pendingCount; ++j) {
+		or_word(&m_bits[(oy + sy*j)*m_stride + pendingWord], pending[j]);
+	}
+}
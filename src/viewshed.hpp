@@ -0,0 +1,129 @@
+#ifndef VIEWSHED_HPP
+#define VIEWSHED_HPP
+
+#include "heightmap.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ViewshedObserver
+{
+	// grid position of the observer.
+	int x, y;
+
+	// height of the observer's eye and of the targets above the terrain,
+	// in heightmap units.
+	float observerHeight;
+	float targetHeight;
+
+	// cells farther away (in grid cells along x or y) are not visible,
+	// 0 for no limit.
+	int radius;
+
+	ViewshedObserver(int x = 0, int y = 0, float observerHeight = 0.01f,
+	                 float targetHeight = 0, int radius = 0)
+		: x(x)
+		, y(y)
+		, observerHeight(observerHeight)
+		, targetHeight(targetHeight)
+		, radius(radius)
+	{
+	}
+};
+
+/**
+ * Visibility bitmap of heightmap cells, one bit per cell.
+ *
+ * Computed with a sweep outwards from the observer (XDraw): the plane is
+ * split into 8 octants, and in each octant the cells are visited in rings
+ * of growing distance. Every cell keeps the height the line of sight has
+ * to clear there, interpolated from the two cells of the previous ring
+ * the ray passes between. So a cell is visited once and the whole map
+ * costs O(width*height), the interpolation makes it approximate. The
+ * octants are independent and computed in parallel.
+ */
+class Viewshed
+{
+private:
+	size_t m_width, m_height;
+
+	// row stride in words, rows start on their own word.
+	size_t m_stride;
+	uint64_t *m_bits;
+
+	Viewshed(const Viewshed &);
+	Viewshed &operator=(const Viewshed &);
+
+public:
+	Viewshed(size_t width, size_t height);
+	~Viewshed();
+
+	/**
+	 * Compute the visibility of every cell from the observer, replacing
+	 * the current bitmap.
+	 *
+	 * @param map of the same size as the viewshed
+	 * @param observer inside the map
+	 * @return 0 on success, -1 if the map or observer doesn't fit.
+	 */
+	int compute(const Heightmap *map, const ViewshedObserver &observer);
+
+	/**
+	 * Compute the viewsheds of many observers at once. Octants of all the
+	 * observers are spread over the threads.
+	 *
+	 * @param map
+	 * @param observers
+	 * @param viewsheds one per observer, of the same size as the map
+	 * @param count number of observers
+	 * @return 0 on success, -1 if any map or observer doesn't fit.
+	 */
+	static int compute(const Heightmap *map, const ViewshedObserver *observers,
+	                   Viewshed **viewsheds, size_t count);
+
+	void clear();
+
+	bool isVisible(size_t x, size_t y) const;
+
+	size_t countVisible() const;
+
+	size_t getWidth() const;
+	size_t getHeight() const;
+
+	/**
+	 * Bits of row y, bit x%64 of word x/64 is cell (x, y).
+	 */
+	const uint64_t *getRow(size_t y) const;
+
+private:
+	/**
+	 * Sweep one octant.
+	 *
+	 * @param octant bit 0: mirror x, bit 1: mirror y, bit 2: rings are rows
+	 */
+	void computeOctant(const Heightmap *map, const ViewshedObserver &observer, int octant);
+
+	void setVisible(size_t x, size_t y);
+};
+
+inline bool Viewshed::isVisible(size_t x, size_t y) const
+{
+	return (m_bits[y*m_stride + x/64] >> (x%64)) & 1;
+}
+
+inline size_t Viewshed::getWidth() const
+{
+	return m_width;
+}
+
+inline size_t Viewshed::getHeight() const
+{
+	return m_height;
+}
+
+inline const uint64_t *Viewshed::getRow(size_t y) const
+{
+	return &m_bits[y*m_stride];
+}
+
+#endif // VIEWSHED_HPP
@@ -0,0 +1,533 @@
+/*
+ * Offline conversion of heightmap rasters, also ones far larger than
+ * memory, into tiles ROAM loads directly, see terrain_tile.h.
+ *
+ * The raster is streamed twice. The first pass finds the height range and,
+ * for text heightmaps, converts the heights into a temporary raw file. The
+ * second cuts that into tiles of 2^n + 1 grid points sharing their edges,
+ * and normalizes the heights, calculates normals, variance trees, height
+ * bounds and a decimated pyramid of each tile. Tiles are baked in parallel,
+ * as many at a time as fit into the memory ceiling.
+ *
+ *   ./roam-bake map.txt tiles --tile 10 --memory 2048
+ *   ./ROAM tiles/tile_0_0.rtile
+ */
+#include "cpu_features.h"
+#include "heightmap.h"
+#include "task_scheduler.hpp"
+#include "terrain_data.hpp"
+#include "terrain_patch.hpp"
+#include "terrain_tile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// bytes of heightmap text parsed per task.
+#define PARSE_GRAIN (4 << 20)
+
+// largest read while scanning a raw raster.
+#define SCAN_CHUNK (64 << 20)
+
+struct BakeOptions
+{
+	const char *input;
+	const char *output;
+
+	// size of a raw float raster, 0 for a text heightmap.
+	size_t rawWidth, rawHeight;
+
+	// tiles are 2^tileLevels + 1 grid points wide.
+	int tileLevels;
+
+	// levels of the variance trees, see TerrainData::computeVariance().
+	int varianceLevels;
+
+	// bytes the heights, tiles and buffers may take at a time.
+	size_t memory;
+
+	BakeOptions()
+		: input(NULL)
+		, output(NULL)
+		, rawWidth(0)
+		, rawHeight(0)
+		, tileLevels(10)
+		, varianceLevels(14)
+		, memory((size_t) 1024 << 20)
+	{
+	}
+};
+
+/**
+ * Raw float raster the tiles are cut from, rows first.
+ */
+struct Raster
+{
+	int fd;
+	size_t width, height;
+	float minZ, maxZ;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s <heightmap> <output_dir> [options]\n", name);
+	printf("\n");
+	printf("Cuts the heightmap into tiles <output_dir>/tile_<x>_<y>.rtile.\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  --raw <w>x<h>   heightmap is raw native floats instead of text\n");
+	printf("  --tile <n>      tiles of 2^n + 1 grid points per side (default 10)\n");
+	printf("  --levels <n>    variance tree levels (default 14)\n");
+	printf("  --memory <MB>   memory ceiling (default 1024)\n");
+	printf("  --threads <n>   threads baking tiles (default one per CPU)\n");
+}
+
+/**
+ * Parse the text heightmap into a raw file, a few pieces at a time so
+ * that only those are in memory.
+ */
+static int convert_text(const BakeOptions &options, const char *rawPath, Raster *raster)
+{
+	HeightmapFile file;
+	if (Heightmap_open_file(&file, options.input) != 0) {
+		return -1;
+	}
+
+	FILE *out = fopen(rawPath, "wb");
+	if (!out) {
+		printf("Unable to create file %s : %s\n", rawPath, strerror(errno));
+		Heightmap_close_file(&file);
+		return -1;
+	}
+
+	TaskScheduler *scheduler = TaskScheduler::instance();
+	const size_t pieces = std::max<size_t>((file.text + file.size - file.values) / PARSE_GRAIN, 1);
+
+	// a piece takes its text and a float per two bytes of it at most.
+	const size_t group = std::max<size_t>(std::min(options.memory / (3*PARSE_GRAIN),
+	                                               2*scheduler->threadCount()), 1);
+	const long page = sysconf(_SC_PAGESIZE);
+
+	std::vector<std::vector<float> > heights(group);
+	std::vector<float> minZ(group), maxZ(group);
+	std::atomic<bool> failed(false);
+	size_t written = 0;
+
+	raster->minZ = FLT_MAX;
+	raster->maxZ = -FLT_MAX;
+
+	for (size_t first = 0; first < pieces && !failed; first += group) {
+		const size_t count = std::min(group, pieces - first);
+
+		scheduler->parallelFor(0, count, 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				const char *p0 = Heightmap_split_values(&file, first + i, pieces);
+				const char *p1 = Heightmap_split_values(&file, first + i + 1, pieces);
+
+				heights[i].resize(Heightmap_count_values(p0, p1));
+				minZ[i] = FLT_MAX;
+				maxZ[i] = -FLT_MAX;
+				if (!heights[i].empty() &&
+				    Heightmap_parse_values(p0, p1, &heights[i][0], &minZ[i], &maxZ[i]) != 0) {
+					failed = true;
+				}
+			}
+		});
+
+		for (size_t i = 0; i < count && !failed; ++i) {
+			if (fwrite(heights[i].data(), sizeof(float), heights[i].size(), out) != heights[i].size()) {
+				printf("Unable to write file %s : %s\n", rawPath, strerror(errno));
+				failed = true;
+			}
+			written += heights[i].size();
+			raster->minZ = std::min(raster->minZ, minZ[i]);
+			raster->maxZ = std::max(raster->maxZ, maxZ[i]);
+		}
+
+		// the parsed text isn't needed anymore.
+		const char *done = Heightmap_split_values(&file, first + count, pieces);
+		const size_t length = (done - file.text) / page * page;
+		if (length > 0) {
+			madvise((void *) file.text, length, MADV_DONTNEED);
+		}
+	}
+
+	raster->width = file.width;
+	raster->height = file.height;
+	Heightmap_close_file(&file);
+
+	if (fclose(out) != 0 && !failed) {
+		printf("Unable to write file %s : %s\n", rawPath, strerror(errno));
+		failed = true;
+	}
+
+	if (!failed && written != raster->width*raster->height) {
+		printf("Heightmap %s has %zu heights instead of %zu x %zu\n",
+		       options.input, written, raster->width, raster->height);
+		failed = true;
+	}
+
+	if (failed) {
+		return -1;
+	}
+
+	raster->fd = open(rawPath, O_RDONLY);
+	if (raster->fd < 0) {
+		printf("Unable to open file %s : %s\n", rawPath, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Find the height range of a raw raster.
+ */
+static int scan_raw(const BakeOptions &options, Raster *raster)
+{
+	raster->width = options.rawWidth;
+	raster->height = options.rawHeight;
+
+	raster->fd = open(options.input, O_RDONLY);
+	if (raster->fd < 0) {
+		printf("Unable to open file %s : %s\n", options.input, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	const size_t total = raster->width*raster->height;
+	if (fstat(raster->fd, &st) != 0 || (size_t) st.st_size != sizeof(float)*total) {
+		printf("Raster %s isn't %zu x %zu floats\n", options.input, raster->width, raster->height);
+		close(raster->fd);
+		return -1;
+	}
+
+	std::vector<float> chunk(std::max<size_t>(std::min<size_t>(options.memory, SCAN_CHUNK) / sizeof(float), 1));
+
+	raster->minZ = FLT_MAX;
+	raster->maxZ = -FLT_MAX;
+
+	for (size_t offset = 0; offset < total; offset += chunk.size()) {
+		const size_t count = std::min(chunk.size(), total - offset);
+		const ssize_t bytes = sizeof(float)*count;
+		if (pread(raster->fd, &chunk[0], bytes, sizeof(float)*offset) != bytes) {
+			printf("Unable to read file %s : %s\n", options.input, strerror(errno));
+			close(raster->fd);
+			return -1;
+		}
+
+		for (size_t i = 0; i < count; ++i) {
+			raster->minZ = std::min(raster->minZ, chunk[i]);
+			raster->maxZ = std::max(raster->maxZ, chunk[i]);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Bytes a tile of the given size takes while it is baked.
+ */
+static size_t tile_memory(size_t size, int varianceLevels)
+{
+	const size_t apron = (size + 2)*(size + 2);
+	const size_t points = size*size;
+
+	// apron and tile heights and normals, height bounds and the pyramid
+	// are about two and a third floats per point.
+	return sizeof(float)*(4*apron + 4*points + 3*points + 2*((size_t) 2 << varianceLevels));
+}
+
+/**
+ * Read the heights of the grid points (x0 + x, y0 + y) into the square
+ * map, clamping to the raster.
+ */
+static int read_window(const Raster &raster, long x0, long y0, Heightmap *map,
+                       std::vector<float> &row)
+{
+	const long lastX = raster.width - 1;
+	const long lastY = raster.height - 1;
+	const long size = map->width;
+
+	const long cx0 = std::min(std::max(x0, 0L), lastX);
+	const long cx1 = std::min(std::max(x0 + size - 1, 0L), lastX);
+	row.resize(cx1 - cx0 + 1);
+
+	for (long y = 0; y < size; ++y) {
+		const long sy = std::min(std::max(y0 + y, 0L), lastY);
+		const ssize_t bytes = sizeof(float)*row.size();
+		if (pread(raster.fd, &row[0], bytes, sizeof(float)*(sy*raster.width + cx0)) != bytes) {
+			printf("Unable to read raster : %s\n", strerror(errno));
+			return -1;
+		}
+
+		float *out = map->map + map->height*y;
+		for (long x = 0; x < size; ++x) {
+			out[x] = row[std::min(std::max(x0 + x, cx0), cx1) - cx0];
+		}
+	}
+
+	return 0;
+}
+
+static int bake_tile(const BakeOptions &options, const Raster &raster,
+                     size_t tileX, size_t tileY, size_t tilesX, size_t tilesY)
+{
+	const size_t step = (size_t) 1 << options.tileLevels;
+	const size_t size = step + 1;
+	const long x0 = tileX*step;
+	const long y0 = tileY*step;
+	std::vector<float> row;
+
+	// normals of the edge need the grid points around the tile.
+	Heightmap *apron = Heightmap_create(size + 2, size + 2);
+	if (apron == NULL) {
+		return -1;
+	}
+
+	if (read_window(raster, x0 - 1, y0 - 1, apron, row) != 0 ||
+	    Heightmap_allocate_normals(apron) != 0) {
+		Heightmap_delete(apron);
+		return -1;
+	}
+
+	size_t histogram[HEIGHTMAP_HISTOGRAM_BINS];
+	apron->maxZ = raster.maxZ;
+	if (Heightmap_preprocess_rows(apron, 0, apron->height, histogram) != 0) {
+		Heightmap_delete(apron);
+		return -1;
+	}
+
+	Heightmap *map = Heightmap_create(size, size);
+	if (map == NULL || Heightmap_allocate_normals(map) != 0 ||
+	    read_window(raster, x0, y0, map, row) != 0) {
+		if (map) {
+			Heightmap_delete(map);
+		}
+		Heightmap_delete(apron);
+		return -1;
+	}
+
+	// heights like the whole raster were loaded, so tiles fit together.
+	for (size_t i = 0; i < size*size; ++i) {
+		map->minZ = std::min(map->minZ, map->map[i]);
+	}
+	map->maxZ = raster.maxZ;
+	Heightmap_normalize(map);
+
+	for (size_t y = 0; y < size; ++y) {
+		memcpy(map->normal_map + 3*size*y, apron->normal_map + 3*((size + 2)*(y + 1) + 1),
+		       3*size*sizeof(float));
+
+		// flat along the edges of the raster, like Heightmap_calculate_normals().
+		for (size_t x = 0; x < size; ++x) {
+			const size_t sx = x0 + x;
+			const size_t sy = y0 + y;
+			if (sx == 0 || sy == 0 || sx >= raster.width - 1 || sy >= raster.height - 1) {
+				float *normal = map->normal_map + 3*(size*y + x);
+				normal[0] = 0;
+				normal[1] = 0;
+				normal[2] = 1;
+			}
+		}
+	}
+
+	Heightmap_delete(apron);
+
+	TerrainData *data = TerrainData::create(map);
+	data->computeVariance(options.varianceLevels);
+
+	TerrainTileHeader header;
+	memset(&header, 0, sizeof(header));
+	header.size = size;
+	header.tile_x = tileX;
+	header.tile_y = tileY;
+	header.tiles_x = tilesX;
+	header.tiles_y = tilesY;
+	header.variance_levels = options.varianceLevels;
+	header.pyramid_levels = options.tileLevels;
+	header.variance_size = data->getVarianceSize();
+	header.bounds_size = data->getHeightBoundsSize();
+	header.min_z = map->minZ;
+	header.max_z = map->maxZ;
+	header.source_min_z = raster.minZ;
+	header.source_max_z = raster.maxZ;
+	for (size_t i = 0; i < HEIGHTMAP_HISTOGRAM_BINS; ++i) {
+		header.histogram[i] = map->histogram[i];
+	}
+
+	// every other grid point of the tile, then of that and so on.
+	std::vector<float> pyramid;
+	for (size_t level = 1; level < header.pyramid_levels; ++level) {
+		const size_t levelSize = TerrainTile_level_size(&header, level);
+		for (size_t y = 0; y < levelSize; ++y) {
+			for (size_t x = 0; x < levelSize; ++x) {
+				pyramid.push_back(map->map[size*(y << level) + (x << level)]);
+			}
+		}
+	}
+
+	char filename[4096];
+	snprintf(filename, sizeof(filename), "%s/tile_%zu_%zu.rtile", options.output, tileX, tileY);
+
+	int result = TerrainTile_write(filename, &header, map->map, map->normal_map,
+	                               data->getLeftVariance(), data->getRightVariance(),
+	                               data->getHeightBounds(), pyramid.data());
+	data->release();
+
+	return result;
+}
+
+static int bake(const BakeOptions &options)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	if (mkdir(options.output, 0755) != 0 && errno != EEXIST) {
+		printf("Unable to create directory %s : %s\n", options.output, strerror(errno));
+		return -1;
+	}
+
+	const size_t size = ((size_t) 1 << options.tileLevels) + 1;
+	const size_t perTile = tile_memory(size, options.varianceLevels);
+	if (perTile > options.memory) {
+		printf("A tile of %zu x %zu takes %zu MB, more than the memory ceiling\n",
+		       size, size, perTile >> 20);
+		return -1;
+	}
+
+	Raster raster;
+	std::string rawPath;
+
+	if (options.rawWidth) {
+		if (scan_raw(options, &raster) != 0) {
+			return -1;
+		}
+	} else {
+		rawPath = std::string(options.output) + "/heights.raw";
+		if (convert_text(options, rawPath.c_str(), &raster) != 0) {
+			unlink(rawPath.c_str());
+			return -1;
+		}
+	}
+
+	printf("%s: %zu x %zu, heights %f - %f, read in %.1f s\n", options.input,
+	       raster.width, raster.height, raster.minZ, raster.maxZ, seconds_since(start));
+
+	const size_t step = size - 1;
+	const size_t tilesX = std::max<size_t>((raster.width - 2) / step + 1, 1);
+	const size_t tilesY = std::max<size_t>((raster.height - 2) / step + 1, 1);
+	const size_t tiles = tilesX*tilesY;
+
+	TaskScheduler *scheduler = TaskScheduler::instance();
+	const size_t slots = std::min(std::min(options.memory / perTile, scheduler->threadCount()), tiles);
+
+	printf("baking %zu x %zu tiles of %zu x %zu, %zu at a time\n", tilesX, tilesY, size, size, slots);
+
+	// every slot bakes one tile after the other, which bounds the memory
+	// even while waiting threads run other slots.
+	std::atomic<size_t> next(0);
+	std::atomic<size_t> done(0);
+	std::atomic<bool> failed(false);
+
+	scheduler->parallelFor(0, slots, 1, [&](size_t begin, size_t end) {
+		for (size_t slot = begin; slot < end; ++slot) {
+			size_t tile;
+			while (!failed && (tile = next.fetch_add(1)) < tiles) {
+				if (bake_tile(options, raster, tile % tilesX, tile / tilesX, tilesX, tilesY) != 0) {
+					failed = true;
+					break;
+				}
+				printf("tile %zu / %zu\n", done.fetch_add(1) + 1, tiles);
+			}
+		}
+	});
+
+	close(raster.fd);
+	if (!rawPath.empty()) {
+		unlink(rawPath.c_str());
+	}
+
+	if (failed) {
+		return -1;
+	}
+
+	printf("baked %zu tiles into %s in %.1f s\n", tiles, options.output, seconds_since(start));
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	BakeOptions options;
+	options.input = argv[1];
+	options.output = argv[2];
+
+	for (int i = 3; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		if (strcmp(argv[i], "--raw") == 0) {
+			if (sscanf(argv[++i], "%zux%zu", &options.rawWidth, &options.rawHeight) != 2 ||
+			    options.rawWidth < 2 || options.rawHeight < 2) {
+				usage(argv[0]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--tile") == 0) {
+			options.tileLevels = atoi(argv[++i]);
+			if (options.tileLevels < 1 || options.tileLevels > 15) {
+				usage(argv[0]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--levels") == 0) {
+			options.varianceLevels = atoi(argv[++i]);
+			if (options.varianceLevels < 1 ||
+			    options.varianceLevels + 2 > PATH_CODE_PATH_BITS) {
+				usage(argv[0]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--memory") == 0) {
+			options.memory = strtoull(argv[++i], NULL, 10) << 20;
+			if (options.memory == 0) {
+				usage(argv[0]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--threads") == 0) {
+			long threads = strtol(argv[++i], NULL, 10);
+			if (threads <= 0 || TaskScheduler::init(threads) != 0) {
+				usage(argv[0]);
+				return -1;
+			}
+		} else {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	// resolved once here, the tiles' kernels run on several threads.
+	CpuFeatures_level();
+
+	return bake(options) == 0 ? 0 : -1;
+}